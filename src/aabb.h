@@ -0,0 +1,108 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "real_type.h"
+#include "vec3.h"
+#include "ray.h"
+
+/**
+ * Axis-aligned bounding box. Default constructed boxes are empty, so they
+ * can be grown with expand() without special-casing the first point.
+ */
+class aabb
+{
+public:
+    aabb()
+    :   _min(big, big, big)
+    ,   _max(-big, -big, -big)
+    {}
+
+    aabb(const position& pmin, const position& pmax)
+    :   _min(pmin)
+    ,   _max(pmax)
+    {}
+
+    const position& min() const { return _min; }
+    const position& max() const { return _max; }
+
+    bool empty() const
+    {
+        return _min.x > _max.x || _min.y > _max.y || _min.z > _max.z;
+    }
+
+    position centroid() const
+    {
+        return 0.5 * (_min + _max);
+    }
+
+    direction extent() const
+    {
+        return _max - _min;
+    }
+
+    real_t surface_area() const
+    {
+        if (empty())
+            return 0.0;
+
+        const direction e = extent();
+        return 2.0 * (e.x*e.y + e.y*e.z + e.z*e.x);
+    }
+
+    aabb& expand(const position& p)
+    {
+        _min = position(std::min(_min.x, p.x), std::min(_min.y, p.y), std::min(_min.z, p.z));
+        _max = position(std::max(_max.x, p.x), std::max(_max.y, p.y), std::max(_max.z, p.z));
+        return *this;
+    }
+
+    aabb& expand(const aabb& b)
+    {
+        if (b.empty())
+            return *this;
+        return expand(b._min).expand(b._max);
+    }
+
+    // Slab test. inv_dir is the component-wise reciprocal of the ray direction.
+    bool hit(const position& origin, const direction& inv_dir, real_t t_min, real_t t_max) const
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const real_t o = component(origin, axis);
+            const real_t inv = component(inv_dir, axis);
+            real_t t0 = (component(_min, axis) - o) * inv;
+            real_t t1 = (component(_max, axis) - o) * inv;
+            if (inv < 0.0)
+                std::swap(t0, t1);
+
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+
+        return true;
+    }
+
+    static real_t component(const position& p, int axis)
+    {
+        return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+    }
+
+private:
+    static constexpr real_t big = std::numeric_limits<real_t>::max();
+
+    position _min;
+    position _max;
+};
+
+inline aabb surrounding_box(aabb a, const aabb& b)
+{
+    return a.expand(b);
+}
+
+#endif
\ No newline at end of file
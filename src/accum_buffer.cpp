@@ -0,0 +1,198 @@
+#include "accum_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+
+constexpr char file_magic[4] = { 'A', 'T', 'A', 'B' };
+constexpr std::uint32_t file_version = 2;
+
+// Followed by sample_range[num_ranges], then the pixels row by row
+struct file_header
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t width;
+    std::uint64_t height;
+    std::uint64_t num_ranges;
+};
+
+static_assert(sizeof(accum_pixel) == 16 && sizeof(sample_range) == 48, "Accumulation buffer records must not be padded");
+
+bool overlap(std::uint64_t first_a, std::uint64_t end_a, std::uint64_t first_b, std::uint64_t end_b)
+{
+    return first_a < end_b && first_b < end_a;
+}
+
+// Whether a and b would count some of the same samples twice
+bool overlap(const sample_range& a, const sample_range& b)
+{
+    return a.source.sampler == b.source.sampler && a.source.seed_offset == b.source.seed_offset
+            && overlap(a.source.first_sample, a.end_sample, b.source.first_sample, b.end_sample)
+            && overlap(a.first_tile, a.end_tile, b.first_tile, b.end_tile);
+}
+
+} /* Anonymous namespace */
+
+accumulation_buffer::accumulation_buffer(std::size_t width, std::size_t height)
+:   _width(width)
+,   _height(height)
+,   _pixels(width * height, accum_pixel{ { 0.0f, 0.0f, 0.0f }, 0 })
+{
+}
+
+accumulation_buffer::accumulation_buffer(const sample_buffer& samples, const sample_range& range)
+:   accumulation_buffer(samples.width(), samples.height())
+{
+    _ranges.push_back(range);
+    for (std::size_t y = 0; y < _height; ++y)
+    {
+        for (std::size_t x = 0; x < _width; ++x)
+        {
+            const pixel_stats& s = samples.stats(x, y);
+            const colour sum = s.mean * static_cast<real_t>(s.count);
+            accum_pixel& p = _pixels[y * _width + x];
+            p.sum[0] = static_cast<float>(sum.x);
+            p.sum[1] = static_cast<float>(sum.y);
+            p.sum[2] = static_cast<float>(sum.z);
+            p.count = s.count;
+        }
+    }
+}
+
+void accumulation_buffer::add(const accumulation_buffer& other)
+{
+    if (other._width != _width || other._height != _height)
+        throw std::runtime_error("Accumulation buffers are different sizes");
+
+    for (const sample_range& a : _ranges)
+    {
+        for (const sample_range& b : other._ranges)
+        {
+            if (a.source.scene != b.source.scene)
+                throw std::runtime_error("Accumulation buffers are renders of different scenes");
+            if (overlap(a, b))
+                throw std::runtime_error("Accumulation buffers both have samples "
+                        + std::to_string(std::max(a.source.first_sample, b.source.first_sample)) + " to "
+                        + std::to_string(std::min(a.end_sample, b.end_sample) - 1) + " of tile "
+                        + std::to_string(std::max(a.first_tile, b.first_tile))
+                        + "; give one a different --seed-offset");
+        }
+    }
+
+    for (std::size_t i = 0; i < _pixels.size(); ++i)
+    {
+        accum_pixel& p = _pixels[i];
+        const accum_pixel& q = other._pixels[i];
+        if (q.count > std::numeric_limits<std::uint32_t>::max() - p.count)
+            throw std::runtime_error("Too many samples in one pixel");
+
+        for (int c = 0; c < 3; ++c)
+            p.sum[c] += q.sum[c];
+        p.count += q.count;
+    }
+
+    _ranges.insert(_ranges.end(), other._ranges.begin(), other._ranges.end());
+}
+
+std::uint64_t accumulation_buffer::total_count() const
+{
+    std::uint64_t n = 0;
+    for (const accum_pixel& p : _pixels)
+        n += p.count;
+    return n;
+}
+
+std::size_t accumulation_buffer::empty_pixels() const
+{
+    std::size_t n = 0;
+    for (const accum_pixel& p : _pixels)
+        n += p.count == 0;
+    return n;
+}
+
+image accumulation_buffer::resolve() const
+{
+    image img(_width, _height);
+    for (std::size_t y = 0; y < _height; ++y)
+    {
+        for (std::size_t x = 0; x < _width; ++x)
+        {
+            const accum_pixel& p = _pixels[y * _width + x];
+            if (p.count > 0)
+            {
+                const real_t n = p.count;
+                img.at(x, y) = colour(p.sum[0] / n, p.sum[1] / n, p.sum[2] / n);
+            }
+            else
+                img.at(x, y) = colour(0.0, 0.0, 0.0);
+        }
+    }
+
+    return img;
+}
+
+void accumulation_buffer::save(const std::string& filename) const
+{
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Cannot open " + filename);
+
+    file_header header = {};
+    std::memcpy(header.magic, file_magic, sizeof(file_magic));
+    header.version = file_version;
+    header.width = _width;
+    header.height = _height;
+    header.num_ranges = _ranges.size();
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(_ranges.data()), _ranges.size() * sizeof(sample_range));
+    out.write(reinterpret_cast<const char*>(_pixels.data()), _pixels.size() * sizeof(accum_pixel));
+    out.flush();
+    if (!out)
+        throw std::runtime_error("Failed to write " + filename);
+}
+
+accumulation_buffer accumulation_buffer::load(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open " + filename);
+
+    file_header header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 || header.version != file_version)
+        throw std::runtime_error("Not an accumulation buffer: " + filename);
+
+    const std::uint64_t max_pixels = std::numeric_limits<std::uint32_t>::max();
+    // Each side is checked before multiplying, so the product cannot wrap
+    if (header.width == 0 || header.height == 0 || header.width > max_pixels || header.height > max_pixels
+            || header.width * header.height > max_pixels)
+        throw std::runtime_error("Bad accumulation buffer dimensions: " + filename);
+
+    // The ranges and pixels must fill the rest of the file exactly
+    const std::streamoff start = in.tellg();
+    in.seekg(0, std::ios::end);
+    const std::uint64_t size = static_cast<std::uint64_t>(in.tellg() - start);
+    in.seekg(start);
+    const std::uint64_t pixel_bytes = header.width * header.height * sizeof(accum_pixel);
+    if (size < pixel_bytes)
+        throw std::runtime_error("Truncated accumulation buffer: " + filename);
+    if (header.num_ranges != (size - pixel_bytes) / sizeof(sample_range))
+        throw std::runtime_error("Bad accumulation buffer range count: " + filename);
+
+    accumulation_buffer buf(header.width, header.height);
+    buf._ranges.resize(header.num_ranges);
+    in.read(reinterpret_cast<char*>(buf._ranges.data()), buf._ranges.size() * sizeof(sample_range));
+    in.read(reinterpret_cast<char*>(buf._pixels.data()), buf._pixels.size() * sizeof(accum_pixel));
+    if (!in)
+        throw std::runtime_error("Truncated accumulation buffer: " + filename);
+
+    return buf;
+}
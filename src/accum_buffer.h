@@ -0,0 +1,80 @@
+#ifndef ACCUM_BUFFER_H
+#define ACCUM_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "sample_buffer.h"
+
+/**
+ * Sum of a pixel's samples and how many there were. Sums are single
+ * precision whatever real_t is, so renders from either build merge.
+ */
+struct accum_pixel
+{
+    float sum[3];
+    std::uint32_t count;
+};
+
+/**
+ * The part of a frame a partial render took: samples
+ * [source.first_sample, end_sample) of each pixel in tiles
+ * [first_tile, end_tile), from source's sampler, seed offset and scene.
+ */
+struct sample_range
+{
+    sample_source source;
+    std::uint32_t end_sample;
+    std::uint32_t reserved;
+    std::uint64_t first_tile;
+    std::uint64_t end_tile;
+};
+
+/**
+ * Raw accumulation buffer for splitting a frame across processes. Each
+ * partial render saves one, covering whatever tiles and samples it took;
+ * buffers of the same size then add together pixel by pixel, in any order,
+ * and resolve to the mean of every sample. Pixels no buffer sampled stay
+ * empty. Each buffer lists the ranges it holds, so the same samples are not
+ * counted twice and only renders of one scene are merged.
+ */
+class accumulation_buffer
+{
+public:
+    accumulation_buffer(std::size_t width, std::size_t height);
+    accumulation_buffer(const sample_buffer& samples, const sample_range& range);
+
+    std::size_t width() const { return _width; }
+    std::size_t height() const { return _height; }
+
+    const accum_pixel& at(std::size_t x, std::size_t y) const { return _pixels[y * _width + x]; }
+    const std::vector<sample_range>& ranges() const { return _ranges; }
+
+    /**
+     * Throws std::runtime_error if the sizes or scenes differ, or if both
+     * buffers have a range with the same sampler and seed offset covering
+     * some of the same samples of the same tiles.
+     */
+    void add(const accumulation_buffer& other);
+
+    std::uint64_t total_count() const;
+    std::size_t empty_pixels() const;
+
+    // Mean radiance per pixel; empty pixels are black
+    image resolve() const;
+
+    // Both throw std::runtime_error on failure
+    void save(const std::string& filename) const;
+    static accumulation_buffer load(const std::string& filename);
+
+private:
+    std::size_t _width;
+    std::size_t _height;
+    std::vector<sample_range> _ranges;
+    std::vector<accum_pixel> _pixels;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include "aov.h"
+
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+
+template <typename FuncT>
+void save_image(const std::string& filename, std::size_t width, std::size_t height, FuncT&& pixel)
+{
+    image img(width, height);
+    colour* out = img.data();
+    for (std::size_t i = 0; i < width * height; ++i)
+        out[i] = pixel(i);
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Cannot open " + filename);
+
+    write_pfm(file, img, 1.0);
+    file.flush();
+    if (!file)
+        throw std::runtime_error("Failed to write " + filename);
+}
+
+} /* Anonymous namespace */
+
+feature_buffer::feature_buffer(std::size_t width, std::size_t height)
+:   _width(width)
+,   _height(height)
+,   _normal(width * height, direction(0.0, 0.0, 0.0))
+,   _depth(width * height, 0.0)
+,   _albedo(width * height, colour(0.0, 0.0, 0.0))
+,   _material_id(width * height, 0)
+,   _count(width * height, 0)
+{
+}
+
+void feature_buffer::add(std::size_t x, std::size_t y, const surface_features& f)
+{
+    const std::size_t i = y * _width + x;
+    const std::uint32_t n = ++_count[i];
+    const real_t w = real_t(1) / static_cast<real_t>(n);
+    _normal[i] += (f.normal - _normal[i]) * w;
+    _depth[i] += (f.depth - _depth[i]) * w;
+    _albedo[i] += (f.albedo - _albedo[i]) * w;
+    if (n == 1)
+        _material_id[i] = f.material_id;
+}
+
+void feature_buffer::save(const std::string& prefix) const
+{
+    save_image(prefix + "-normal.pfm", _width, _height,
+            [&] (std::size_t i) { return colour(_normal[i].x, _normal[i].y, _normal[i].z); });
+    save_image(prefix + "-depth.pfm", _width, _height,
+            [&] (std::size_t i) { return colour(_depth[i], _depth[i], _depth[i]); });
+    save_image(prefix + "-albedo.pfm", _width, _height,
+            [&] (std::size_t i) { return _albedo[i]; });
+    save_image(prefix + "-material.pfm", _width, _height,
+            [&] (std::size_t i)
+            {
+                const real_t id = static_cast<real_t>(_material_id[i]);
+                return colour(id, id, id);
+            });
+}
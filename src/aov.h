@@ -0,0 +1,65 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "real_type.h"
+#include "vec3.h"
+
+/**
+ * What a camera ray sees first: the surface normal facing the ray, the
+ * distance along the ray, the surface colour and the kind of material.
+ * Rays that hit nothing have material ID zero, a zero normal and depth.
+ */
+struct surface_features
+{
+    direction normal = direction(0.0, 0.0, 0.0);
+    real_t depth = 0.0;
+    colour albedo = colour(0.0, 0.0, 0.0);
+    std::uint32_t material_id = 0;  // material_kind plus one
+};
+
+/**
+ * Auxiliary output buffers: per-pixel means of the first-hit normal,
+ * depth and albedo over a few samples, and the material ID of each
+ * pixel's first sample. Each buffer is row-major and stored separately so
+ * filters can stream through one feature at a time.
+ */
+class feature_buffer
+{
+public:
+    feature_buffer(std::size_t width, std::size_t height);
+
+    std::size_t width() const { return _width; }
+    std::size_t height() const { return _height; }
+
+    // Average in one more sample of pixel (x, y)
+    void add(std::size_t x, std::size_t y, const surface_features& f);
+
+    const std::vector<direction>& normals() const { return _normal; }
+    const std::vector<real_t>& depths() const { return _depth; }
+    const std::vector<colour>& albedos() const { return _albedo; }
+    const std::vector<std::uint32_t>& material_ids() const { return _material_id; }
+
+    /**
+     * Write prefix-normal.pfm, prefix-depth.pfm, prefix-albedo.pfm and
+     * prefix-material.pfm. Normals keep their sign, and single-valued
+     * buffers are grey. Throws std::runtime_error on failure.
+     */
+    void save(const std::string& prefix) const;
+
+private:
+    std::size_t _width;
+    std::size_t _height;
+    std::vector<direction> _normal;
+    std::vector<real_t> _depth;
+    std::vector<colour> _albedo;
+    std::vector<std::uint32_t> _material_id;
+    std::vector<std::uint32_t> _count;
+};
+
+#endif
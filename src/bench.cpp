@@ -0,0 +1,518 @@
+#include "vec3.h"
+#include "ray.h"
+#include "camera.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "sphere_set.h"
+#include "droplet_field.h"
+#include "material.h"
+#include "sampler.h"
+#include "spectrum.h"
+#include "rt_utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC
+#endif
+
+/*
+ * Microbenchmarks for the hot kernels. Every workload is generated from a
+ * fixed seed, so runs on the same machine are comparable from build to
+ * build. Each benchmark cycles through a pool of precomputed inputs and is
+ * timed over several repetitions; the fastest repetition is reported.
+ *
+ * Cycles are read from the time stamp counter, which ticks at a constant
+ * reference rate rather than the core clock, so they are only comparable
+ * on the same machine.
+ */
+
+namespace
+{
+
+constexpr std::size_t pool_size = 4096;
+constexpr int repetitions = 5;
+constexpr std::uint32_t workload_seed = 12345;
+
+const dielectric water(refractive_index::water());
+
+struct bench_options
+{
+    std::string filter;
+    std::string output_file;
+    std::string format = "table";
+    double min_time = 0.5;              // Seconds per benchmark
+    std::size_t max_spheres = 1000000;
+    std::size_t max_list_spheres = 10000;
+};
+
+struct result
+{
+    std::string name;
+    std::string kernel;
+    std::size_t spheres;
+    double ns_per_op;
+    double ops_per_sec;
+    double cycles_per_op;
+};
+
+bool selected(const bench_options& opts, const std::string& name)
+{
+    return opts.filter.empty() || name.find(opts.filter) != std::string::npos;
+}
+
+// Keeps results alive so the compiler cannot drop the work
+volatile real_t sink;
+
+std::uint64_t read_cycles()
+{
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Time op(i) for i cycling through [0, pool_size). The batch size grows
+ * until one repetition takes min_time / repetitions. op is inlined into the
+ * timing loops, so cheap kernels are not measured as the cost of a call.
+ */
+template <typename OpT>
+result measure(const std::string& name, const std::string& kernel, std::size_t spheres,
+        double min_time, OpT&& op)
+{
+    using clock = std::chrono::steady_clock;
+    const double rep_time = min_time / repetitions;
+
+    std::size_t batch = pool_size;
+    for (;;)
+    {
+        const auto start = clock::now();
+        real_t acc = 0;
+        for (std::size_t i = 0; i < batch; ++i)
+            acc += op(i % pool_size);
+        sink = acc;
+        const double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        if (elapsed >= rep_time || batch >= (std::size_t(1) << 40))
+            break;
+        batch = elapsed > 0 ? static_cast<std::size_t>(batch * std::min(100.0, 1.2 * rep_time / elapsed)) : batch * 100;
+    }
+
+    double best_seconds = std::numeric_limits<double>::infinity();
+    double best_cycles = 0;
+    for (int rep = 0; rep < repetitions; ++rep)
+    {
+        const auto start = clock::now();
+        const std::uint64_t c0 = read_cycles();
+        real_t acc = 0;
+        for (std::size_t i = 0; i < batch; ++i)
+            acc += op(i % pool_size);
+        const std::uint64_t c1 = read_cycles();
+        sink = acc;
+        const double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        if (elapsed < best_seconds)
+        {
+            best_seconds = elapsed;
+            best_cycles = static_cast<double>(c1 - c0);
+        }
+    }
+
+    return {
+        name,
+        kernel,
+        spheres,
+        1e9 * best_seconds / batch,
+        batch / best_seconds,
+        best_cycles / batch
+    };
+}
+
+// Random rays from the camera, as the first bounce of a render sees them
+std::vector<ray> camera_rays()
+{
+    const camera cam;
+    std::vector<ray> rays;
+    rays.reserve(pool_size);
+    for (std::size_t i = 0; i < pool_size; ++i)
+        rays.push_back(cam.get_ray(random_real(), random_real()));
+    return rays;
+}
+
+/**
+ * n droplets scattered through a slab in front of the camera, sized so
+ * their total cross-section, and so the fraction of camera rays that hit
+ * something, stays about the same whatever n is.
+ */
+std::vector<sphere_set::element> random_droplets(std::size_t n)
+{
+    constexpr real_t half_width = 1.8;
+    constexpr real_t half_height = 1.0;
+    constexpr real_t z_near = -1.0;
+    constexpr real_t z_far = -3.0;
+
+    // n discs of radius r cover a fraction n pi r^2 / A of the far plane
+    const real_t area = 4 * half_width * half_height * (z_far / z_near) * (z_far / z_near);
+    const real_t radius = std::sqrt(0.7 * area / (pi * n));
+
+    std::vector<sphere_set::element> droplets;
+    droplets.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const real_t z = random_real(z_far, z_near);
+        const real_t s = -z / -z_near;
+        const position centre(random_real(-half_width, half_width) * s, random_real(-half_height, half_height) * s, z);
+        droplets.push_back({ centre, radius, &water });
+    }
+
+    return droplets;
+}
+
+real_t hit_distance(const hittable& world, const ray& r)
+{
+    hit_record rec;
+    return world.hit(r, 0.001, infinity, rec) ? rec.t : real_t(0);
+}
+
+void bench_single_sphere(const bench_options& opts, std::vector<result>& results)
+{
+    if (!selected(opts, "sphere::hit"))
+        return;
+
+    seed_random(workload_seed);
+    const sphere s(position(0.0, 0.0, -2.0), 0.5, &water);
+
+    // Aim at a disc a little wider than the sphere, so some rays miss
+    std::vector<ray> rays;
+    for (std::size_t i = 0; i < pool_size; ++i)
+    {
+        const position target(random_real(-0.7, 0.7), random_real(-0.7, 0.7), -2.0);
+        rays.emplace_back(position(0.0, 0.0, 0.0), target);
+    }
+
+    results.push_back(measure("sphere::hit", "scalar", 1, opts.min_time,
+            [&] (std::size_t i) { return hit_distance(s, rays[i]); }));
+}
+
+void bench_scenes(const bench_options& opts, std::vector<result>& results)
+{
+    const bool run_list = selected(opts, "hittable_list::hit");
+    const bool run_bvh = selected(opts, "bvh::hit");
+    const bool run_set = selected(opts, "sphere_set::hit");
+    const bool run_occluded = selected(opts, "sphere_set::occluded");
+    const bool run_field = selected(opts, "droplet_field::hit");
+    if (!run_list && !run_bvh && !run_set && !run_occluded && !run_field)
+        return;
+
+    for (std::size_t n = 10; n <= opts.max_spheres; n *= 10)
+    {
+        seed_random(workload_seed);
+        const std::vector<sphere_set::element> droplets = random_droplets(n);
+        const std::vector<ray> rays = camera_rays();
+
+        if (run_list && n <= opts.max_list_spheres)
+        {
+            hittable_list list;
+            for (const sphere_set::element& d : droplets)
+                list.add(std::make_unique<sphere>(d.centre, d.radius, d.mat));
+
+            results.push_back(measure("hittable_list::hit", "scalar", n, opts.min_time,
+                    [&] (std::size_t i) { return hit_distance(list, rays[i]); }));
+        }
+
+        if (run_bvh)
+        {
+            std::vector<std::unique_ptr<hittable>> objs;
+            for (const sphere_set::element& d : droplets)
+                objs.push_back(std::make_unique<sphere>(d.centre, d.radius, d.mat));
+            const bvh tree(std::move(objs));
+
+            results.push_back(measure("bvh::hit", "scalar", n, opts.min_time,
+                    [&] (std::size_t i) { return hit_distance(tree, rays[i]); }));
+        }
+
+        if (run_set || run_occluded)
+        {
+            const sphere_set set(droplets);
+            if (run_set)
+            {
+                results.push_back(measure("sphere_set::hit", sphere_set::kernel_name(), n, opts.min_time,
+                        [&] (std::size_t i) { return hit_distance(set, rays[i]); }));
+            }
+
+            if (run_occluded)
+            {
+                results.push_back(measure("sphere_set::occluded", sphere_set::kernel_name(), n, opts.min_time,
+                        [&] (std::size_t i) { return set.occluded(rays[i], 0.001, infinity) ? real_t(1) : real_t(0); }));
+            }
+        }
+
+        if (run_field)
+        {
+            std::vector<droplet> packed;
+            packed.reserve(n);
+            for (const sphere_set::element& d : droplets)
+            {
+                packed.push_back({
+                        static_cast<float>(d.centre.x),
+                        static_cast<float>(d.centre.y),
+                        static_cast<float>(d.centre.z),
+                        static_cast<float>(d.radius) });
+            }
+
+            const droplet_field field(std::move(packed), &water);
+            results.push_back(measure("droplet_field::hit", sphere_set::kernel_name(), n, opts.min_time,
+                    [&] (std::size_t i) { return hit_distance(field, rays[i]); }));
+        }
+    }
+}
+
+void bench_scatter(const bench_options& opts, std::vector<result>& results)
+{
+    if (!selected(opts, "dielectric::scatter") && !selected(opts, "refract"))
+        return;
+
+    seed_random(workload_seed);
+    const sphere droplet(position(0.0, 0.0, -2.0), 0.5, &water);
+
+    // Real hits on a droplet, entering and leaving
+    std::vector<ray> rays;
+    std::vector<hit_record> hits;
+    while (rays.size() < pool_size)
+    {
+        const direction offset = random_unit_vector<direction>() * 0.49;
+        const position target = position(0.0, 0.0, -2.0) + offset;
+        const bool inside = random_real() < 0.5;
+        const ray r = inside ? ray(position(0.0, 0.0, -2.0), offset) : ray(position(0.0, 0.0, 0.0), target);
+
+        hit_record rec;
+        if (droplet.hit(r, 0.001, infinity, rec))
+        {
+            rays.push_back(r);
+            hits.push_back(rec);
+        }
+    }
+
+    std::vector<real_t> hero;
+    for (std::size_t i = 0; i < pool_size; ++i)
+        hero.push_back(random_real());
+
+    if (selected(opts, "dielectric::scatter"))
+    {
+        sampler s;
+        results.push_back(measure("dielectric::scatter", "scalar", 0, opts.min_time,
+                [&] (std::size_t i)
+                {
+                    wavelengths lambdas = wavelengths::sample_uniform(hero[i]);
+                    spectral_sample attenuation;
+                    ray scattered;
+                    water.scatter(rays[i], hits[i], lambdas, attenuation, scattered, s);
+                    return scattered.dir().x;
+                }));
+    }
+
+    std::vector<direction> dirs;
+    std::vector<direction> normals;
+    for (std::size_t i = 0; i < pool_size; ++i)
+    {
+        const direction n = random_unit_vector<direction>();
+        direction d = random_unit_vector<direction>();
+        if (dot(d, n) > 0)
+            d = -d;
+        dirs.push_back(d);
+        normals.push_back(n);
+    }
+
+    if (selected(opts, "refract"))
+    {
+        results.push_back(measure("refract", "scalar", 0, opts.min_time,
+                [&] (std::size_t i) { return refract(dirs[i], normals[i], real_t(1.0 / 1.333)).x; }));
+    }
+}
+
+void bench_camera(const bench_options& opts, std::vector<result>& results)
+{
+    if (!selected(opts, "camera::get_ray"))
+        return;
+
+    seed_random(workload_seed);
+    const camera cam;
+    std::vector<real_t> uv;
+    for (std::size_t i = 0; i < 2 * pool_size; ++i)
+        uv.push_back(random_real());
+
+    results.push_back(measure("camera::get_ray", "scalar", 0, opts.min_time,
+            [&] (std::size_t i) { return cam.get_ray(uv[2*i], uv[2*i + 1]).dir().x; }));
+}
+
+// One bounce's dimensions of a fresh sample each time, as a path draws them
+void bench_sampler(const bench_options& opts, std::vector<result>& results)
+{
+    if (!selected(opts, "sampler::get_1d"))
+        return;
+
+    sampler s;
+    results.push_back(measure("sampler::get_1d", "philox", 0, opts.min_time,
+            [&] (std::size_t i)
+            {
+                s.start(i % 600, i / 600 % 337, static_cast<std::uint32_t>(i));
+                s.start_bounce(0);
+                return s.get_1d();
+            }));
+}
+
+void write_table(std::ostream& os, const std::vector<result>& results)
+{
+    os << std::left << std::setw(22) << "benchmark" << std::setw(9) << "kernel"
+       << std::right << std::setw(9) << "spheres" << std::setw(12) << "ns/op"
+       << std::setw(14) << "ops/s" << std::setw(12) << "cycles/op" << '\n';
+
+    for (const result& r : results)
+    {
+        os << std::left << std::setw(22) << r.name << std::setw(9) << r.kernel << std::right
+           << std::setw(9) << (r.spheres > 0 ? std::to_string(r.spheres) : "-")
+           << std::fixed << std::setprecision(2) << std::setw(12) << r.ns_per_op
+           << std::scientific << std::setprecision(3) << std::setw(14) << r.ops_per_sec
+           << std::fixed << std::setprecision(1) << std::setw(12) << r.cycles_per_op << '\n';
+        os.unsetf(std::ios::floatfield);
+    }
+}
+
+void write_csv(std::ostream& os, const std::vector<result>& results)
+{
+    os << "benchmark,kernel,spheres,ns_per_op,ops_per_sec,cycles_per_op,real_size\n";
+    for (const result& r : results)
+    {
+        os << r.name << ',' << r.kernel << ',' << r.spheres << ',' << r.ns_per_op << ','
+           << r.ops_per_sec << ',' << r.cycles_per_op << ',' << sizeof(real_t) << '\n';
+    }
+}
+
+void write_json(std::ostream& os, const std::vector<result>& results)
+{
+    os << "{\n"
+       << "  \"real_size\": " << sizeof(real_t) << ",\n"
+       << "  \"sphere_set_kernel\": \"" << sphere_set::kernel_name() << "\",\n"
+       << "  \"seed\": " << workload_seed << ",\n"
+       << "  \"results\": [\n";
+
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const result& r = results[i];
+        os << "    { \"benchmark\": \"" << r.name << "\", \"kernel\": \"" << r.kernel
+           << "\", \"spheres\": " << r.spheres << ", \"ns_per_op\": " << r.ns_per_op
+           << ", \"ops_per_sec\": " << r.ops_per_sec << ", \"cycles_per_op\": " << r.cycles_per_op
+           << " }" << (i + 1 < results.size() ? "," : "") << '\n';
+    }
+
+    os << "  ]\n}\n";
+}
+
+void print_usage(std::ostream& os, const char* program)
+{
+    os << "Usage: " << program << " [options]\n"
+       << "\n"
+       << "  --filter TEXT           Only run benchmarks whose name contains TEXT\n"
+       << "  --format table|csv|json Output format (default table)\n"
+       << "  -o, --output FILE       Write results to FILE instead of stdout\n"
+       << "  --min-time S            Seconds to spend on each benchmark (default 0.5)\n"
+       << "  --max-spheres N         Largest scene size (default 1000000)\n"
+       << "  -h, --help              Show this message\n";
+}
+
+bench_options parse_bench_options(int argc, char* argv[])
+{
+    bench_options opts;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string flag = argv[i];
+        if (flag == "-h" || flag == "--help")
+        {
+            print_usage(std::cout, argv[0]);
+            std::exit(0);
+        }
+
+        if (i + 1 == argc)
+            throw std::runtime_error("Missing value for " + flag);
+        const std::string value = argv[++i];
+
+        if (flag == "--filter")
+            opts.filter = value;
+        else if (flag == "--format")
+        {
+            if (value != "table" && value != "csv" && value != "json")
+                throw std::runtime_error("Unknown format: " + value);
+            opts.format = value;
+        }
+        else if (flag == "-o" || flag == "--output")
+            opts.output_file = value;
+        else if (flag == "--min-time")
+            opts.min_time = std::stod(value);
+        else if (flag == "--max-spheres")
+            opts.max_spheres = std::stoull(value);
+        else
+            throw std::runtime_error("Unknown option: " + flag);
+    }
+
+    return opts;
+}
+
+} /* Anonymous namespace */
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        const bench_options opts = parse_bench_options(argc, argv);
+
+        std::vector<result> results;
+        bench_single_sphere(opts, results);
+        bench_camera(opts, results);
+        bench_sampler(opts, results);
+        bench_scatter(opts, results);
+        bench_scenes(opts, results);
+
+        std::ofstream file;
+        if (!opts.output_file.empty())
+        {
+            file.open(opts.output_file);
+            if (!file)
+                throw std::runtime_error("Cannot open " + opts.output_file);
+        }
+        std::ostream& os = opts.output_file.empty() ? std::cout : file;
+
+        if (opts.format == "csv")
+            write_csv(os, results);
+        else if (opts.format == "json")
+            write_json(os, results);
+        else
+            write_table(os, results);
+    }
+    catch (const std::logic_error&)
+    {
+        std::cerr << "Error: invalid numeric argument\n";
+        return 1;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
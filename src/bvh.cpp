@@ -0,0 +1,540 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "simd_lanes.h"
+
+namespace
+{
+
+constexpr int num_bins = 16;
+constexpr real_t traversal_cost = 1.0;  // Relative to one primitive test
+constexpr std::size_t max_leaf_count = std::numeric_limits<std::uint16_t>::max();
+constexpr std::size_t parallel_threshold = 4096;
+
+float round_down(real_t x)
+{
+    float f = static_cast<float>(x);
+    if (f > x)
+        f = std::nextafter(f, -std::numeric_limits<float>::infinity());
+    return f;
+}
+
+float round_up(real_t x)
+{
+    float f = static_cast<float>(x);
+    if (f < x)
+        f = std::nextafter(f, std::numeric_limits<float>::infinity());
+    return f;
+}
+
+void set_node_bounds(bvh_node& node, const aabb& box)
+{
+    node.bmin[0] = round_down(box.min().x);
+    node.bmin[1] = round_down(box.min().y);
+    node.bmin[2] = round_down(box.min().z);
+    node.bmax[0] = round_up(box.max().x);
+    node.bmax[1] = round_up(box.max().y);
+    node.bmax[2] = round_up(box.max().z);
+}
+
+// Intermediate node, laid out in a 2N-1 array with gaps and compacted later
+struct build_node
+{
+    aabb box;
+    std::uint32_t first = 0;
+    std::uint32_t count = 0;
+    std::uint32_t right = 0;
+    int axis = 0;
+};
+
+struct bin
+{
+    aabb box;
+    std::size_t count = 0;
+};
+
+class builder
+{
+public:
+    builder(
+            const std::vector<aabb>& boxes,
+            std::size_t max_leaf_size,
+            real_t intersection_cost,
+            std::vector<std::uint32_t>& order)
+    :   _boxes(boxes)
+    ,   _max_leaf_size(std::max<std::size_t>(1, std::min(max_leaf_size, max_leaf_count)))
+    ,   _intersection_cost(intersection_cost)
+    ,   _order(order)
+    ,   _centroids(boxes.size())
+    ,   _nodes(2 * boxes.size() - 1)
+    {
+        const long n = static_cast<long>(boxes.size());
+#ifndef NO_OPENMP
+        #pragma omp parallel for
+#endif
+        for (long i = 0; i < n; ++i)
+            _centroids[i] = boxes[i].centroid();
+    }
+
+    void build()
+    {
+#ifndef NO_OPENMP
+        #pragma omp parallel
+        #pragma omp single
+#endif
+        build(0, 0, static_cast<std::uint32_t>(_boxes.size()), 0);
+    }
+
+    void flatten(std::vector<bvh_node>& out) const
+    {
+        out.clear();
+        out.reserve(_nodes.size());
+        flatten(0, out);
+    }
+
+private:
+    void build(std::uint32_t index, std::uint32_t begin, std::uint32_t end, int depth)
+    {
+        build_node& node = _nodes[index];
+        const std::uint32_t n = end - begin;
+
+        aabb centroid_box;
+        for (std::uint32_t i = begin; i < end; ++i)
+        {
+            node.box.expand(_boxes[_order[i]]);
+            centroid_box.expand(_centroids[_order[i]]);
+        }
+
+        node.first = begin;
+        node.count = n;
+        if (n == 1)
+            return;
+
+        int best_axis = -1;
+        int best_split = 0;
+        real_t best_cost = infinity();
+        const direction extent = centroid_box.extent();
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const real_t lo = aabb::component(centroid_box.min(), axis);
+            const real_t width = aabb::component(extent, axis);
+            if (width <= 0.0)
+                continue;
+
+            bin bins[num_bins];
+            for (std::uint32_t i = begin; i < end; ++i)
+            {
+                const int b = bin_index(aabb::component(_centroids[_order[i]], axis), lo, width);
+                bins[b].box.expand(_boxes[_order[i]]);
+                ++bins[b].count;
+            }
+
+            // Sweep from the right to get the cost of everything above each split
+            real_t right_cost[num_bins];
+            aabb right_box;
+            std::size_t right_count = 0;
+            for (int b = num_bins - 1; b > 0; --b)
+            {
+                right_box.expand(bins[b].box);
+                right_count += bins[b].count;
+                right_cost[b] = right_box.surface_area() * right_count;
+            }
+
+            aabb left_box;
+            std::size_t left_count = 0;
+            for (int b = 0; b < num_bins - 1; ++b)
+            {
+                left_box.expand(bins[b].box);
+                left_count += bins[b].count;
+                const real_t cost = left_box.surface_area() * left_count + right_cost[b + 1];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b;
+                }
+            }
+        }
+
+        const real_t area = node.box.surface_area();
+        const real_t split_cost = area > 0.0
+                ? traversal_cost + _intersection_cost * best_cost / area
+                : infinity();
+        const bool small = n <= _max_leaf_size;
+        if (small && split_cost >= _intersection_cost * n)
+            return;
+
+        std::uint32_t mid = begin;
+        if (best_axis >= 0 && depth < bvh_tree::max_depth / 2)
+        {
+            const real_t lo = aabb::component(centroid_box.min(), best_axis);
+            const real_t width = aabb::component(extent, best_axis);
+            std::uint32_t* const first = _order.data() + begin;
+            std::uint32_t* const last = _order.data() + end;
+            const std::uint32_t* const split = std::partition(first, last,
+                    [&] (std::uint32_t i)
+                    {
+                        return bin_index(aabb::component(_centroids[i], best_axis), lo, width) <= best_split;
+                    });
+            mid = begin + static_cast<std::uint32_t>(split - first);
+        }
+
+        // Fall back to an object median if the binned split was degenerate,
+        // or if the tree is getting deep enough to threaten the traversal stack
+        if (mid == begin || mid == end)
+        {
+            const int axis = best_axis >= 0 ? best_axis : 0;
+            std::uint32_t* const first = _order.data() + begin;
+            mid = begin + n / 2;
+            std::nth_element(first, _order.data() + mid, _order.data() + end,
+                    [&] (std::uint32_t a, std::uint32_t b)
+                    {
+                        return aabb::component(_centroids[a], axis) < aabb::component(_centroids[b], axis);
+                    });
+        }
+
+        const std::uint32_t left = index + 1;
+        const std::uint32_t right = index + 2 * (mid - begin);
+        node.count = 0;
+        node.right = right;
+        node.axis = best_axis >= 0 ? best_axis : 0;
+
+        if (n > parallel_threshold)
+        {
+#ifndef NO_OPENMP
+            #pragma omp task
+#endif
+            build(left, begin, mid, depth + 1);
+            build(right, mid, end, depth + 1);
+#ifndef NO_OPENMP
+            #pragma omp taskwait
+#endif
+        }
+        else
+        {
+            build(left, begin, mid, depth + 1);
+            build(right, mid, end, depth + 1);
+        }
+    }
+
+    std::uint32_t flatten(std::uint32_t index, std::vector<bvh_node>& out) const
+    {
+        const build_node& node = _nodes[index];
+        const std::uint32_t flat_index = static_cast<std::uint32_t>(out.size());
+
+        bvh_node flat;
+        set_node_bounds(flat, node.box);
+        flat.offset = node.first;
+        flat.count = static_cast<std::uint16_t>(node.count);
+        flat.axis = static_cast<std::uint16_t>(node.axis);
+        out.push_back(flat);
+
+        if (node.count == 0)
+        {
+            flatten(index + 1, out);
+            out[flat_index].offset = flatten(node.right, out);
+        }
+
+        return flat_index;
+    }
+
+    static int bin_index(real_t c, real_t lo, real_t width)
+    {
+        const int b = static_cast<int>(num_bins * ((c - lo) / width));
+        return std::min(std::max(b, 0), num_bins - 1);
+    }
+
+    static constexpr real_t infinity()
+    {
+        return std::numeric_limits<real_t>::infinity();
+    }
+
+    const std::vector<aabb>& _boxes;
+    const std::size_t _max_leaf_size;
+    const real_t _intersection_cost;
+    std::vector<std::uint32_t>& _order;
+    std::vector<position> _centroids;
+    std::vector<build_node> _nodes;
+};
+
+using packet_test = std::uint64_t (*)(const bvh_node&, const ray_packet&, std::uint64_t, real_t);
+
+// The same slab test as bvh_tree::node_hit(), for each ray of lanes in turn
+std::uint64_t packet_slabs_scalar(const bvh_node& node, const ray_packet& p, std::uint64_t lanes, real_t t_min)
+{
+    std::uint64_t hit = 0;
+    for (std::uint64_t rest = lanes; rest; rest &= rest - 1)
+    {
+        const int k = __builtin_ctzll(rest);
+        real_t lo = t_min;
+        real_t hi = p.t_max[k];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const real_t inv = p.inv_dir[axis][k];
+            const real_t t0 = (node.bmin[axis] - p.origin[axis][k]) * inv;
+            const real_t t1 = (node.bmax[axis] - p.origin[axis][k]) * inv;
+            const real_t near = inv < 0.0 ? t1 : t0;
+            const real_t far = inv < 0.0 ? t0 : t1;
+            lo = near > lo ? near : lo;
+            hi = far < hi ? far : hi;
+        }
+        if (!(hi < lo))
+            hit |= std::uint64_t(1) << k;
+    }
+
+    return hit;
+}
+
+#ifdef SIMD_X86
+
+// Vector arguments only ever cross inlined calls, so the ABI note is moot
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+/*
+ * The slab test a register of rays at a time, up to the last ray in lanes.
+ * max and min pick their second operand when unordered, and the near and
+ * far planes are picked by the sign of the reciprocal direction, so every
+ * ray gets exactly the answer node_hit() would give it.
+ */
+template <typename L>
+__attribute__((always_inline)) inline std::uint64_t packet_slabs_lanes(
+        const bvh_node& node,
+        const ray_packet& p,
+        std::uint64_t lanes,
+        real_t t_min)
+{
+    using vec = typename L::vec;
+    constexpr std::uint32_t width = L::width;
+
+    const vec tmin = L::set1(t_min);
+    vec bmin[3];
+    vec bmax[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        bmin[axis] = L::set1(node.bmin[axis]);
+        bmax[axis] = L::set1(node.bmax[axis]);
+    }
+
+    std::uint64_t hit = 0;
+    const std::uint32_t end = 64 - __builtin_clzll(lanes);
+    for (std::uint32_t base = 0; base < end; base += width)
+    {
+        vec lo = tmin;
+        vec hi = L::load(p.t_max + base);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const vec o = L::load(p.origin[axis] + base);
+            const vec inv = L::load(p.inv_dir[axis] + base);
+            const vec t0 = L::mul(L::sub(bmin[axis], o), inv);
+            const vec t1 = L::mul(L::sub(bmax[axis], o), inv);
+            lo = L::max(L::select_negative(inv, t0, t1), lo);
+            hi = L::min(L::select_negative(inv, t1, t0), hi);
+        }
+        hit |= std::uint64_t(L::nlt(hi, lo)) << base;
+    }
+
+    return hit & lanes;
+}
+
+#pragma GCC diagnostic pop
+
+SIMD_AVX2
+std::uint64_t packet_slabs_avx2(const bvh_node& node, const ray_packet& p, std::uint64_t lanes, real_t t_min)
+{
+    return packet_slabs_lanes<avx2_lanes>(node, p, lanes, t_min);
+}
+
+SIMD_AVX512
+std::uint64_t packet_slabs_avx512(const bvh_node& node, const ray_packet& p, std::uint64_t lanes, real_t t_min)
+{
+    return packet_slabs_lanes<avx512_lanes>(node, p, lanes, t_min);
+}
+
+#endif /* SIMD_X86 */
+
+packet_test select_packet_test()
+{
+#ifdef SIMD_X86
+    if (__builtin_cpu_supports("avx512f"))
+        return packet_slabs_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return packet_slabs_avx2;
+#endif
+    return packet_slabs_scalar;
+}
+
+} /* Anonymous namespace */
+
+aabb bvh_node::box() const
+{
+    return aabb(position(bmin[0], bmin[1], bmin[2]), position(bmax[0], bmax[1], bmax[2]));
+}
+
+bvh_tree::bvh_tree(const std::vector<aabb>& boxes, std::size_t max_leaf_size, real_t intersection_cost)
+{
+    if (boxes.empty())
+        return;
+
+    if (boxes.size() > std::numeric_limits<std::uint32_t>::max() / 2)
+        throw std::runtime_error("Too many primitives for BVH");
+
+    _order.resize(boxes.size());
+    for (std::size_t i = 0; i < boxes.size(); ++i)
+        _order[i] = static_cast<std::uint32_t>(i);
+
+    builder b(boxes, max_leaf_size, intersection_cost, _order);
+    b.build();
+    b.flatten(_nodes);
+}
+
+bvh_tree::bvh_tree(std::vector<bvh_node> nodes, std::size_t num_primitives)
+:   _nodes(std::move(nodes))
+{
+    if (num_primitives > std::numeric_limits<std::uint32_t>::max() / 2)
+        throw std::runtime_error("Too many primitives for BVH");
+
+    _order.resize(num_primitives);
+    for (std::size_t i = 0; i < num_primitives; ++i)
+        _order[i] = static_cast<std::uint32_t>(i);
+
+    if (_nodes.empty())
+    {
+        if (num_primitives > 0)
+            throw std::runtime_error("Malformed BVH");
+        return;
+    }
+
+    // Every node must be reached exactly once within the traversal stack
+    // limit, and the leaves must stay inside the primitives
+    std::vector<std::pair<std::uint32_t, int>> stack(1, std::make_pair(0u, 0));
+    std::size_t visited = 0;
+    std::size_t covered = 0;
+    while (!stack.empty())
+    {
+        const std::uint32_t index = stack.back().first;
+        const int depth = stack.back().second;
+        stack.pop_back();
+
+        const bvh_node& node = _nodes[index];
+        if (++visited > _nodes.size() || depth >= max_depth)
+            throw std::runtime_error("Malformed BVH");
+
+        if (node.is_leaf())
+        {
+            if (node.offset > num_primitives || node.count > num_primitives - node.offset)
+                throw std::runtime_error("Malformed BVH");
+            covered += node.count;
+        }
+        else
+        {
+            if (node.offset <= index + 1 || node.offset >= _nodes.size() || node.axis > 2)
+                throw std::runtime_error("Malformed BVH");
+            stack.emplace_back(index + 1, depth + 1);
+            stack.emplace_back(node.offset, depth + 1);
+        }
+    }
+
+    if (visited != _nodes.size() || covered != num_primitives)
+        throw std::runtime_error("Malformed BVH");
+}
+
+aabb bvh_tree::bounding_box() const
+{
+    return _nodes.empty() ? aabb() : _nodes.front().box();
+}
+
+real_t bvh_tree::surface_area() const
+{
+    real_t area = 0.0;
+    for (const bvh_node& node : _nodes)
+        area += node.box().surface_area();
+    return area;
+}
+
+void bvh_tree::set_bounds(bvh_node& node, const aabb& box)
+{
+    set_node_bounds(node, box);
+}
+
+bvh::bvh(std::vector<std::unique_ptr<hittable>> objs)
+{
+    std::vector<aabb> boxes;
+    boxes.reserve(objs.size());
+    for (const std::unique_ptr<hittable>& obj : objs)
+        boxes.push_back(obj->bounding_box());
+
+    constexpr std::size_t leaf_size = 4;
+    _tree = bvh_tree(boxes, leaf_size);
+
+    // Store objects in leaf order so each leaf is a contiguous run
+    _objs.reserve(objs.size());
+    for (std::uint32_t i : _tree.order())
+        _objs.push_back(std::move(objs[i]));
+}
+
+bool bvh::intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const
+{
+    return _tree.traverse(r, t_min, t_max,
+            [&] (std::uint32_t first, std::uint32_t count, real_t& closest_so_far)
+            {
+                bool hit_anything = false;
+                for (std::uint32_t i = first; i < first + count; ++i)
+                    if (_objs[i]->intersect(r, t_min, closest_so_far, prim))
+                        hit_anything = true;
+                return hit_anything;
+            });
+}
+
+std::uint64_t bvh_tree::node_hit_packet(
+        const bvh_node& node,
+        const ray_packet& p,
+        std::uint64_t lanes,
+        real_t t_min)
+{
+    static const packet_test test = select_packet_test();
+    return test(node, p, lanes, t_min);
+}
+
+void bvh::intersect_packet(ray_packet& p, std::uint64_t lanes, real_t t_min) const
+{
+    _tree.traverse_packet(p, lanes, t_min,
+            [&] (std::uint32_t first, std::uint32_t count, std::uint64_t leaf_lanes)
+            {
+                for (std::uint32_t i = first; i < first + count; ++i)
+                    _objs[i]->intersect_packet(p, leaf_lanes, t_min);
+            });
+}
+
+// Children name themselves in prim, so this is only reached by forwarding
+void bvh::surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const
+{
+    prim.object->surface(r, t, prim, rec);
+}
+
+bool bvh::occluded(const ray& r, real_t t_min, real_t t_max) const
+{
+    return _tree.any_hit(r, t_min, t_max,
+            [&] (std::uint32_t first, std::uint32_t count)
+            {
+                for (std::uint32_t i = first; i < first + count; ++i)
+                    if (_objs[i]->occluded(r, t_min, t_max))
+                        return true;
+                return false;
+            });
+}
+
+aabb bvh::bounding_box() const
+{
+    return _tree.bounding_box();
+}
+
+void bvh::refit()
+{
+    _tree.refit([&] (std::uint32_t slot) { return _objs[slot]->bounding_box(); });
+}
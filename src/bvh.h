@@ -0,0 +1,348 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "real_type.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "stats.h"
+
+/**
+ * Flattened BVH node. Bounds are stored as outward-rounded floats so two
+ * nodes fit in a cache line.
+ */
+struct bvh_node
+{
+    float bmin[3];
+    float bmax[3];
+    std::uint32_t offset;   // First primitive (leaf) or second child (interior)
+    std::uint16_t count;    // Number of primitives, 0 for interior nodes
+    std::uint16_t axis;     // Split axis of interior nodes
+
+    bool is_leaf() const { return count > 0; }
+    aabb box() const;
+};
+
+/**
+ * Bounding volume hierarchy over a set of primitive boxes, built with the
+ * binned surface area heuristic. Nodes are in depth-first order, so the
+ * first child of an interior node immediately follows it. order() maps
+ * leaf primitive slots back to the indices of the input boxes.
+ */
+class bvh_tree
+{
+public:
+    // Trees never get deeper than this, which bounds the traversal stack
+    static constexpr int max_depth = 128;
+
+    bvh_tree() = default;
+    /**
+     * intersection_cost is the cost of testing one primitive relative to
+     * one node traversal step; batched primitives should pass less than 1
+     * to get fuller leaves.
+     */
+    bvh_tree(const std::vector<aabb>& boxes, std::size_t max_leaf_size, real_t intersection_cost = 1.0);
+
+    /**
+     * A tree built earlier, e.g. loaded from a file, over num_primitives
+     * primitives that are already in its leaf order. Throws
+     * std::runtime_error if the nodes do not form such a tree.
+     */
+    bvh_tree(std::vector<bvh_node> nodes, std::size_t num_primitives);
+
+    const std::vector<bvh_node>& nodes() const { return _nodes; }
+    const std::vector<std::uint32_t>& order() const { return _order; }
+    aabb bounding_box() const;
+
+    /**
+     * Recompute every node's bounds after the primitives have moved,
+     * keeping the topology: box(slot) gives the new box of the primitive
+     * in leaf slot. A refit tree finds the same hits as a rebuilt one but
+     * may visit more nodes, the more so the further primitives move from
+     * where the tree grouped them.
+     */
+    template <typename BoxFuncT>
+    void refit(BoxFuncT&& box);
+
+    // Summed surface area of the nodes, which the cost of tracing rays
+    // through the tree grows with; a guide to when a refit tree has decayed
+    real_t surface_area() const;
+
+    /**
+     * Visit every leaf whose box is hit by r within [t_min, t_max], nearest
+     * child first. leaf(first, count, t_max) returns true on a hit and
+     * shrinks t_max to the new closest distance.
+     */
+    template <typename LeafFuncT>
+    bool traverse(const ray& r, real_t t_min, real_t& t_max, LeafFuncT&& leaf) const;
+
+    /**
+     * Visit leaves whose box is hit by r within [t_min, t_max] until
+     * leaf(first, count) returns true, meaning something in it blocks r.
+     */
+    template <typename LeafFuncT>
+    bool any_hit(const ray& r, real_t t_min, real_t t_max, LeafFuncT&& leaf) const;
+
+    /**
+     * traverse() for the rays of p in lanes together. Each node is fetched
+     * once and tested against every ray that reached its parent, and
+     * leaf(first, count, lanes) gets the rays that reach the leaf; it
+     * shrinks their t_max in p as it finds hits.
+     */
+    template <typename LeafFuncT>
+    void traverse_packet(const ray_packet& p, std::uint64_t lanes, real_t t_min, LeafFuncT&& leaf) const;
+
+private:
+    static void set_bounds(bvh_node& node, const aabb& box);
+
+    static bool node_hit(
+            const bvh_node& node,
+            const position& origin,
+            const direction& inv_dir,
+            real_t t_min,
+            real_t t_max);
+
+    // The rays of p in lanes whose t range overlaps node's box
+    static std::uint64_t node_hit_packet(
+            const bvh_node& node,
+            const ray_packet& p,
+            std::uint64_t lanes,
+            real_t t_min);
+
+    std::vector<bvh_node> _nodes;
+    std::vector<std::uint32_t> _order;
+};
+
+/**
+ * Drop-in replacement for hittable_list. Takes ownership of the objects and
+ * reorders them to match the leaf layout of the tree.
+ */
+class bvh : public hittable
+{
+public:
+    explicit bvh(std::vector<std::unique_ptr<hittable>> objs);
+
+    bool intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const final;
+    void surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const final;
+    bool occluded(const ray& r, real_t t_min, real_t t_max) const final;
+    void intersect_packet(ray_packet& p, std::uint64_t lanes, real_t t_min) const final;
+    aabb bounding_box() const final;
+
+    // Fit the tree to its objects' bounds again, after some have moved
+    void refit();
+
+private:
+    std::vector<std::unique_ptr<hittable>> _objs;
+    bvh_tree _tree;
+};
+
+inline bool bvh_tree::node_hit(
+        const bvh_node& node,
+        const position& origin,
+        const direction& inv_dir,
+        real_t t_min,
+        real_t t_max)
+{
+    const real_t o[3] = { origin.x, origin.y, origin.z };
+    const real_t inv[3] = { inv_dir.x, inv_dir.y, inv_dir.z };
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        real_t t0 = (node.bmin[axis] - o[axis]) * inv[axis];
+        real_t t1 = (node.bmax[axis] - o[axis]) * inv[axis];
+        if (inv[axis] < 0.0)
+            std::swap(t0, t1);
+
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+
+    return true;
+}
+
+template <typename BoxFuncT>
+void bvh_tree::refit(BoxFuncT&& box)
+{
+    // Children come after their parents, so walking backwards fits every
+    // child before the node that contains it
+    for (std::size_t i = _nodes.size(); i-- > 0;)
+    {
+        bvh_node& node = _nodes[i];
+        aabb bounds;
+        if (node.is_leaf())
+        {
+            for (std::uint32_t slot = node.offset; slot < node.offset + node.count; ++slot)
+                bounds.expand(box(slot));
+        }
+        else
+        {
+            bounds = _nodes[i + 1].box();
+            bounds.expand(_nodes[node.offset].box());
+        }
+        set_bounds(node, bounds);
+    }
+}
+
+template <typename LeafFuncT>
+bool bvh_tree::traverse(const ray& r, real_t t_min, real_t& t_max, LeafFuncT&& leaf) const
+{
+    if (_nodes.empty())
+        return false;
+
+    const direction inv_dir(1.0 / r.dir().x, 1.0 / r.dir().y, 1.0 / r.dir().z);
+    const bool dir_neg[3] = { inv_dir.x < 0.0, inv_dir.y < 0.0, inv_dir.z < 0.0 };
+
+    std::uint32_t stack[max_depth];
+    int stack_size = 0;
+    std::uint32_t index = 0;
+    std::uint64_t visited = 0;
+    bool hit_anything = false;
+
+    for (;;)
+    {
+        const bvh_node& node = _nodes[index];
+        ++visited;
+        if (node_hit(node, r.origin(), inv_dir, t_min, t_max))
+        {
+            if (node.is_leaf())
+            {
+                if (leaf(node.offset, node.count, t_max))
+                    hit_anything = true;
+            }
+            else
+            {
+                // Descend into the nearer child first so t_max shrinks early
+                if (dir_neg[node.axis])
+                {
+                    stack[stack_size++] = index + 1;
+                    index = node.offset;
+                }
+                else
+                {
+                    stack[stack_size++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        index = stack[--stack_size];
+    }
+
+    thread_stats().bvh_nodes += visited;
+    return hit_anything;
+}
+
+template <typename LeafFuncT>
+bool bvh_tree::any_hit(const ray& r, real_t t_min, real_t t_max, LeafFuncT&& leaf) const
+{
+    if (_nodes.empty())
+        return false;
+
+    const direction inv_dir(1.0 / r.dir().x, 1.0 / r.dir().y, 1.0 / r.dir().z);
+    const bool dir_neg[3] = { inv_dir.x < 0.0, inv_dir.y < 0.0, inv_dir.z < 0.0 };
+
+    std::uint32_t stack[max_depth];
+    int stack_size = 0;
+    std::uint32_t index = 0;
+    std::uint64_t visited = 0;
+    bool blocked = false;
+
+    for (;;)
+    {
+        const bvh_node& node = _nodes[index];
+        ++visited;
+        if (node_hit(node, r.origin(), inv_dir, t_min, t_max))
+        {
+            if (!node.is_leaf())
+            {
+                // Nearer child first: blockers are found sooner there too
+                if (dir_neg[node.axis])
+                {
+                    stack[stack_size++] = index + 1;
+                    index = node.offset;
+                }
+                else
+                {
+                    stack[stack_size++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+
+            if (leaf(node.offset, node.count))
+            {
+                blocked = true;
+                break;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        index = stack[--stack_size];
+    }
+
+    thread_stats().bvh_nodes += visited;
+    return blocked;
+}
+
+template <typename LeafFuncT>
+void bvh_tree::traverse_packet(const ray_packet& p, std::uint64_t lanes, real_t t_min, LeafFuncT&& leaf) const
+{
+    if (_nodes.empty() || lanes == 0)
+        return;
+
+    // Rays that reached the node a stack entry was pushed from
+    struct entry
+    {
+        std::uint32_t index;
+        std::uint64_t lanes;
+    };
+
+    entry stack[max_depth];
+    int stack_size = 0;
+    std::uint32_t index = 0;
+    std::uint64_t visited = 0;
+
+    for (;;)
+    {
+        const bvh_node& node = _nodes[index];
+        ++visited;
+        const std::uint64_t hit = node_hit_packet(node, p, lanes, t_min);
+        if (hit)
+        {
+            if (node.is_leaf())
+                leaf(node.offset, node.count, hit);
+            else
+            {
+                // Nearer child first, as seen by the first ray still in play
+                const int k = __builtin_ctzll(hit);
+                const bool dir_neg = p.inv_dir[node.axis][k] < 0.0;
+                stack[stack_size++] = { dir_neg ? index + 1 : node.offset, hit };
+                index = dir_neg ? node.offset : index + 1;
+                lanes = hit;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        index = stack[--stack_size].index;
+        lanes = stack[stack_size].lanes;
+    }
+
+    thread_stats().bvh_nodes += visited;
+}
+
+#endif
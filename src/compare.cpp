@@ -0,0 +1,152 @@
+#include "image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Per-pixel comparison of two PFM renders, typically the same scene and
+ * seed from the float and double builds:
+ *
+ *   rainbow_compare reference.pfm test.pfm [--tolerance T] [-o diff.pfm]
+ *
+ * A pixel counts as different if any channel differs by more than T times
+ * the brightest reference value. -o writes the absolute difference image.
+ */
+
+namespace
+{
+
+image load(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open " + filename);
+    return read_pfm(in);
+}
+
+void print_usage(std::ostream& os, const char* program)
+{
+    os << "Usage: " << program << " reference.pfm test.pfm [--tolerance T] [-o diff.pfm]\n";
+}
+
+} /* Anonymous namespace */
+
+int main(int argc, char* argv[])
+{
+    std::string files[2];
+    std::string diff_file;
+    double tolerance = 1e-3;
+
+    try
+    {
+        int num_files = 0;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if ((arg == "-o" || arg == "--tolerance") && i + 1 == argc)
+                throw std::runtime_error("Missing value for " + arg);
+
+            if (arg == "-o")
+                diff_file = argv[++i];
+            else if (arg == "--tolerance")
+                tolerance = std::stod(argv[++i]);
+            else if (arg == "-h" || arg == "--help")
+            {
+                print_usage(std::cout, argv[0]);
+                return 0;
+            }
+            else if (num_files < 2)
+                files[num_files++] = arg;
+            else
+                throw std::runtime_error("Unexpected argument: " + arg);
+        }
+
+        if (num_files != 2)
+        {
+            print_usage(std::cerr, argv[0]);
+            return 1;
+        }
+
+        const image ref = load(files[0]);
+        const image test = load(files[1]);
+        if (ref.width() != test.width() || ref.height() != test.height())
+            throw std::runtime_error("Images are different sizes");
+
+        const std::size_t width = ref.width();
+        const std::size_t height = ref.height();
+        const std::size_t num_pixels = width * height;
+
+        double ref_max = 0.0;
+        double ref_sum2 = 0.0;
+        for (std::size_t y = 0; y < height; ++y)
+        {
+            for (std::size_t x = 0; x < width; ++x)
+            {
+                const colour& c = ref.at(x, y);
+                ref_max = std::max({ ref_max, double(c.x), double(c.y), double(c.z) });
+                ref_sum2 += double(c.x)*c.x + double(c.y)*c.y + double(c.z)*c.z;
+            }
+        }
+
+        const double threshold = tolerance * ref_max;
+        image diff(width, height);
+        double max_diff = 0.0;
+        double sum_diff = 0.0;
+        double sum2_diff = 0.0;
+        std::size_t num_changed = 0;
+        std::size_t num_over = 0;
+        for (std::size_t y = 0; y < height; ++y)
+        {
+            for (std::size_t x = 0; x < width; ++x)
+            {
+                const colour d = test.at(x, y) - ref.at(x, y);
+                const colour a(std::abs(d.x), std::abs(d.y), std::abs(d.z));
+                const double m = std::max({ double(a.x), double(a.y), double(a.z) });
+
+                diff.at(x, y) = a;
+                max_diff = std::max(max_diff, m);
+                sum_diff += (double(a.x) + a.y + a.z) / 3.0;
+                sum2_diff += double(d.x)*d.x + double(d.y)*d.y + double(d.z)*d.z;
+                num_changed += m > 0.0;
+                num_over += m > threshold;
+            }
+        }
+
+        const double rms = std::sqrt(sum2_diff / (3.0 * num_pixels));
+        const double ref_rms = std::sqrt(ref_sum2 / (3.0 * num_pixels));
+
+        std::cout << "pixels " << num_pixels << '\n'
+                << "max_abs_diff " << max_diff << '\n'
+                << "mean_abs_diff " << sum_diff / num_pixels << '\n'
+                << "rms_diff " << rms << '\n'
+                << "relative_rms_diff " << (ref_rms > 0.0 ? rms / ref_rms : 0.0) << '\n'
+                << "pixels_changed " << num_changed << '\n'
+                << "pixels_over_tolerance " << num_over
+                << " (" << 100.0 * num_over / num_pixels << "%)\n";
+
+        if (!diff_file.empty())
+        {
+            std::ofstream out(diff_file, std::ios::binary);
+            write_pfm(out, diff, 1.0);
+            if (!out)
+                throw std::runtime_error("Failed to write " + diff_file);
+        }
+    }
+    catch (const std::logic_error&)
+    {
+        std::cerr << "Error: invalid tolerance\n";
+        return 1;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
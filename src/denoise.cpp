@@ -0,0 +1,177 @@
+#include "denoise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace
+{
+
+// B3 spline, the a-trous smoothing kernel
+constexpr real_t b3[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+
+// Darker albedos are clamped before dividing them out
+constexpr real_t min_albedo = 0.01;
+
+// Keeps zero-over-zero out of the edge-stopping terms
+constexpr real_t tiny = 1e-20;
+
+// One value per pixel for each channel, so each tap streams through
+// contiguous arrays
+struct planes
+{
+    explicit planes(std::size_t n) : r(n), g(n), b(n) {}
+
+    std::vector<real_t> r;
+    std::vector<real_t> g;
+    std::vector<real_t> b;
+};
+
+} /* Anonymous namespace */
+
+image denoise(
+        const image& noisy,
+        const std::vector<real_t>& variance,
+        const feature_buffer& features,
+        const denoise_settings& settings)
+{
+    const std::size_t width = noisy.width();
+    const std::size_t height = noisy.height();
+    const std::size_t n = width * height;
+    if (features.width() != width || features.height() != height || variance.size() != n)
+        throw std::runtime_error("Denoiser inputs are different sizes");
+
+    const colour* pixels = noisy.data();
+    const std::vector<std::uint32_t>& ids = features.material_ids();
+    const std::vector<real_t>& depth = features.depths();
+
+    planes normal(n);
+    planes albedo(n);
+    planes divisor(n);
+    planes current(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const direction& v = features.normals()[i];
+        const real_t length = v.length();
+        const real_t scale = length > 0.0 ? 1.0 / length : 0.0;
+        normal.r[i] = v.x * scale;
+        normal.g[i] = v.y * scale;
+        normal.b[i] = v.z * scale;
+
+        const colour& a = features.albedos()[i];
+        albedo.r[i] = a.x;
+        albedo.g[i] = a.y;
+        albedo.b[i] = a.z;
+        divisor.r[i] = std::max(a.x, min_albedo);
+        divisor.g[i] = std::max(a.y, min_albedo);
+        divisor.b[i] = std::max(a.z, min_albedo);
+
+        current.r[i] = pixels[i].x / divisor.r[i];
+        current.g[i] = pixels[i].y / divisor.g[i];
+        current.b[i] = pixels[i].z / divisor.b[i];
+    }
+
+    const real_t inv_albedo_sigma2 = 1.0 / (settings.albedo_sigma * settings.albedo_sigma);
+    real_t colour_sigma2 = settings.colour_sigma * settings.colour_sigma;
+    planes next(n);
+    for (int iteration = 0; iteration < settings.iterations; ++iteration)
+    {
+        const long step = 1L << iteration;
+        const long w = static_cast<long>(width);
+        const long h = static_cast<long>(height);
+
+#ifndef NO_OPENMP
+        #pragma omp parallel
+#endif
+        {
+            planes sum(width);
+            std::vector<real_t> weight_sum(width);
+
+#ifndef NO_OPENMP
+            #pragma omp for schedule(static)
+#endif
+            for (long y = 0; y < h; ++y)
+            {
+                std::fill(sum.r.begin(), sum.r.end(), 0.0);
+                std::fill(sum.g.begin(), sum.g.end(), 0.0);
+                std::fill(sum.b.begin(), sum.b.end(), 0.0);
+                std::fill(weight_sum.begin(), weight_sum.end(), 0.0);
+
+                for (int dy = -2; dy <= 2; ++dy)
+                {
+                    const long qy = y + dy * step;
+                    if (qy < 0 || qy >= h)
+                        continue;
+
+                    for (int dx = -2; dx <= 2; ++dx)
+                    {
+                        // Only the pixels whose tap lands inside the row
+                        const long offset = dx * step;
+                        const long x0 = std::max(0L, -offset);
+                        const long x1 = std::min(w, w - offset);
+                        const real_t k = b3[dy + 2] * b3[dx + 2];
+                        const std::size_t p = static_cast<std::size_t>(y * w);
+                        const std::size_t q = static_cast<std::size_t>(qy * w + offset);
+
+                        for (long x = x0; x < x1; ++x)
+                        {
+                            const std::size_t i = p + x;
+                            const std::size_t j = q + x;
+
+                            // Colour difference in radiance, against the noise expected
+                            const real_t dr = current.r[i] * divisor.r[i] - current.r[j] * divisor.r[j];
+                            const real_t dg = current.g[i] * divisor.g[i] - current.g[j] * divisor.g[j];
+                            const real_t db = current.b[i] * divisor.b[i] - current.b[j] * divisor.b[j];
+                            const real_t colour_term = (dr * dr + dg * dg + db * db)
+                                    / (colour_sigma2 * variance[i] + tiny);
+
+                            const real_t depth_term = std::abs(depth[i] - depth[j])
+                                    / (settings.depth_sigma * std::max(depth[i], depth[j]) + tiny);
+
+                            const real_t ar = albedo.r[i] - albedo.r[j];
+                            const real_t ag = albedo.g[i] - albedo.g[j];
+                            const real_t ab = albedo.b[i] - albedo.b[j];
+                            const real_t albedo_term = (ar * ar + ag * ag + ab * ab) * inv_albedo_sigma2;
+
+                            // Background pixels have no normal to compare
+                            const real_t cosine = normal.r[i] * normal.r[j] + normal.g[i] * normal.g[j] + normal.b[i] * normal.b[j];
+                            const real_t normal_term = ids[i] != 0
+                                    ? settings.normal_power * std::log(std::max(cosine, real_t(1e-8)))
+                                    : 0.0;
+
+                            const real_t weight = ids[i] == ids[j]
+                                    ? k * std::exp(normal_term - colour_term - depth_term - albedo_term)
+                                    : 0.0;
+
+                            sum.r[x] += weight * current.r[j];
+                            sum.g[x] += weight * current.g[j];
+                            sum.b[x] += weight * current.b[j];
+                            weight_sum[x] += weight;
+                        }
+                    }
+                }
+
+                // The centre tap always has weight, so weight_sum is never zero
+                for (long x = 0; x < w; ++x)
+                {
+                    const std::size_t i = static_cast<std::size_t>(y * w + x);
+                    next.r[i] = sum.r[x] / weight_sum[x];
+                    next.g[i] = sum.g[x] / weight_sum[x];
+                    next.b[i] = sum.b[x] / weight_sum[x];
+                }
+            }
+        }
+
+        std::swap(current, next);
+        colour_sigma2 *= 0.25;
+    }
+
+    image result(width, height);
+    colour* out = result.data();
+    for (std::size_t i = 0; i < n; ++i)
+        out[i] = colour(current.r[i] * divisor.r[i], current.g[i] * divisor.g[i], current.b[i] * divisor.b[i]);
+
+    return result;
+}
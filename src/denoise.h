@@ -0,0 +1,40 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <vector>
+
+#include "aov.h"
+#include "image.h"
+#include "real_type.h"
+
+struct denoise_settings
+{
+    int iterations = 5;             // Kernel footprints of 5, 9, 17, 33 and 65 pixels
+    real_t colour_sigma = 4.0;      // In standard errors of the pixels' means
+    real_t normal_power = 64.0;     // Exponent on the cosine between normals
+    real_t depth_sigma = 0.05;      // Relative to the farther depth
+    real_t albedo_sigma = 0.1;
+};
+
+/**
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) for linear
+ * radiance, run before the display transform. Each iteration blurs with a
+ * 5x5 B3 spline kernel whose taps are spread twice as far apart as the
+ * last iteration's. Each tap is weighted down by how far its colour,
+ * normal, depth and albedo are from the centre pixel's. Taps on a
+ * different material get no weight.
+ *
+ * Colour differences are measured against variance, the squared standard
+ * error of each pixel's mean luminance, so the filter smooths noise but
+ * keeps edges that stand out from it. The tolerance is halved every
+ * iteration, as the noise left shrinks. Colours are divided by albedo
+ * while filtering, so texture is not blurred. Rows are filtered in
+ * parallel, a tap at a time across contiguous arrays.
+ */
+image denoise(
+        const image& noisy,
+        const std::vector<real_t>& variance,
+        const feature_buffer& features,
+        const denoise_settings& settings = denoise_settings());
+
+#endif
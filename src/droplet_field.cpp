@@ -0,0 +1,320 @@
+#include "droplet_field.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "stats.h"
+
+namespace
+{
+
+// Clusters are the leaves of SAH trees built over runs of this many
+// droplets in Morton order, which bounds the memory the build needs
+constexpr std::size_t chunk_size = 4096;
+constexpr real_t droplet_intersection_cost = 0.1;
+
+// Each cluster is a leaf of the tree over the clusters
+constexpr real_t cluster_intersection_cost = 1.0;
+
+// Centres are binned on a 1024^3 grid for the Morton order
+constexpr real_t morton_grid = 1024.0;
+constexpr real_t quantisation_steps = 65535.0;
+
+// Spread the low 10 bits of v out to every third bit
+std::uint32_t spread_bits(std::uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+std::uint32_t grid_cell(real_t p, real_t lo, real_t cells_per_unit)
+{
+    const real_t cell = (p - lo) * cells_per_unit;
+    return static_cast<std::uint32_t>(std::min(std::max(cell, real_t(0)), morton_grid - 1));
+}
+
+std::uint16_t quantise(real_t p, float origin, float scale)
+{
+    if (scale <= 0.0f)
+        return 0;
+
+    const real_t q = std::round((p - origin) / scale);
+    return static_cast<std::uint16_t>(std::min(std::max(q, real_t(0)), quantisation_steps));
+}
+
+} /* Anonymous namespace */
+
+droplet_field::droplet_field(std::vector<droplet> droplets, const material* mat)
+:   _kernel(sphere_set::select_kernel())
+{
+    if (mat == nullptr)
+        throw std::runtime_error("No material set for droplets");
+    const std::size_t count = droplets.size();
+    if (count > std::numeric_limits<std::uint32_t>::max())
+        throw std::runtime_error("Too many droplets for a droplet field");
+    if (count == 0)
+        return;
+
+    // Size classes span the radii actually present
+    float min_radius = std::numeric_limits<float>::max();
+    float max_radius = 0.0f;
+    aabb centres;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const droplet& d = droplets[i];
+        if (!(d.radius > 0.0f))
+            throw std::runtime_error("Droplet radius must be positive");
+        min_radius = std::min(min_radius, d.radius);
+        max_radius = std::max(max_radius, d.radius);
+        centres.expand(position(d.x, d.y, d.z));
+    }
+
+    const std::size_t num_classes = max_radius > min_radius ? max_size_classes : 1;
+    const real_t log_min = std::log(real_t(min_radius));
+    const real_t log_step = num_classes > 1 ? std::log(real_t(max_radius) / min_radius) / (num_classes - 1) : 0.0;
+    _classes.resize(num_classes);
+    for (std::size_t k = 0; k < num_classes; ++k)
+    {
+        const real_t radius = k == 0 ? real_t(min_radius) : std::exp(log_min + k * log_step);
+        _classes[k] = { radius, radius * radius, mat };
+    }
+
+    const auto class_of = [&] (float radius)
+    {
+        if (num_classes == 1)
+            return std::uint8_t(0);
+        const long k = std::lround((std::log(real_t(radius)) - log_min) / log_step);
+        return static_cast<std::uint8_t>(std::min<long>(std::max<long>(k, 0), num_classes - 1));
+    };
+
+    // Sort the droplets themselves by Morton code, so no keys are stored.
+    // The sort is stable, keeping drops in the same cell in input order
+    const direction extent = centres.extent();
+    const real_t cells_x = extent.x > 0.0 ? morton_grid / extent.x : 0.0;
+    const real_t cells_y = extent.y > 0.0 ? morton_grid / extent.y : 0.0;
+    const real_t cells_z = extent.z > 0.0 ? morton_grid / extent.z : 0.0;
+    const auto morton_code = [&] (const droplet& d)
+    {
+        return spread_bits(grid_cell(d.x, centres.min().x, cells_x))
+                | spread_bits(grid_cell(d.y, centres.min().y, cells_y)) << 1
+                | spread_bits(grid_cell(d.z, centres.min().z, cells_z)) << 2;
+    };
+    std::stable_sort(droplets.begin(), droplets.end(),
+            [&] (const droplet& a, const droplet& b) { return morton_code(a) < morton_code(b); });
+
+    const auto pack = [&] (const cluster& c, const droplet& d)
+    {
+        packed_droplet p;
+        p.q[0] = quantise(d.x, c.origin[0], c.scale[0]);
+        p.q[1] = quantise(d.y, c.origin[1], c.scale[1]);
+        p.q[2] = quantise(d.z, c.origin[2], c.scale[2]);
+        p.size_class = class_of(d.radius);
+        p.reserved = 0;
+        return p;
+    };
+
+    // Split each chunk into clusters along the leaves of its own tree
+    std::vector<cluster> clusters;
+    std::vector<aabb> chunk_boxes;
+    std::vector<droplet> chunk;
+    for (std::size_t start = 0; start < count; start += chunk_size)
+    {
+        const std::size_t n = std::min(chunk_size, count - start);
+        chunk_boxes.clear();
+        for (std::size_t j = start; j < start + n; ++j)
+        {
+            const droplet& d = droplets[j];
+            const real_t radius = _classes[class_of(d.radius)].radius;
+            const position centre(d.x, d.y, d.z);
+            chunk_boxes.emplace_back(centre - direction(radius, radius, radius), centre + direction(radius, radius, radius));
+        }
+
+        const bvh_tree chunk_tree(chunk_boxes, cluster_size, droplet_intersection_cost);
+        chunk.assign(droplets.begin() + start, droplets.begin() + start + n);
+        for (std::size_t slot = 0; slot < n; ++slot)
+            droplets[start + slot] = chunk[chunk_tree.order()[slot]];
+
+        for (const bvh_node& node : chunk_tree.nodes())
+        {
+            if (node.is_leaf())
+            {
+                cluster cl = {};
+                cl.first = static_cast<std::uint32_t>(start + node.offset);
+                cl.count = node.count;
+                clusters.push_back(cl);
+            }
+        }
+    }
+
+    // Quantise each cluster's centres within its bounds, and bound it by its
+    // droplets as they will be decoded. Droplets are packed in the order
+    // they now have, which keeps each cluster's run contiguous
+    const std::size_t num_clusters = clusters.size();
+    std::vector<aabb> boxes(num_clusters);
+    _droplets.reserve(count);
+    for (std::size_t c = 0; c < num_clusters; ++c)
+    {
+        cluster& cl = clusters[c];
+
+        float lo[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+        float hi[3] = { -lo[0], -lo[1], -lo[2] };
+        for (std::size_t j = cl.first; j < cl.first + cl.count; ++j)
+        {
+            const droplet& d = droplets[j];
+            const float p[3] = { d.x, d.y, d.z };
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                lo[axis] = std::min(lo[axis], p[axis]);
+                hi[axis] = std::max(hi[axis], p[axis]);
+            }
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            cl.origin[axis] = lo[axis];
+            cl.scale[axis] = static_cast<float>((real_t(hi[axis]) - lo[axis]) / quantisation_steps);
+        }
+
+        for (std::size_t j = cl.first; j < cl.first + cl.count; ++j)
+        {
+            const packed_droplet p = pack(cl, droplets[j]);
+            _droplets.push_back(p);
+            const real_t radius = _classes[p.size_class].radius;
+            const position centre = droplet_field::centre(cl, p);
+            boxes[c].expand(centre - direction(radius, radius, radius));
+            boxes[c].expand(centre + direction(radius, radius, radius));
+        }
+    }
+
+    // The full droplets are not needed from here on, and the cluster tree
+    // build is the other big allocation
+    std::vector<droplet>().swap(droplets);
+    _tree = bvh_tree(boxes, 1, cluster_intersection_cost);
+    std::vector<aabb>().swap(boxes);
+
+    // Clusters go in leaf order; their droplets stay where they were packed
+    _clusters.reserve(num_clusters);
+    for (std::uint32_t c : _tree.order())
+        _clusters.push_back(clusters[c]);
+}
+
+position droplet_field::centre(const cluster& c, const packed_droplet& d)
+{
+    return position(
+            c.origin[0] + d.q[0] * real_t(c.scale[0]),
+            c.origin[1] + d.q[1] * real_t(c.scale[1]),
+            c.origin[2] + d.q[2] * real_t(c.scale[2]));
+}
+
+void droplet_field::decode(const cluster& c, decoded_cluster& out) const
+{
+    for (std::uint32_t i = 0; i < c.count; ++i)
+    {
+        const packed_droplet& d = _droplets[c.first + i];
+        const position p = centre(c, d);
+        out.cx[i] = p.x;
+        out.cy[i] = p.y;
+        out.cz[i] = p.z;
+        out.r2[i] = _classes[d.size_class].r2;
+    }
+}
+
+bool droplet_field::intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const
+{
+    decoded_cluster decoded;
+    const sphere_set::arrays a = decoded.arrays();
+
+    std::uint32_t hit_cluster = 0;
+    std::uint32_t hit_droplet = 0;
+    std::uint64_t tests = 0;
+
+    const bool hit_anything = _tree.traverse(r, t_min, t_max,
+            [&] (std::uint32_t first, std::uint32_t count, real_t& closest_so_far)
+            {
+                bool hit_leaf = false;
+                for (std::uint32_t c = first; c < first + count; ++c)
+                {
+                    const cluster& cl = _clusters[c];
+                    decode(cl, decoded);
+
+                    tests += cl.count;
+                    std::uint32_t index;
+                    if (_kernel(a, 0, cl.count, r, t_min, closest_so_far, index))
+                    {
+                        hit_cluster = c;
+                        hit_droplet = cl.first + index;
+                        hit_leaf = true;
+                    }
+                }
+                return hit_leaf;
+            });
+
+    thread_stats().intersection_tests += tests;
+    if (hit_anything)
+    {
+        prim.object = this;
+        prim.index = hit_droplet;
+        prim.group = hit_cluster;
+    }
+
+    return hit_anything;
+}
+
+void droplet_field::surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const
+{
+    const packed_droplet& d = _droplets[prim.index];
+    const size_class& sc = _classes[d.size_class];
+    const position centre = droplet_field::centre(_clusters[prim.group], d);
+    rec.t = t;
+    rec.p = r.at(t);
+    direction outward_normal = (rec.p - centre) / sc.radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat = sc.mat;
+}
+
+bool droplet_field::occluded(const ray& r, real_t t_min, real_t t_max) const
+{
+    decoded_cluster decoded;
+    const sphere_set::arrays a = decoded.arrays();
+    std::uint64_t tests = 0;
+
+    const bool blocked = _tree.any_hit(r, t_min, t_max,
+            [&] (std::uint32_t first, std::uint32_t count)
+            {
+                for (std::uint32_t c = first; c < first + count; ++c)
+                {
+                    const cluster& cl = _clusters[c];
+                    decode(cl, decoded);
+
+                    tests += cl.count;
+                    real_t closest = t_max;
+                    std::uint32_t index;
+                    if (_kernel(a, 0, cl.count, r, t_min, closest, index))
+                        return true;
+                }
+                return false;
+            });
+
+    thread_stats().intersection_tests += tests;
+    return blocked;
+}
+
+aabb droplet_field::bounding_box() const
+{
+    return _tree.bounding_box();
+}
+
+std::size_t droplet_field::memory_bytes() const
+{
+    return _droplets.capacity() * sizeof(packed_droplet)
+            + _clusters.capacity() * sizeof(cluster)
+            + _classes.capacity() * sizeof(size_class)
+            + _tree.nodes().capacity() * sizeof(bvh_node)
+            + _tree.order().capacity() * sizeof(std::uint32_t);
+}
@@ -0,0 +1,96 @@
+#ifndef DROPLET_FIELD_H
+#define DROPLET_FIELD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "real_type.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "sphere_set.h"
+
+class material;
+
+/**
+ * Droplets stored in 8 bytes each, for rain volumes too big for
+ * sphere_set. Droplets are sorted in Morton order and split into clusters
+ * of up to cluster_size by small SAH trees, with a BVH over the clusters. A droplet keeps only its
+ * centre, quantised to 16 bits per axis within its cluster's bounds, and a
+ * size class. The size class gives the radius and material.
+ *
+ * Radii are rounded to at most max_size_classes classes spaced evenly in
+ * log radius, and centres move by at most half a quantisation step, so
+ * this is an approximation of the input droplets. Clusters are decoded on
+ * the fly and tested with the sphere_set leaf kernels.
+ */
+class droplet_field : public hittable
+{
+public:
+    static constexpr std::size_t cluster_size = 16;
+    static constexpr std::size_t max_size_classes = 256;
+
+    // Takes the droplets by value, sorting and packing them in place, and
+    // frees them before the cluster tree is built
+    droplet_field(std::vector<droplet> droplets, const material* mat);
+
+    bool intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const final;
+    void surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const final;
+    bool occluded(const ray& r, real_t t_min, real_t t_max) const final;
+    aabb bounding_box() const final;
+
+    std::size_t size() const { return _droplets.size(); }
+    std::size_t num_size_classes() const { return _classes.size(); }
+
+    // Bytes held, tree included
+    std::size_t memory_bytes() const;
+
+private:
+    struct packed_droplet
+    {
+        std::uint16_t q[3];
+        std::uint8_t size_class;
+        std::uint8_t reserved;
+    };
+
+    // Centres are origin + q * scale
+    struct cluster
+    {
+        float origin[3];
+        float scale[3];
+        std::uint32_t first;
+        std::uint32_t count;
+    };
+
+    struct size_class
+    {
+        real_t radius;
+        real_t r2;
+        const material* mat;
+    };
+
+    // One decoded cluster, laid out for the leaf kernel
+    struct decoded_cluster
+    {
+        alignas(64) real_t cx[cluster_size] = {};
+        alignas(64) real_t cy[cluster_size] = {};
+        alignas(64) real_t cz[cluster_size] = {};
+        alignas(64) real_t r2[cluster_size] = {};
+
+        sphere_set::arrays arrays() const { return { cx, cy, cz, r2 }; }
+    };
+
+    static position centre(const cluster& c, const packed_droplet& d);
+    void decode(const cluster& c, decoded_cluster& out) const;
+
+    std::vector<packed_droplet> _droplets;  // Grouped by cluster, in Morton order
+    std::vector<cluster> _clusters;         // In leaf order
+    std::vector<size_class> _classes;
+    bvh_tree _tree;
+    sphere_set::leaf_kernel _kernel;
+};
+
+#endif
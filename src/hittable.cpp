@@ -1,27 +1,65 @@
 #include "hittable.h"
 #include "ray.h"
 
+void ray_packet::add(const ray& r, real_t limit)
+{
+    const std::size_t k = size++;
+    rays[k] = r;
+    t_max[k] = limit;
+    origin[0][k] = r.origin().x;
+    origin[1][k] = r.origin().y;
+    origin[2][k] = r.origin().z;
+    inv_dir[0][k] = 1.0 / r.dir().x;
+    inv_dir[1][k] = 1.0 / r.dir().y;
+    inv_dir[2][k] = 1.0 / r.dir().z;
+}
+
+void hittable::intersect_packet(ray_packet& p, std::uint64_t lanes, real_t t_min) const
+{
+    for (; lanes; lanes &= lanes - 1)
+    {
+        const int k = __builtin_ctzll(lanes);
+        if (intersect(p.rays[k], t_min, p.t_max[k], p.prims[k]))
+            p.hits |= std::uint64_t(1) << k;
+    }
+}
+
 void hit_record::set_face_normal(const ray& r, const direction& outward_normal)
 {
     front_face = dot(r.dir(), outward_normal) < 0;
     normal = front_face ? outward_normal : -outward_normal;
 }
 
-bool hittable_list::hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+bool hittable_list::intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const
 {
-    hit_record temp_rec;
     bool hit_anything = false;
-    real_t closest_so_far = t_max;
-
     for (const std::unique_ptr<hittable>& obj : _objs)
-    {
-        if (obj->hit(r, t_min, closest_so_far, temp_rec))
-        {
+        if (obj->intersect(r, t_min, t_max, prim))
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
-        }
-    }
 
     return hit_anything;
+}
+
+// Children name themselves in prim, so this is only reached by forwarding
+void hittable_list::surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const
+{
+    prim.object->surface(r, t, prim, rec);
+}
+
+bool hittable_list::occluded(const ray& r, real_t t_min, real_t t_max) const
+{
+    for (const std::unique_ptr<hittable>& obj : _objs)
+        if (obj->occluded(r, t_min, t_max))
+            return true;
+
+    return false;
+}
+
+aabb hittable_list::bounding_box() const
+{
+    aabb box;
+    for (const std::unique_ptr<hittable>& obj : _objs)
+        box.expand(obj->bounding_box());
+
+    return box;
 }
\ No newline at end of file
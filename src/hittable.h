@@ -1,15 +1,19 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <utility>
 #include <vector>
 
 #include "real_type.h"
 #include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
 
-class ray;
 class material;
+class hittable;
 
 struct hit_record
 {
@@ -22,16 +26,97 @@ struct hit_record
     void set_face_normal(const ray& r, const direction& outward_normal);
 };
 
+/**
+ * The primitive a closest-hit search settled on: the object that owns it
+ * and where it is stored there. Containers pass on whatever their children
+ * set, so object is always the primitive's own hittable.
+ */
+struct primitive_ref
+{
+    const hittable* object = nullptr;
+    std::uint32_t index = 0;
+    std::uint32_t group = 0;    // A second index, for objects that need one
+};
+
+/**
+ * Up to max_size rays whose closest hits are searched for together, with
+ * intersect_packet(). Each ray has its own t_max and primitive, as for
+ * intersect(). Origins and reciprocal directions are also kept one array
+ * per axis, so a tree node can be tested against the whole packet in one
+ * loop.
+ */
+struct ray_packet
+{
+    static constexpr std::size_t max_size = 64;
+
+    std::size_t size = 0;
+    ray rays[max_size];
+    primitive_ref prims[max_size];
+    std::uint64_t hits = 0;     // Bit k is set once ray k has hit something
+
+    // Zeroed, as node tests read whole registers past the last ray
+    alignas(64) real_t t_max[max_size] = {};
+    alignas(64) real_t origin[3][max_size] = {};
+    alignas(64) real_t inv_dir[3][max_size] = {};
+
+    // Empty the packet
+    void clear() { size = 0; hits = 0; }
+
+    // Add r, to be searched as far as t_max
+    void add(const ray& r, real_t t_max);
+
+    // Every ray in the packet, as a mask
+    std::uint64_t all() const { return size == max_size ? ~std::uint64_t(0) : (std::uint64_t(1) << size) - 1; }
+};
+
+/**
+ * Ray queries are split in two. intersect() searches for the closest hit,
+ * tracking only its distance and which primitive it was. surface() then
+ * works out the point, normal and material, once, for the primitive that
+ * won. occluded() answers whether anything at all is hit, stopping at the
+ * first primitive found, for shadow rays.
+ */
 class hittable
 {
 public:
     virtual ~hittable() = default;
 
-    virtual bool hit(
+    /**
+     * Look for a hit in [t_min, t_max]. If one is found, t_max shrinks to
+     * its distance, prim names its primitive and the result is true.
+     * Otherwise both are left alone.
+     */
+    virtual bool intersect(
             const ray& r,
             real_t t_min,
-            real_t t_max,
-            hit_record& rec) const = 0;
+            real_t& t_max,
+            primitive_ref& prim) const = 0;
+
+    // The surface of a primitive intersect() found at distance t along r
+    virtual void surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const = 0;
+
+    virtual bool occluded(const ray& r, real_t t_min, real_t t_max) const = 0;
+
+    /**
+     * intersect() for each ray of p whose bit is set in lanes, updating
+     * its t_max and primitive and setting its bit in p.hits on a hit.
+     * Objects with trees override this to take the rays through together;
+     * by default each ray is searched on its own.
+     */
+    virtual void intersect_packet(ray_packet& p, std::uint64_t lanes, real_t t_min) const;
+
+    virtual aabb bounding_box() const = 0;
+
+    // The closest hit, with its surface
+    bool hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+    {
+        primitive_ref prim;
+        if (!intersect(r, t_min, t_max, prim))
+            return false;
+
+        prim.object->surface(r, t_max, prim, rec);
+        return true;
+    }
 };
 
 class hittable_list : public hittable
@@ -40,7 +125,13 @@ public:
     void clear() { _objs.clear(); }
     void add(std::unique_ptr<hittable> h) { _objs.push_back(std::move(h)); }
 
-    bool hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const final;
+    // Hand the objects over to another container, e.g. a bvh
+    std::vector<std::unique_ptr<hittable>> release() { return std::move(_objs); }
+
+    bool intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const final;
+    void surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const final;
+    bool occluded(const ray& r, real_t t_min, real_t t_max) const final;
+    aabb bounding_box() const final;
 
 private:
     std::vector<std::unique_ptr<hittable>> _objs;
@@ -1,5 +1,9 @@
 #include "image.h"
 
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
 #include <utility>
 
 image::image(std::size_t width, std::size_t height)
@@ -75,33 +79,151 @@ void image::scale_brightness(real_t sf)
 namespace
 {
 
-real_t clamp(real_t x, real_t cmin, real_t cmax)
+static_assert(sizeof(colour) == 3 * sizeof(real_t), "colour must be three packed reals");
+
+/*
+ * Exposure, gamma and quantisation fused into a single pass over the
+ * pixels. Each row is an independent run of 3 * width reals, written
+ * straight into the output buffer; gamma 2 and 1 get branch-free inner
+ * loops the compiler can vectorise.
+ */
+template <typename GammaFuncT>
+void quantise_rows(const image& img, real_t exposure, GammaFuncT&& gamma, unsigned char* out)
+{
+    const std::size_t row_len = 3 * img.width();
+    const real_t* const src = &img.data()->x;
+    const long num_rows = static_cast<long>(img.height());
+
+#ifndef NO_OPENMP
+    #pragma omp parallel for
+#endif
+    for (long y = 0; y < num_rows; ++y)
+    {
+        const real_t* in = src + y * row_len;
+        unsigned char* dst = out + y * row_len;
+        for (std::size_t i = 0; i < row_len; ++i)
+        {
+            real_t v = gamma(std::max(in[i] * exposure, real_t(0.0)));
+            v = std::min(v, real_t(0.9999));
+            dst[i] = static_cast<unsigned char>(256 * v);
+        }
+    }
+}
+
+std::vector<unsigned char> quantise(const image& img, const tonemap& tm)
 {
-    if (x < cmin)
-        return cmin;
-    else if (x > cmax)
-        return cmax;
+    std::vector<unsigned char> bytes(3 * img.width() * img.height());
+
+    if (tm.gamma == 2.0)
+        quantise_rows(img, tm.exposure, [] (real_t v) { return std::sqrt(v); }, bytes.data());
+    else if (tm.gamma == 1.0)
+        quantise_rows(img, tm.exposure, [] (real_t v) { return v; }, bytes.data());
     else
-        return x;
+    {
+        const real_t inv_gamma = 1.0 / tm.gamma;
+        quantise_rows(img, tm.exposure, [=] (real_t v) { return std::pow(v, inv_gamma); }, bytes.data());
+    }
+
+    return bytes;
 }
 
-std::ostream& operator<<(std::ostream& os, const colour& c)
+void write_ppm_header(std::ostream& os, const char* magic, const image& img)
 {
-    return os << static_cast<int>(256 * clamp(c.x, 0.0, 0.9999))
-            << ' ' << static_cast<int>(256 * clamp(c.y, 0.0, 0.9999))
-            << ' ' << static_cast<int>(256 * clamp(c.z, 0.0, 0.9999));
+    os << magic << '\n' << img.width() << ' ' << img.height() << '\n' << "255\n";
 }
 
 } /* Anonymous namespace */
 
 std::ostream& operator<<(std::ostream& os, const image& img)
 {
-    os << "P3\n";
-    os << img._width << ' ' << img._height << '\n';
-    os << "255\n";
+    tonemap raw;
+    raw.gamma = 1.0;
+    write_ppm_ascii(os, img, raw);
+    return os;
+}
+
+void write_ppm(std::ostream& os, const image& img, const tonemap& tm)
+{
+    const std::vector<unsigned char> bytes = quantise(img, tm);
+    write_ppm_header(os, "P6", img);
+    os.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
 
-    for (const colour& pixel : img._pixels)
-        os << pixel << '\n';
+void write_ppm_ascii(std::ostream& os, const image& img, const tonemap& tm)
+{
+    const std::vector<unsigned char> bytes = quantise(img, tm);
+    write_ppm_header(os, "P3", img);
+
+    // Format into one buffer rather than going through the stream per value
+    std::string text;
+    text.reserve(bytes.size() * 4);
+    for (std::size_t i = 0; i < bytes.size(); i += 3)
+    {
+        for (std::size_t c = 0; c < 3; ++c)
+        {
+            const unsigned v = bytes[i + c];
+            if (v >= 100)
+                text += static_cast<char>('0' + v / 100);
+            if (v >= 10)
+                text += static_cast<char>('0' + v / 10 % 10);
+            text += static_cast<char>('0' + v % 10);
+            text += c == 2 ? '\n' : ' ';
+        }
+    }
+
+    os.write(text.data(), text.size());
+}
 
-    return os;
-}
\ No newline at end of file
+void write_pfm(std::ostream& os, const image& img, real_t exposure)
+{
+    const std::size_t width = img.width();
+    const std::size_t height = img.height();
+    std::vector<float> floats(3 * width * height);
+
+    // PFM scanlines run bottom to top
+    const real_t* const src = &img.data()->x;
+    const long num_rows = static_cast<long>(height);
+#ifndef NO_OPENMP
+    #pragma omp parallel for
+#endif
+    for (long y = 0; y < num_rows; ++y)
+    {
+        const real_t* in = src + y * 3 * width;
+        float* dst = floats.data() + (height - 1 - y) * 3 * width;
+        for (std::size_t i = 0; i < 3 * width; ++i)
+            dst[i] = static_cast<float>(in[i] * exposure);
+    }
+
+    // A negative scale marks the data as little-endian, as written on x86
+    os << "PF\n" << width << ' ' << height << '\n' << "-1.0\n";
+    os.write(reinterpret_cast<const char*>(floats.data()), floats.size() * sizeof(float));
+}
+
+image read_pfm(std::istream& is)
+{
+    std::string magic;
+    std::size_t width = 0;
+    std::size_t height = 0;
+    double scale = 0.0;
+    is >> magic >> width >> height >> scale;
+    is.get();
+    if (!is || magic != "PF" || width == 0 || height == 0)
+        throw std::runtime_error("Not a colour PFM");
+    if (scale >= 0.0)
+        throw std::runtime_error("Big-endian PFM is not supported");
+
+    std::vector<float> floats(3 * width * height);
+    is.read(reinterpret_cast<char*>(floats.data()), floats.size() * sizeof(float));
+    if (!is)
+        throw std::runtime_error("Truncated PFM");
+
+    image img(width, height);
+    for (std::size_t y = 0; y < height; ++y)
+    {
+        const float* src = floats.data() + (height - 1 - y) * 3 * width;
+        for (std::size_t x = 0; x < width; ++x)
+            img.at(x, y) = colour(src[3*x], src[3*x + 1], src[3*x + 2]);
+    }
+
+    return img;
+}
@@ -2,6 +2,7 @@
 #define IMAGE_H
 
 #include <vector>
+#include <istream>
 #include <ostream>
 #include <utility>
 
@@ -29,6 +30,10 @@ public:
     std::size_t width() const;
     std::size_t height() const;
 
+    // Row-major pixels, top row first, with no bounds checking
+    const colour* data() const { return _pixels.data(); }
+    colour* data() { return _pixels.data(); }
+
     void scale_brightness(real_t sf);
 
     template <typename FuncT>
@@ -47,4 +52,28 @@ private:
     std::vector<colour> _pixels;
 };
 
+/**
+ * Display transform applied on output: pixel values are multiplied by
+ * exposure, raised to 1/gamma and quantised to 8 bits, all in one pass.
+ */
+struct tonemap
+{
+    real_t exposure = 1.0;
+    real_t gamma = 2.0;
+};
+
+// Binary (P6) PPM
+void write_ppm(std::ostream& os, const image& img, const tonemap& tm);
+
+// ASCII (P3) PPM
+void write_ppm_ascii(std::ostream& os, const image& img, const tonemap& tm);
+
+// Little-endian PFM of the linear values, scaled by exposure but otherwise
+// untouched so HDR data survives
+void write_pfm(std::ostream& os, const image& img, real_t exposure);
+
+// Read back a PFM written by write_pfm. Throws std::runtime_error if it is
+// not a little-endian colour PFM.
+image read_pfm(std::istream& is);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,572 @@
+#include "integrator.h"
+
+#include <algorithm>
+
+#include "camera.h"
+#include "phase_function.h"
+#include "render.h"
+#include "rt_utils.h"
+#include "sample_buffer.h"
+#include "stats.h"
+
+namespace
+{
+
+constexpr real_t t_min = 0.001;
+
+// Russian roulette starts after this many bounces
+constexpr int min_bounces = 3;
+constexpr real_t max_survival = 0.95;
+
+// Streams of numbers each bounce takes for tracking; see sampler::stream()
+constexpr std::uint32_t free_flight_walk = 0;
+constexpr std::uint32_t shadow_walk = 1;
+
+// Decide whether a path that has just made bounce number depth carries on,
+// reweighting its throughput if it does
+bool survives(spectral_sample& throughput, int depth, const sampler& s)
+{
+    if (depth + 1 < min_bounces)
+        return true;
+
+    const real_t survival = std::min(throughput.max_value(), max_survival);
+    if (survival <= 0.0 || s.get_1d(sampler::roulette_dimension(depth)) >= survival)
+        return false;
+
+    throughput *= 1.0 / survival;
+    return true;
+}
+
+// Power heuristic weight for a sample taken with density pdf, against
+// another strategy's other_pdf
+real_t mis_weight(real_t pdf, real_t other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Fraction of ls's light that reaches p: none if a surface is in the
+// way, otherwise what the media let through
+real_t visibility(
+        const hittable& world,
+        const media& volumes,
+        const position& p,
+        const light_sample& ls,
+        const sampler& s,
+        int depth)
+{
+    ++thread_stats().shadow_rays;
+    const ray shadow(p, ls.dir);
+    if (world.occluded(shadow, t_min, ls.distance - t_min))
+        return 0.0;
+    if (volumes.empty())
+        return 1.0;
+
+    philox_stream rng = s.stream(depth, shadow_walk);
+    return volumes.transmittance(shadow, 0.0, ls.distance, rng);
+}
+
+/**
+ * Light reaching the smooth surface at rec from a sampled direction toward
+ * one of lights, through an unblocked shadow ray, weighted against the
+ * chance that scattering would have picked the same direction
+ */
+spectral_sample direct_light(
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        const hit_record& rec,
+        const wavelengths& lambdas,
+        const sampler& s,
+        int depth)
+{
+    const std::uint32_t dim = sampler::light_dimension(depth);
+    light_sample ls;
+    if (!lights.sample(rec.p, lambdas, s.get_1d(dim + 2), s.get_2d(dim), ls))
+        return spectral_sample(0.0);
+
+    spectral_sample f_cos;
+    real_t scatter_pdf;
+    rec.mat->evaluate(rec, ls.dir, lambdas, f_cos, scatter_pdf);
+    if (scatter_pdf <= 0.0)
+        return spectral_sample(0.0);
+
+    const real_t v = visibility(world, volumes, rec.p, ls, s, depth);
+    if (v <= 0.0)
+        return spectral_sample(0.0);
+
+    return ls.radiance * f_cos * (mis_weight(ls.pdf, scatter_pdf) * v / ls.pdf);
+}
+
+// As direct_light(), for light travelling along unit direction dir that
+// scatters in a medium with phase at p
+spectral_sample medium_direct_light(
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        const droplet_phase& phase,
+        const position& p,
+        const direction& dir,
+        const wavelengths& lambdas,
+        const sampler& s,
+        int depth)
+{
+    const std::uint32_t dim = sampler::light_dimension(depth);
+    light_sample ls;
+    if (!lights.sample(p, lambdas, s.get_1d(dim + 2), s.get_2d(dim), ls))
+        return spectral_sample(0.0);
+
+    const real_t cos_theta = dot(dir, ls.dir);
+    const real_t value = phase.value(lambdas[0], cos_theta);
+    if (value <= 0.0)
+        return spectral_sample(0.0);
+
+    const real_t v = visibility(world, volumes, p, ls, s, depth);
+    if (v <= 0.0)
+        return spectral_sample(0.0);
+
+    return ls.radiance * (value * v * mis_weight(ls.pdf, phase.pdf(lambdas[0], cos_theta)) / ls.pdf);
+}
+
+/**
+ * Turn the path travelling along current in the medium of event: light
+ * sampled from there is added to radiance, then the phase function picks
+ * the new ray. The droplets' phase function is dispersive, so as at their
+ * surfaces only the hero wavelength carries on.
+ */
+void scatter_in_medium(
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        const medium_event& event,
+        ray& current,
+        wavelengths& lambdas,
+        spectral_sample& radiance,
+        spectral_sample& throughput,
+        real_t& scatter_pdf,
+        position& scatter_point,
+        sampler& s,
+        int depth)
+{
+    ++thread_stats().medium_scatters;
+    const droplet_phase& phase = event.where->phase();
+    const position p = current.at(event.t);
+    const direction dir = normalise(current.dir());
+    lambdas.terminate_secondary();
+
+    s.start_bounce(depth);
+    if (lights.can_sample())
+        radiance += throughput * medium_direct_light(world, lights, volumes, phase, p, dir, lambdas, s, depth);
+
+    const direction scattered = phase.sample(lambdas[0], dir, s.get_2d(), scatter_pdf);
+    throughput *= phase.albedo(lambdas[0]);
+    scatter_point = p;
+    current = ray(p, scattered);
+}
+
+// Whether the path along r scatters in volumes before t_max, and where
+bool medium_event_before(const media& volumes, const ray& r, real_t t_max, const sampler& s, int depth, medium_event& event)
+{
+    if (volumes.empty())
+        return false;
+
+    philox_stream rng = s.stream(depth, free_flight_walk);
+    return volumes.sample_event(r, 0.0, t_max, rng, event);
+}
+
+// Weight for light a path runs into at rec, having scattered from
+// scatter_point with density scatter_pdf; discrete scattering leaves light
+// sampling nothing to add, so gets the full weight
+real_t emission_weight(const light_list& lights, real_t scatter_pdf, const position& scatter_point, const hit_record& rec)
+{
+    return scatter_pdf > 0.0 ? mis_weight(scatter_pdf, lights.pdf(scatter_point, rec.p)) : 1.0;
+}
+
+// Light from distant lights and the sky for a path escaping along dir,
+// weighted like emission_weight()
+spectral_sample background_light(const light_list& lights, real_t scatter_pdf, const direction& dir, const wavelengths& lambdas)
+{
+    const direction unit = normalise(dir);
+    const real_t weight = scatter_pdf > 0.0 ? mis_weight(scatter_pdf, lights.pdf(unit)) : 1.0;
+    return lights.sky(unit, lambdas) + lights.distant(unit, lambdas) * weight;
+}
+
+// Density of scattering from rec into scattered, zero unless the material is smooth
+real_t scattered_pdf(const hit_record& rec, const ray& scattered, const wavelengths& lambdas)
+{
+    if (!rec.mat->smooth())
+        return 0.0;
+
+    spectral_sample f_cos;
+    real_t pdf;
+    rec.mat->evaluate(rec, normalise(scattered.dir()), lambdas, f_cos, pdf);
+    return pdf;
+}
+
+} /* Anonymous namespace */
+
+spectral_sample ray_colour(
+        const ray& r,
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        wavelengths& lambdas,
+        int max_depth,
+        sampler& s)
+{
+    render_stats& stats = thread_stats();
+    spectral_sample radiance(0.0);
+    spectral_sample throughput(1.0);
+    ray current = r;
+    real_t scatter_pdf = 0.0;
+    position scatter_point;
+
+    for (int depth = 0; depth < max_depth; ++depth)
+    {
+        hit_record rec;
+        const bool timed = ++stats.rays % timing_stride == 0;
+        std::uint64_t start = timed ? stats_ticks() : 0;
+        const bool hit = world.hit(current, t_min, infinity, rec) && rec.mat;
+        if (timed)
+            stats.intersect_ticks += timing_stride * (stats_ticks() - start);
+
+        medium_event event;
+        if (medium_event_before(volumes, current, hit ? rec.t : infinity, s, depth, event))
+        {
+            scatter_in_medium(world, lights, volumes, event, current, lambdas, radiance, throughput, scatter_pdf, scatter_point, s, depth);
+            if (!survives(throughput, depth, s))
+            {
+                ++stats.roulette;
+                stats.end_path(depth + 1);
+                return radiance;
+            }
+            continue;
+        }
+
+        if (!hit)
+        {
+            if (lights.has_background())
+                radiance += throughput * background_light(lights, scatter_pdf, current.dir(), lambdas);
+            ++stats.escaped;
+            stats.end_path(depth);
+            return radiance;
+        }
+
+        ++stats.hits[static_cast<int>(rec.mat->kind())];
+        radiance += throughput * rec.mat->emitted(lambdas) * emission_weight(lights, scatter_pdf, scatter_point, rec);
+
+        ray scattered;
+        spectral_sample attenuation;
+        start = timed ? stats_ticks() : 0;
+        s.start_bounce(depth);
+        if (rec.mat->smooth() && lights.can_sample())
+            radiance += throughput * direct_light(world, lights, volumes, rec, lambdas, s, depth);
+        const bool scatters = rec.mat->scatter(current, rec, lambdas, attenuation, scattered, s);
+        if (timed)
+            stats.scatter_ticks += timing_stride * (stats_ticks() - start);
+        if (!scatters)
+        {
+            ++stats.absorbed;
+            stats.end_path(depth + 1);
+            return radiance;
+        }
+
+        current = scattered;
+        throughput *= attenuation;
+        scatter_pdf = scattered_pdf(rec, scattered, lambdas);
+        scatter_point = rec.p;
+        if (!survives(throughput, depth, s))
+        {
+            ++stats.roulette;
+            stats.end_path(depth + 1);
+            return radiance;
+        }
+    }
+
+    ++stats.depth_limit;
+    stats.end_path(max_depth);
+    return radiance;
+}
+
+path_integrator::path_integrator(
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        const camera& cam,
+        std::size_t width,
+        std::size_t height,
+        int max_depth,
+        const sampler& samples)
+:   _world(world)
+,   _lights(lights)
+,   _volumes(volumes)
+,   _cam(cam)
+,   _width(width)
+,   _height(height)
+,   _max_depth(max_depth)
+,   _sampler(samples)
+{
+}
+
+sampler path_integrator::start_sample(std::size_t x, std::size_t y, std::uint32_t index) const
+{
+    sampler s = _sampler;
+    s.start(x, y, index);
+    return s;
+}
+
+ray path_integrator::camera_ray(std::size_t x, std::size_t y, sampler& s) const
+{
+    const std::size_t j = _height - 1 - y;
+    const sample_2d jitter = s.get_2d();
+    const real_t u = (x + (jitter.u - 0.5)) / (_width - 1);
+    const real_t v = (j + (jitter.v - 0.5)) / (_height - 1);
+    return _cam.get_ray(u, v);
+}
+
+colour path_integrator::sample(std::size_t x, std::size_t y, std::uint32_t index) const
+{
+    ++thread_stats().camera_rays;
+    sampler s = start_sample(x, y, index);
+    const ray r = camera_ray(x, y, s);
+    wavelengths lambdas = wavelengths::sample_uniform(s.get_1d());
+    const spectral_sample radiance = ray_colour(r, _world, _lights, _volumes, lambdas, _max_depth, s);
+    return spectrum_to_rgb(radiance, lambdas);
+}
+
+surface_features path_integrator::features(std::size_t x, std::size_t y, std::uint32_t index) const
+{
+    sampler s = start_sample(x, y, index);
+    const ray r = camera_ray(x, y, s);
+
+    surface_features f;
+    hit_record rec;
+    if (_world.hit(r, t_min, infinity, rec) && rec.mat)
+    {
+        f.normal = rec.normal;
+        f.depth = rec.t * r.dir().length();
+        f.albedo = rec.mat->albedo();
+        f.material_id = static_cast<std::uint32_t>(rec.mat->kind()) + 1;
+    }
+
+    return f;
+}
+
+wavefront_integrator::wavefront_integrator(
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        const camera& cam,
+        std::size_t width,
+        std::size_t height,
+        int max_depth,
+        const sampler& samples)
+:   _world(world)
+,   _lights(lights)
+,   _volumes(volumes)
+,   _paths(world, lights, volumes, cam, width, height, max_depth, samples)
+,   _max_depth(max_depth)
+,   _rays(max_wave_size)
+,   _lambdas(max_wave_size)
+,   _samplers(max_wave_size)
+,   _throughput(max_wave_size)
+,   _radiance(max_wave_size)
+,   _hits(max_wave_size)
+,   _scatter_pdf(max_wave_size)
+,   _scatter_point(max_wave_size)
+,   _events(max_wave_size)
+,   _pixel(max_wave_size)
+{
+    _active.reserve(max_wave_size);
+    for (std::vector<std::uint32_t>& queue : _queues)
+        queue.reserve(max_wave_size);
+    _medium_queue.reserve(max_wave_size);
+}
+
+void wavefront_integrator::render_tile(
+        const tile& t,
+        const render_pass& pass,
+        const sample_buffer& buf,
+        pixel_stats* accum)
+{
+    // Generate: one path per sample still owed, flushing full waves
+    std::size_t size = 0;
+    for (std::size_t y = t.y0; y < t.y1; ++y)
+    {
+        for (std::size_t x = t.x0; x < t.x1; ++x)
+        {
+            const std::uint32_t pixel = static_cast<std::uint32_t>((y - t.y0) * t.width() + (x - t.x0));
+            const std::uint32_t target = pass.target(x, y, buf.width());
+            for (std::uint32_t k = buf.count(x, y); k < target; ++k)
+            {
+                sampler& s = _samplers[size];
+                s = _paths.start_sample(x, y, pass.first_sample + k);
+                _rays[size] = _paths.camera_ray(x, y, s);
+                _lambdas[size] = wavelengths::sample_uniform(s.get_1d());
+                _throughput[size] = spectral_sample(1.0);
+                _radiance[size] = spectral_sample(0.0);
+                _scatter_pdf[size] = 0.0;
+                _pixel[size] = pixel;
+
+                if (++size == max_wave_size)
+                {
+                    trace_wave(size, accum);
+                    size = 0;
+                }
+            }
+        }
+    }
+
+    if (size > 0)
+        trace_wave(size, accum);
+}
+
+void wavefront_integrator::trace_wave(std::size_t size, pixel_stats* accum)
+{
+    _active.resize(size);
+    for (std::size_t i = 0; i < size; ++i)
+        _active[i] = static_cast<std::uint32_t>(i);
+
+    render_stats& stats = thread_stats();
+    stats.camera_rays += size;
+
+    for (int depth = 0; depth < _max_depth && !_active.empty(); ++depth)
+    {
+        intersect(depth);
+
+        // Lights only emit, so their paths end here
+        const std::vector<std::uint32_t>& lights = _queues[static_cast<int>(material_kind::light)];
+        for (std::uint32_t i : lights)
+        {
+            _radiance[i] += _throughput[i] * _hits[i].mat->emitted(_lambdas[i])
+                    * emission_weight(_lights, _scatter_pdf[i], _scatter_point[i], _hits[i]);
+            stats.end_path(depth + 1);
+        }
+        stats.absorbed += lights.size();
+
+        const std::uint64_t start = stats_ticks();
+        shade<lambertian>(_queues[static_cast<int>(material_kind::lambertian)], depth);
+        shade<metal>(_queues[static_cast<int>(material_kind::metal)], depth);
+        shade<dielectric>(_queues[static_cast<int>(material_kind::dielectric)], depth);
+        shade_media(depth);
+        stats.scatter_ticks += stats_ticks() - start;
+    }
+
+    stats.depth_limit += _active.size();
+    stats.path_length[std::min<std::size_t>(_max_depth, path_length_buckets - 1)] += _active.size();
+
+    // Paths are in generation order, so samples reach each pixel in order
+    for (std::size_t i = 0; i < size; ++i)
+        accum[_pixel[i]].push(spectrum_to_rgb(_radiance[i], _lambdas[i]));
+}
+
+void wavefront_integrator::intersect(int depth)
+{
+    for (std::vector<std::uint32_t>& queue : _queues)
+        queue.clear();
+    _medium_queue.clear();
+
+    render_stats& stats = thread_stats();
+    const std::uint64_t start = stats_ticks();
+
+    // Live paths go through the world a packet at a time, so each tree node
+    // and leaf is fetched once for a group of rays. Paths that miss, or hit
+    // something without a material, are finished
+    ray_packet p;
+    for (std::size_t first = 0; first < _active.size(); first += ray_packet::max_size)
+    {
+        const std::size_t n = std::min(ray_packet::max_size, _active.size() - first);
+        p.clear();
+        for (std::size_t k = 0; k < n; ++k)
+            p.add(_rays[_active[first + k]], infinity);
+        _world.intersect_packet(p, p.all(), t_min);
+
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            const std::uint32_t i = _active[first + k];
+            hit_record& rec = _hits[i];
+            bool hit = false;
+            if (p.hits >> k & 1)
+            {
+                p.prims[k].object->surface(_rays[i], p.t_max[k], p.prims[k], rec);
+                hit = rec.mat != nullptr;
+            }
+
+            if (medium_event_before(_volumes, _rays[i], hit ? rec.t : infinity, _samplers[i], depth, _events[i]))
+                _medium_queue.push_back(i);
+            else if (hit)
+                _queues[static_cast<int>(rec.mat->kind())].push_back(i);
+            else if (_lights.has_background())
+                _radiance[i] += _throughput[i] * background_light(_lights, _scatter_pdf[i], _rays[i].dir(), _lambdas[i]);
+        }
+    }
+
+    stats.intersect_ticks += stats_ticks() - start;
+    stats.rays += _active.size();
+
+    std::size_t num_hits = 0;
+    for (int k = 0; k < num_material_kinds; ++k)
+    {
+        stats.hits[k] += _queues[k].size();
+        num_hits += _queues[k].size();
+    }
+    const std::size_t num_escaped = _active.size() - num_hits - _medium_queue.size();
+    stats.escaped += num_escaped;
+    stats.path_length[std::min<std::size_t>(depth, path_length_buckets - 1)] += num_escaped;
+
+    _active.clear();
+}
+
+template <typename MaterialT>
+void wavefront_integrator::shade(const std::vector<std::uint32_t>& queue, int depth)
+{
+    render_stats& stats = thread_stats();
+    for (std::uint32_t i : queue)
+    {
+        // The kind says which class this is, and as the class is final the
+        // call below is not virtual
+        const MaterialT& mat = static_cast<const MaterialT&>(*_hits[i].mat);
+
+        ray scattered;
+        spectral_sample attenuation;
+        sampler& s = _samplers[i];
+        s.start_bounce(depth);
+        if (mat.smooth() && _lights.can_sample())
+            _radiance[i] += _throughput[i] * direct_light(_world, _lights, _volumes, _hits[i], _lambdas[i], s, depth);
+        if (!mat.scatter(_rays[i], _hits[i], _lambdas[i], attenuation, scattered, s))
+        {
+            ++stats.absorbed;
+            stats.end_path(depth + 1);
+            continue;
+        }
+
+        _rays[i] = scattered;
+        _throughput[i] *= attenuation;
+        _scatter_pdf[i] = scattered_pdf(_hits[i], scattered, _lambdas[i]);
+        _scatter_point[i] = _hits[i].p;
+        if (survives(_throughput[i], depth, s))
+            _active.push_back(i);
+        else
+        {
+            ++stats.roulette;
+            stats.end_path(depth + 1);
+        }
+    }
+}
+
+void wavefront_integrator::shade_media(int depth)
+{
+    render_stats& stats = thread_stats();
+    for (std::uint32_t i : _medium_queue)
+    {
+        sampler& s = _samplers[i];
+        scatter_in_medium(_world, _lights, _volumes, _events[i], _rays[i], _lambdas[i], _radiance[i], _throughput[i],
+                _scatter_pdf[i], _scatter_point[i], s, depth);
+        if (survives(_throughput[i], depth, s))
+            _active.push_back(i);
+        else
+        {
+            ++stats.roulette;
+            stats.end_path(depth + 1);
+        }
+    }
+}
@@ -0,0 +1,157 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "aov.h"
+#include "real_type.h"
+#include "vec3.h"
+#include "ray.h"
+#include "hittable.h"
+#include "lights.h"
+#include "material.h"
+#include "medium.h"
+#include "sampler.h"
+#include "spectrum.h"
+
+class camera;
+class sample_buffer;
+struct pixel_stats;
+struct render_pass;
+struct tile;
+
+/**
+ * Radiance arriving back along r. The path is followed iteratively, carrying
+ * the product of attenuations so far; after a few bounces it survives each
+ * further bounce with probability given by that throughput (Russian
+ * roulette), and survivors are reweighted to keep the estimate unbiased.
+ * Scattering and roulette draw from each bounce's dimensions of s.
+ *
+ * At smooth surfaces a direction toward one of lights is also sampled and
+ * a shadow ray cast (next-event estimation). Light reached that way and
+ * light the scattered path runs into are each weighted by the power
+ * heuristic, so the two estimates combine without counting light twice
+ * (multiple importance sampling). Paths that escape the world pick up
+ * lights' background: distant lights and the sky.
+ *
+ * Between surfaces the path may scatter in one of volumes instead, at a
+ * distance found by delta tracking. There light is sampled the same way,
+ * weighted by the medium's phase function, and shadow rays are dimmed by
+ * the media they cross.
+ */
+spectral_sample ray_colour(
+        const ray& r,
+        const hittable& world,
+        const light_list& lights,
+        const media& volumes,
+        wavelengths& lambdas,
+        int max_depth,
+        sampler& s);
+
+/**
+ * The scene as seen through the camera, sampled one path at a time. Pixel
+ * coordinates count rows from the top of the image. Each path's random
+ * numbers come from a copy of samples, started at its pixel and sample
+ * index.
+ */
+class path_integrator
+{
+public:
+    path_integrator(
+            const hittable& world,
+            const light_list& lights,
+            const media& volumes,
+            const camera& cam,
+            std::size_t width,
+            std::size_t height,
+            int max_depth,
+            const sampler& samples = sampler());
+
+    // Sample number index of pixel (x, y)
+    colour sample(std::size_t x, std::size_t y, std::uint32_t index) const;
+
+    // A sampler ready for sample number index of pixel (x, y)
+    sampler start_sample(std::size_t x, std::size_t y, std::uint32_t index) const;
+
+    // Jittered camera ray through pixel (x, y)
+    ray camera_ray(std::size_t x, std::size_t y, sampler& s) const;
+
+    // What the camera ray of sample number index of pixel (x, y) hits first
+    surface_features features(std::size_t x, std::size_t y, std::uint32_t index) const;
+
+private:
+    const hittable& _world;
+    const light_list& _lights;
+    const media& _volumes;
+    const camera& _cam;
+    std::size_t _width;
+    std::size_t _height;
+    int _max_depth;
+    sampler _sampler;
+};
+
+/**
+ * The same estimator as path_integrator, evaluated a wave of paths at a
+ * time. Path state lives in one array per field, and each bounce runs as
+ * separate loops: intersect the live paths a ray_packet at a time, bin the
+ * hits by material kind, then scatter each bin with direct calls to its
+ * material class. Paths that
+ * scatter in a medium before reaching a surface get a bin of their own. Each
+ * worker needs its own instance, as the path buffers are reused from tile
+ * to tile.
+ */
+class wavefront_integrator
+{
+public:
+    // Most paths in flight at once; bigger tiles are rendered in several waves
+    static constexpr std::size_t max_wave_size = 1 << 14;
+
+    wavefront_integrator(
+            const hittable& world,
+            const light_list& lights,
+            const media& volumes,
+            const camera& cam,
+            std::size_t width,
+            std::size_t height,
+            int max_depth,
+            const sampler& samples = sampler());
+
+    // Take the samples that tile t still needs for pass; see render_tile_batches()
+    void render_tile(const tile& t, const render_pass& pass, const sample_buffer& buf, pixel_stats* accum);
+
+private:
+    void trace_wave(std::size_t size, pixel_stats* accum);
+    void intersect(int depth);
+    template <typename MaterialT>
+    void shade(const std::vector<std::uint32_t>& queue, int depth);
+    void shade_media(int depth);
+
+    const hittable& _world;
+    const light_list& _lights;
+    const media& _volumes;
+    path_integrator _paths;
+    int _max_depth;
+
+    // Path state, indexed by path
+    std::vector<ray> _rays;
+    std::vector<wavelengths> _lambdas;
+    std::vector<sampler> _samplers;
+    std::vector<spectral_sample> _throughput;
+    std::vector<spectral_sample> _radiance;
+    std::vector<hit_record> _hits;
+    std::vector<real_t> _scatter_pdf;   // Of the last scattered direction, zero if not smooth
+    std::vector<position> _scatter_point;
+    std::vector<medium_event> _events;
+    std::vector<std::uint32_t> _pixel;  // Index into the tile's accumulators
+
+    // Indices of live paths, of the hits on each kind of material and of
+    // the paths scattering in media
+    std::vector<std::uint32_t> _active;
+    std::array<std::vector<std::uint32_t>, num_material_kinds> _queues;
+    std::vector<std::uint32_t> _medium_queue;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "lights.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "material.h"
+#include "rt_utils.h"
+
+namespace
+{
+
+// Points this close to a light's surface, relative to its radius, are on it
+constexpr real_t surface_tolerance = 1e-3;
+
+// CIE standard clear sky (type 12) gradation and indicatrix coefficients
+constexpr real_t sky_a = -1.0;
+constexpr real_t sky_b = -0.32;
+constexpr real_t sky_c = 10.0;
+constexpr real_t sky_d = -3.0;
+constexpr real_t sky_e = 0.45;
+
+// Luminance relative to the horizon, by cosine of the zenith angle
+real_t sky_gradation(real_t cos_zenith)
+{
+    return 1 + sky_a * std::exp(sky_b / cos_zenith);
+}
+
+// Relative luminance by angle from the sun
+real_t sky_indicatrix(real_t gamma)
+{
+    const real_t cos_gamma = std::cos(gamma);
+    return 1 + sky_c * (std::exp(sky_d * gamma) - std::exp(sky_d * pi / 2)) + sky_e * cos_gamma * cos_gamma;
+}
+
+/**
+ * One minus the cosine of the half-angle a sphere subtends from distance
+ * d, or zero from inside. Written in terms of the sine so that the sun,
+ * which subtends a tiny angle, does not lose its precision to cancellation.
+ */
+real_t cone_one_minus_cos(real_t radius, real_t d2)
+{
+    const real_t r2 = radius * radius;
+    if (d2 <= r2)
+        return 0.0;
+
+    const real_t sin2 = r2 / d2;
+    return sin2 / (1 + std::sqrt(1 - sin2));
+}
+
+// Uniform within one_minus_cos_max of unit direction w, about a frame whose
+// third axis is w
+direction sample_cone(const direction& w, real_t one_minus_cos_max, const sample_2d& u, real_t& cos_theta, real_t& sin_theta)
+{
+    direction t;
+    direction s;
+    orthonormal_basis(w, t, s);
+
+    const real_t one_minus_cos = u.u * one_minus_cos_max;
+    cos_theta = 1 - one_minus_cos;
+    sin_theta = std::sqrt(std::max(real_t(0), one_minus_cos * (2 - one_minus_cos)));
+    const real_t phi = 2 * pi * u.v;
+    return (sin_theta * std::cos(phi)) * t + (sin_theta * std::sin(phi)) * s + cos_theta * w;
+}
+
+} /* Anonymous namespace */
+
+void light_list::add_sphere(const position& centre, real_t radius, const material* mat)
+{
+    _spheres.push_back({ centre, radius, mat });
+}
+
+void light_list::add_distant(const direction& to_light, real_t angular_diameter, const colour& c)
+{
+    if (!(angular_diameter > 0.0 && angular_diameter < pi))
+        throw std::runtime_error("Distant light must be between 0 and 180 degrees across");
+
+    const real_t half_sin = std::sin(angular_diameter / 4);
+    const real_t one_minus_cos_max = 2 * half_sin * half_sin;
+    const real_t sin2_max = one_minus_cos_max * (2 - one_minus_cos_max);
+    _distant.push_back({ normalise(to_light), 1 - one_minus_cos_max, one_minus_cos_max, c / (pi * sin2_max) });
+}
+
+void light_list::set_sky(const colour& zenith, const direction& to_sun)
+{
+    _has_sky = true;
+    _sky_zenith = zenith;
+    _sky_sun = normalise(to_sun);
+
+    const real_t sun_zenith = std::acos(std::min(real_t(1), std::max(real_t(-1), _sky_sun.y)));
+    _sky_scale = 1 / (sky_indicatrix(sun_zenith) * sky_gradation(1.0));
+}
+
+bool light_list::sample(
+        const position& p,
+        const wavelengths& lambdas,
+        real_t u_light,
+        const sample_2d& u,
+        light_sample& out) const
+{
+    if (!can_sample())
+        return false;
+
+    const std::size_t n = size();
+    const std::size_t chosen = std::min(static_cast<std::size_t>(u_light * n), n - 1);
+    real_t cos_theta;
+    real_t sin_theta;
+
+    if (chosen >= _spheres.size())
+    {
+        const distant_light& l = _distant[chosen - _spheres.size()];
+        out.dir = sample_cone(l.to_light, l.one_minus_cos_max, u, cos_theta, sin_theta);
+        out.distance = infinity;
+        out.pdf = 1 / (2 * pi * l.one_minus_cos_max * n);
+        out.radiance = rgb_to_spectrum(l.radiance, lambdas);
+        return true;
+    }
+
+    const sphere_light& l = _spheres[chosen];
+    const direction to_centre = l.centre - p;
+    const real_t d2 = to_centre.length2();
+    const real_t one_minus_cos_max = cone_one_minus_cos(l.radius, d2);
+    if (one_minus_cos_max <= 0.0)
+        return false;
+
+    const real_t d = std::sqrt(d2);
+    out.dir = sample_cone(to_centre / d, one_minus_cos_max, u, cos_theta, sin_theta);
+
+    // Nearer intersection with the sphere, from the closest approach
+    const real_t r2 = l.radius * l.radius;
+    out.distance = d * cos_theta - std::sqrt(std::max(real_t(0), r2 - d2 * sin_theta * sin_theta));
+    out.pdf = 1 / (2 * pi * one_minus_cos_max * n);
+    out.radiance = l.mat->emitted(lambdas);
+    return true;
+}
+
+real_t light_list::pdf(const position& p, const position& point) const
+{
+    for (const sphere_light& l : _spheres)
+    {
+        if (std::abs((point - l.centre).length() - l.radius) > surface_tolerance * l.radius)
+            continue;
+
+        const real_t one_minus_cos_max = cone_one_minus_cos(l.radius, (l.centre - p).length2());
+        return one_minus_cos_max > 0.0 ? choice_pdf() / (2 * pi * one_minus_cos_max) : 0.0;
+    }
+
+    return 0.0;
+}
+
+real_t light_list::pdf(const direction& dir) const
+{
+    real_t sum = 0.0;
+    for (const distant_light& l : _distant)
+    {
+        if (dot(dir, l.to_light) >= l.cos_max)
+            sum += choice_pdf() / (2 * pi * l.one_minus_cos_max);
+    }
+
+    return sum;
+}
+
+spectral_sample light_list::distant(const direction& dir, const wavelengths& lambdas) const
+{
+    colour c(0.0, 0.0, 0.0);
+    for (const distant_light& l : _distant)
+    {
+        if (dot(dir, l.to_light) >= l.cos_max)
+            c += l.radiance;
+    }
+
+    return rgb_to_spectrum(c, lambdas);
+}
+
+spectral_sample light_list::sky(const direction& dir, const wavelengths& lambdas) const
+{
+    // The ground below the horizon is black
+    if (!_has_sky || dir.y <= 0.0)
+        return spectral_sample(0.0);
+
+    const real_t gamma = std::acos(std::min(real_t(1), std::max(real_t(-1), dot(dir, _sky_sun))));
+    const real_t relative = sky_indicatrix(gamma) * sky_gradation(dir.y) * _sky_scale;
+    return rgb_to_spectrum(_sky_zenith * relative, lambdas);
+}
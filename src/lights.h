@@ -0,0 +1,107 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <cstddef>
+#include <vector>
+
+#include "real_type.h"
+#include "sampler.h"
+#include "spectrum.h"
+#include "vec3.h"
+
+class material;
+
+struct light_sample
+{
+    direction dir;              // Unit direction from the shading point
+    real_t distance;            // To the light's surface along dir, infinite for distant lights
+    real_t pdf;                 // Per unit solid angle, including the choice of light
+    spectral_sample radiance;   // Arriving along dir, if nothing blocks it
+};
+
+/**
+ * The emitters of a scene, for next-event estimation: spheres with light
+ * materials, and distant lights like the sun that are only a cone of
+ * directions. A light is chosen uniformly, then a direction is sampled
+ * uniformly within the cone it subtends. For a small, distant sphere like
+ * the sun, this wastes far fewer samples than picking points on its
+ * surface.
+ *
+ * Distant lights and the sky are not geometry: rays that escape the world
+ * see them through background(), so they cost no intersection tests.
+ */
+class light_list
+{
+public:
+    void add_sphere(const position& centre, real_t radius, const material* mat);
+
+    /**
+     * A disc of angular_diameter radians in the direction to_light, of
+     * uniform radiance, giving the irradiance c on a surface facing it
+     */
+    void add_distant(const direction& to_light, real_t angular_diameter, const colour& c);
+
+    /**
+     * Light from the rest of the sky, above the horizon: the CIE standard
+     * clear sky, brightest around the sun at to_sun and toward the horizon
+     * away from it, scaled to radiance zenith straight up
+     */
+    void set_sky(const colour& zenith, const direction& to_sun);
+
+    // With sampling off the lights are only found by running into them
+    void set_sampling(bool enabled) { _sampling = enabled; }
+    bool can_sample() const { return _sampling && size() > 0; }
+
+    std::size_t size() const { return _spheres.size() + _distant.size(); }
+
+    // Whether background() can be anything but black
+    bool has_background() const { return _has_sky || !_distant.empty(); }
+
+    // A direction toward a light from p, or false if p is inside the light
+    bool sample(
+            const position& p,
+            const wavelengths& lambdas,
+            real_t u_light,
+            const sample_2d& u,
+            light_sample& out) const;
+
+    // The density sample() has for the direction from p to point, which
+    // must be on a light sphere's surface; zero if it is on none
+    real_t pdf(const position& p, const position& point) const;
+
+    // The density sample() has for unit direction dir toward distant lights
+    real_t pdf(const direction& dir) const;
+
+    // Radiance of distant lights, and of the sky, seen along unit direction dir
+    spectral_sample distant(const direction& dir, const wavelengths& lambdas) const;
+    spectral_sample sky(const direction& dir, const wavelengths& lambdas) const;
+
+private:
+    struct sphere_light
+    {
+        position centre;
+        real_t radius;
+        const material* mat;
+    };
+
+    struct distant_light
+    {
+        direction to_light;
+        real_t cos_max;
+        real_t one_minus_cos_max;
+        colour radiance;
+    };
+
+    real_t choice_pdf() const { return _sampling ? 1.0 / size() : 0.0; }
+
+    std::vector<sphere_light> _spheres;
+    std::vector<distant_light> _distant;
+    bool _sampling = true;
+
+    bool _has_sky = false;
+    colour _sky_zenith;
+    direction _sky_sun;
+    real_t _sky_scale = 0.0;    // Zenith over the luminance distribution there
+};
+
+#endif
@@ -4,14 +4,39 @@
 #include "camera.h"
 #include "hittable.h"
 #include "sphere.h"
+#include "bvh.h"
+#include "sphere_set.h"
 #include "rt_utils.h"
 #include "material.h"
+#include "render.h"
+#include "integrator.h"
+#include "spectrum.h"
+#include "options.h"
+#include "phase_function.h"
+#include "sample_buffer.h"
+#include "stats.h"
+#include "scene.h"
+#include "rain.h"
+#include "accum_buffer.h"
+#include "aov.h"
+#include "denoise.h"
+#include "medium.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
-
-#ifndef NO_OPENMP
-#include <omp.h>
-#endif
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 namespace materials
 {
@@ -23,39 +48,11 @@ const lambertian centre(colour(0.7, 0.3, 0.3));
 const metal left(colour(0.8, 0.8, 0.8), 0.0);
 const metal right(colour(0.8, 0.6, 0.2), 1.0);
 const dielectric glass(1.5);
-const dielectric water(1.33);
+const dielectric water(refractive_index::water());
 const light sun(colour(0.0, 1.0, 1.0));
 
 }
 
-colour ray_colour(const ray& r, const hittable& h, int depth)
-{
-    constexpr colour black(0.0, 0.0, 0.0);
-
-    if (depth <= 0)
-        return black;
-
-    hit_record rec;
-    if (h.hit(r, 0.001, infinity, rec))
-    {
-        if (rec.mat)
-        {
-            const colour emitted = rec.mat->emitted();
-            
-            ray scattered;
-            colour attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return emitted + attenuation * ray_colour(scattered, h, depth - 1);
-            
-            return emitted;
-        }
-
-        return black;
-    }
-
-    return black;
-}
-
 std::string progress_bar(int pc_progress)
 {
     constexpr int num_blocks = 50;
@@ -74,61 +71,641 @@ std::string progress_bar(int pc_progress)
     return bar;
 }
 
-int main(int argc, char* argv[])
+namespace
 {
-    const real_t aspect_ratio = 16.0 / 9.0;
-    const real_t width = 600.0;
-    const real_t height = width / aspect_ratio;
-    image rainbow(static_cast<std::size_t>(width), aspect_ratio);
 
-    hittable_list world;
-    world.add(std::make_unique<sphere>(position(0.0, 0.0, 10.0), 1, &materials::sun));
+// Distant sun irradiance on a surface facing it. White, so the bow's
+// colours are the droplets' own.
+const colour sun_irradiance(1.0, 1.0, 1.0);
+
+// Clear sky radiance straight up, about a twentieth of the sun's
+// irradiance per steradian
+const colour sky_zenith(0.03, 0.05, 0.09);
+
+// The sun sits behind the camera, so the bow is centred on the
+// antisolar point below the horizon
+direction sun_direction(real_t elevation_degrees)
+{
+    const real_t elevation = to_radians(elevation_degrees);
+    return direction(0.0, std::sin(elevation), std::cos(elevation));
+}
+
+// Sun elevation in degrees at frame number frame, moving evenly over the
+// animation
+real_t sun_elevation(const options& opts, std::uint32_t frame)
+{
+    if (opts.frames < 2)
+        return opts.sun_elevation;
+
+    const real_t f = static_cast<real_t>(frame) / (opts.frames - 1);
+    return opts.sun_elevation + f * (opts.sun_elevation_end - opts.sun_elevation);
+}
+
+// name with the frame number before its extension: rain.ppm becomes
+// rain.0007.ppm. Numbers are padded so the files sort in order.
+std::string frame_filename(const std::string& name, std::uint32_t frame, std::uint32_t frames)
+{
+    const std::string digits = std::to_string(frames - 1);
+    std::ostringstream number;
+    number << std::setw(std::max<int>(4, static_cast<int>(digits.size()))) << std::setfill('0') << frame;
+
+    const std::size_t slash = name.find_last_of("/\\");
+    const std::size_t dot = name.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == 0)
+        return name + '.' + number.str();
+    return name.substr(0, dot) + '.' + number.str() + name.substr(dot);
+}
+
+std::atomic<bool> stop_requested(false);
+
+void request_stop(int sig)
+{
+    stop_requested.store(true);
+
+    // A second signal kills the process as usual
+    std::signal(sig, SIG_DFL);
+}
+
+struct render_interrupted : public std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// Mean luminance below which pixels count as this bright when judging noise
+constexpr real_t adaptive_error_floor = 0.05;
 
-    for (int i = 0; i < static_cast<int>(width); i += 10)
+std::uint64_t samples_needed(const sample_buffer& samples, const render_pass& pass, const std::vector<tile>& region)
+{
+    std::uint64_t n = 0;
+    for (const tile& t : region)
     {
-        for (int j = 0; j < static_cast<int>(height); j += 10)
+        for (std::size_t y = t.y0; y < t.y1; ++y)
         {
-            real_t x = -1.0*aspect_ratio + (2.0*aspect_ratio * (static_cast<real_t>(i)/width));
-            real_t y = -1.0 + (2.0 * (static_cast<real_t>(j)/height));
-            world.add(std::make_unique<sphere>(position(x, y, -1.0), 0.1, &materials::water));
+            for (std::size_t x = t.x0; x < t.x1; ++x)
+            {
+                const std::uint32_t target = pass.target(x, y, samples.width());
+                if (target > samples.count(x, y))
+                    n += target - samples.count(x, y);
+            }
         }
     }
 
+    return n;
+}
+
+// Fewest samples of any pixel this render covers
+std::uint32_t min_count(const sample_buffer& samples, const std::vector<tile>& region)
+{
+    std::uint32_t n = std::numeric_limits<std::uint32_t>::max();
+    for (const tile& t : region)
+        for (std::size_t y = t.y0; y < t.y1; ++y)
+            for (std::size_t x = t.x0; x < t.x1; ++x)
+                n = std::min(n, samples.count(x, y));
+
+    return n;
+}
+
+// Variance of each pixel's mean luminance, row-major, to tell the denoiser
+// how much of each pixel is noise
+std::vector<real_t> mean_variances(const sample_buffer& samples)
+{
+    std::vector<real_t> v;
+    v.reserve(samples.width() * samples.height());
+    for (std::size_t y = 0; y < samples.height(); ++y)
+    {
+        for (std::size_t x = 0; x < samples.width(); ++x)
+        {
+            const pixel_stats& s = samples.stats(x, y);
+            v.push_back(s.count > 0 ? s.variance() / s.count : 0.0);
+        }
+    }
+
+    return v;
+}
+
+// First-hit features from the camera rays of each pixel's first few samples
+feature_buffer render_features(const path_integrator& paths, std::size_t width, std::size_t height)
+{
+    constexpr std::uint32_t feature_samples = 4;
+
+    feature_buffer features(width, height);
+    const long rows = static_cast<long>(height);
+#ifndef NO_OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (long y = 0; y < rows; ++y)
+        for (std::size_t x = 0; x < width; ++x)
+            for (std::uint32_t k = 0; k < feature_samples; ++k)
+                features.add(x, y, paths.features(x, y, k));
+
+    return features;
+}
+
+std::size_t num_pixels(const std::vector<tile>& region)
+{
+    std::size_t n = 0;
+    for (const tile& t : region)
+        n += t.width() * t.height();
+    return n;
+}
+
+/**
+ * Give up to pass_samples more samples to each pixel whose relative error is
+ * above the target, noisiest first, until the budget runs out. Returns the
+ * number of samples planned, zero once the image has converged.
+ */
+std::uint64_t plan_adaptive_pass(
+        const sample_buffer& samples,
+        const options& opts,
+        std::uint64_t budget,
+        std::vector<std::uint32_t>& targets)
+{
+    const std::uint64_t used = samples.total_count();
+    if (used >= budget)
+        return 0;
+
+    const std::size_t width = samples.width();
+    targets.resize(width * samples.height());
+
+    std::vector<std::pair<real_t, std::size_t>> noisy;
+    for (std::size_t y = 0; y < samples.height(); ++y)
+    {
+        for (std::size_t x = 0; x < width; ++x)
+        {
+            const pixel_stats& s = samples.stats(x, y);
+            targets[y * width + x] = s.count;
+
+            const real_t error = s.relative_error(adaptive_error_floor);
+            if (error > opts.target_error && s.count < opts.max_samples)
+                noisy.emplace_back(error, y * width + x);
+        }
+    }
+
+    std::sort(noisy.begin(), noisy.end(), std::greater<std::pair<real_t, std::size_t>>());
+
+    std::uint64_t remaining = budget - used;
+    std::uint64_t planned = 0;
+    for (const auto& pixel : noisy)
+    {
+        std::uint32_t& target = targets[pixel.second];
+        const std::uint64_t extra = std::min<std::uint64_t>(
+                std::min(opts.pass_samples, opts.max_samples - target), remaining);
+        if (extra == 0)
+            break;
+
+        target += static_cast<std::uint32_t>(extra);
+        remaining -= extra;
+        planned += extra;
+    }
+
+    return planned;
+}
+
+// m:ss, or h:mm:ss for long renders
+std::string format_duration(double seconds)
+{
+    const long total = std::lround(std::max(seconds, 0.0));
+    std::ostringstream os;
+    if (total >= 3600)
+        os << total / 3600 << ':' << std::setw(2) << std::setfill('0') << total / 60 % 60;
+    else
+        os << total / 60;
+    os << ':' << std::setw(2) << std::setfill('0') << total % 60;
+    return os.str();
+}
+
+void write_stats(const std::string& filename, const options& opts, const image& img, const stats_collector& stats)
+{
+    std::ofstream out(filename);
+    if (!out)
+        throw std::runtime_error("Cannot open " + filename);
+
+    const render_stats total = stats.total();
+    const double seconds = stats.seconds();
+    out << "{\n"
+        << "  \"mode\": \"" << (opts.mode == render_mode::phase ? "phase" : "path") << "\",\n"
+        << "  \"integrator\": \"" << (opts.wavefront ? "wavefront" : "path") << "\",\n"
+        << "  \"precision\": \"" << (sizeof(real_t) == sizeof(float) ? "float" : "double") << "\",\n"
+        << "  \"width\": " << img.width() << ",\n"
+        << "  \"height\": " << img.height() << ",\n"
+        << "  \"samples_per_pixel\": " << opts.samples_per_pixel << ",\n"
+        << "  \"max_depth\": " << opts.max_depth << ",\n"
+        << "  \"frames\": " << opts.frames << ",\n"
+        << "  \"threads\": " << num_render_workers() << ",\n"
+        << "  \"wall_seconds\": " << seconds << ",\n"
+        << "  \"rays_per_second\": " << (seconds > 0.0 ? total.rays / seconds : 0.0) << ",\n"
+        << "  \"counters\": ";
+    write_json(out, total, stats.ticks_per_second(), 2);
+    out << "\n}\n";
+
+    if (!out)
+        throw std::runtime_error("Failed to write " + filename);
+}
+
+// To filename, or stdout if it is empty
+void write_image(const image& img, const options& opts, real_t scale, const std::string& filename)
+{
+    std::ofstream file;
+    if (!filename.empty())
+    {
+        file.open(filename, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Cannot open " + filename);
+    }
+    std::ostream& out = filename.empty() ? std::cout : file;
+
+    // Exposure, gamma correction and quantisation all happen in one pass.
+    // Spectral estimates of saturated colours can dip slightly below
+    // zero; the output pass clips those.
+    const tonemap tm = { scale * opts.exposure, opts.gamma };
+    switch (opts.format)
+    {
+    case output_format::ppm:
+        write_ppm(out, img, tm);
+        break;
+    case output_format::ppm_ascii:
+        write_ppm_ascii(out, img, tm);
+        break;
+    case output_format::pfm:
+        write_pfm(out, img, tm.exposure);
+        break;
+    }
+
+    out.flush();
+    if (!out)
+        throw std::runtime_error("Failed to write image");
+}
+
+// The scene's light spheres, and the sun and sky at elevation degrees. The
+// sun and sky are not in the world: only escaping rays see them.
+light_list scene_lights(const scene& world_scene, const options& opts, real_t elevation)
+{
+    light_list lights = world_scene.lights();
+    const direction to_sun = sun_direction(elevation);
+    if (opts.distant_sun)
+        lights.add_distant(to_sun, to_radians(opts.sun_size), sun_irradiance);
+    if (opts.sky)
+        lights.set_sky(sky_zenith, to_sun);
+    lights.set_sampling(opts.light_sampling);
+    return lights;
+}
+
+// From --phase-table if it exists, otherwise traced and saved there
+phase_table load_phase_table(const options& opts)
+{
+    phase_table table;
+    std::ifstream cached(opts.phase_table_file);
+    if (!opts.phase_table_file.empty() && cached)
+    {
+        std::cerr << "Loading phase table from " << opts.phase_table_file << '\n';
+        table = phase_table::load(opts.phase_table_file);
+    }
+    else
+    {
+        std::cerr << "Building phase table from " << opts.phase_rays << " rays per wavelength\n";
+        const sphere droplet(position(0.0, 0.0, 0.0), 1.0, &materials::water);
+        table = phase_table::build(droplet, opts.phase_rays);
+
+        if (!opts.phase_table_file.empty())
+            table.save(opts.phase_table_file);
+    }
+
+    return table;
+}
+
+} /* Anonymous namespace */
+
+// Each renderer returns the scale that turns its image into radiance, which
+// is folded into the exposure of the single output pass
+
+real_t render_path(image& rainbow, const options& opts, stats_collector& stats)
+{
+    using clock = std::chrono::steady_clock;
+
+    const auto load_start = clock::now();
+    scene world_scene = !opts.scene_file.empty() ? scene::load(opts.scene_file)
+            : opts.rain ? rain_scene(opts.rain_params, !opts.distant_sun)
+            : default_scene(rainbow.width(), rainbow.height(), !opts.distant_sun);
+
+    // Saving builds the droplet trees, which the world then reuses
+    if (!opts.save_scene_file.empty())
+        world_scene.save(opts.save_scene_file);
+
+    // Checkpoints and partials record the scene they belong to, which has
+    // to be hashed before droplet fields take the droplets over
+    sample_source source;
+    source.sampler = static_cast<std::uint32_t>(opts.sampler);
+    source.seed_offset = opts.seed_offset;
+    source.first_sample = opts.first_sample;
+    if (!opts.checkpoint_file.empty() || !opts.partial_file.empty())
+        source.scene = world_scene.fingerprint();
+
+    std::vector<sphere_set*> droplet_sets;
+    const std::unique_ptr<bvh> world = world_scene.build_world(opts.compact_droplets, &droplet_sets);
+    light_list lights = scene_lights(world_scene, opts, sun_elevation(opts, 0));
+
+    // Generated rain falls from frame to frame; other scenes stay put
+    const bool falling = opts.frames > 1 && opts.rain && world_scene.num_droplet_arrays() > 0;
+    std::vector<droplet> fallen;
+
+    // Rain as a medium scatters with the phase function of a single drop
+    media volumes;
+    std::unique_ptr<droplet_phase> rain_phase;
+    if (opts.rain && opts.rain_params.model != rain_model::droplets)
+    {
+        rain_phase = std::make_unique<droplet_phase>(load_phase_table(opts));
+        volumes.add(rain_medium(opts.rain_params, *rain_phase));
+    }
+    std::cerr << "Scene has " << world_scene.num_spheres() << " spheres and "
+            << world_scene.num_droplets() << " droplets, ready in "
+            << std::chrono::duration<double, std::milli>(clock::now() - load_start).count() << " ms\n";
+
     const camera cam;
 
     const size_t img_width = rainbow.width();
     const size_t img_height = rainbow.height();
-    const int samples_per_pixel = 100;
-    const int max_depth = 10;
+    const std::uint32_t samples_per_pixel = opts.samples_per_pixel - opts.first_sample;
+
+    // The tiles this process renders, all of them unless the frame is split
+    const std::vector<tile> region = make_tiles(img_width, img_height, render_pass().tile_size, opts.first_tile, opts.end_tile);
+    if (region.empty())
+        throw std::runtime_error("--tile-range is outside the image, which has "
+                + std::to_string(make_tiles(img_width, img_height, render_pass().tile_size).size()) + " tiles");
 
-    int prev_progress = -1;
-    for (size_t j = 0; j < img_height; ++j)
+    const sampler samples_prototype(opts.sampler, opts.seed_offset);
+    const path_integrator paths(*world, lights, volumes, cam, img_width, img_height, opts.max_depth, samples_prototype);
+    std::vector<wavefront_integrator> wavefronts;
+    if (opts.wavefront)
     {
-        const int pc_progress = j * 100 / (img_height - 1);
-        if (pc_progress != prev_progress)
-            std::cerr << "\rProgress: " << progress_bar(pc_progress) << ' ' << pc_progress << '%';
-        prev_progress = pc_progress;
+        const int num_workers = num_render_workers();
+        wavefronts.reserve(num_workers);
+        for (int w = 0; w < num_workers; ++w)
+            wavefronts.emplace_back(*world, lights, volumes, cam, img_width, img_height, opts.max_depth, samples_prototype);
+    }
+
+    sample_buffer samples(img_width, img_height);
+    samples.set_source(source);
+    if (opts.resume)
+    {
+        samples = sample_buffer::load(opts.checkpoint_file);
+        if (samples.width() != img_width || samples.height() != img_height)
+            throw std::runtime_error("Checkpoint size does not match the image");
+        // More samples would continue a different sequence, so the rest of
+        // the render would not match an uninterrupted one
+        const sample_source& saved = samples.source();
+        if (saved.sampler != source.sampler)
+            throw std::runtime_error("Checkpoint was made with a different --sampler");
+        if (saved.seed_offset != source.seed_offset)
+            throw std::runtime_error("Checkpoint was made with a different --seed-offset");
+        if (saved.first_sample != source.first_sample)
+            throw std::runtime_error("Checkpoint was made with a different --sample-range");
+        if (saved.scene != source.scene)
+            throw std::runtime_error("Checkpoint was made for a different scene");
+        std::cerr << "Resuming from " << opts.checkpoint_file
+                << " with " << min_count(samples, region) << " samples per pixel\n";
+    }
+
+    const auto interval = std::chrono::duration<double>(opts.checkpoint_interval);
+    auto next_checkpoint = clock::now() + interval;
+    const bool checkpointing = !opts.checkpoint_file.empty();
+
+    // Uniform passes bring every pixel up to the base count; adaptive passes
+    // then spend what is left of the budget on the noisiest pixels
+    const std::uint32_t base_samples = opts.adaptive ? opts.min_samples : samples_per_pixel;
+    const std::uint64_t budget = std::uint64_t(samples_per_pixel) * num_pixels(region);
+    std::vector<std::uint32_t> targets;
+
+    // The progress line is redrawn when the percentage changes, and at least
+    // this often so the throughput figures stay live
+    const auto redraw_interval = std::chrono::milliseconds(500);
+
+    // Frames after the first move the scene in place, so the integrators,
+    // buffers and droplet arrays made above serve them all
+    for (std::uint32_t frame = 0; frame < opts.frames; ++frame)
+    {
+        if (frame > 0)
+        {
+            const auto update_start = clock::now();
+            lights = scene_lights(world_scene, opts, sun_elevation(opts, frame));
+
+            bool rebuilt = false;
+            if (falling)
+            {
+                for (std::size_t i = 0; i < droplet_sets.size(); ++i)
+                {
+                    fall(opts.rain_params, world_scene.droplets(i), world_scene.num_droplets(i), frame / opts.frame_rate, fallen);
+                    rebuilt |= droplet_sets[i]->update(fallen.data());
+                }
+                world->refit();
+            }
+            samples.clear();
+
+            std::cerr << "Frame " << frame << ": ";
+            if (falling)
+                std::cerr << "rain moved and tree " << (rebuilt ? "rebuilt" : "refit") << " in "
+                        << std::chrono::duration<double, std::milli>(clock::now() - update_start).count() << " ms\n";
+            else
+                std::cerr << "sun at " << sun_elevation(opts, frame) << " degrees\n";
+        }
+
+        auto last_redraw = clock::now();
+        const std::uint64_t start_samples = samples.total_count();
+        const std::uint64_t start_rays = stats.rays();
+        const double start_seconds = stats.seconds();
+
+        int prev_progress = -1;
+        for (;;)
+        {
+            render_pass pass;
+            pass.stats = &stats;
+            pass.first_sample = opts.first_sample;
+            pass.first_tile = opts.first_tile;
+            pass.end_tile = opts.end_tile;
+            std::uint64_t pass_samples = 0;
+            const std::uint32_t have_samples = min_count(samples, region);
+            if (have_samples < base_samples)
+            {
+                pass.target_samples = std::min(base_samples, have_samples + opts.pass_samples);
+                pass_samples = samples_needed(samples, pass, region);
+            }
+            else if (opts.adaptive)
+            {
+                pass_samples = plan_adaptive_pass(samples, opts, budget, targets);
+                pass.target_samples = 0;
+                pass.pixel_targets = targets.data();
+            }
+
+            if (pass_samples == 0)
+                break;
+
+            const std::uint64_t pass_start = samples.total_count();
+            const auto progress = [&] (std::size_t done, std::size_t total)
+            {
+                const std::uint64_t sampled = pass_start + pass_samples * done / total;
+                const int pc_progress = static_cast<int>(std::min<std::uint64_t>(sampled * 100 / budget, 100));
+                const auto now = clock::now();
+                if (pc_progress == prev_progress && now - last_redraw < redraw_interval)
+                    return;
+                prev_progress = pc_progress;
+                last_redraw = now;
 
-        // #pragma omp parallel for
-        for (size_t i = 0; i < img_width; ++i)
+                // The ETA assumes the rest of the budget goes at the rate so far;
+                // adaptive renders usually converge before spending it all
+                const double elapsed = stats.seconds() - start_seconds;
+                const double rays_per_second = elapsed > 0.0 ? (stats.rays() - start_rays) / elapsed : 0.0;
+                const std::uint64_t done_samples = sampled - start_samples;
+                std::ostringstream line;
+                line << "\rProgress: " << progress_bar(pc_progress) << ' ' << pc_progress << "% "
+                        << std::fixed << std::setprecision(2) << rays_per_second * 1e-6 << " Mrays/s";
+                if (done_samples > 0)
+                    line << " ETA " << format_duration(elapsed * (budget - std::min(sampled, budget)) / done_samples);
+                std::cerr << line.str() << "   " << std::flush;
+            };
+
+            const auto stop = [&] ()
+            {
+                const bool checkpoint_due = checkpointing && clock::now() >= next_checkpoint;
+                return stop_requested.load() || checkpoint_due;
+            };
+
+            const bool finished = opts.wavefront
+                    ? render_tile_batches(samples, pass,
+                            [&] (int worker, const tile& t, pixel_stats* accum)
+                            {
+                                wavefronts[worker].render_tile(t, pass, samples, accum);
+                            },
+                            progress, stop)
+                    : render_tiles(samples, pass,
+                            [&] (std::size_t x, std::size_t y, std::uint32_t index) { return paths.sample(x, y, index); },
+                            progress, stop);
+
+            // Checkpoints are taken between tiles; the unfinished part of the
+            // pass is picked up again straight afterwards
+            if (checkpointing && (!finished || clock::now() >= next_checkpoint))
+            {
+                samples.save(opts.checkpoint_file);
+                next_checkpoint = clock::now() + interval;
+            }
+
+            if (stop_requested.load())
+            {
+                std::cerr << '\n';
+                throw render_interrupted(checkpointing
+                        ? "Interrupted, progress saved to " + opts.checkpoint_file
+                        : "Interrupted");
+            }
+        }
+
+        if (checkpointing)
+            samples.save(opts.checkpoint_file);
+
+        if (!opts.partial_file.empty())
         {
-            for (int k = 0; k < samples_per_pixel; ++k)
+            const sample_range range = { source, opts.samples_per_pixel, 0, opts.first_tile, opts.end_tile };
+            accumulation_buffer(samples, range).save(opts.partial_file);
+        }
+
+        std::cerr << '\n';
+        if (opts.adaptive)
+        {
+            std::cerr << "Adaptive sampling used " << samples.total_count() << " of " << budget
+                    << " samples, " << static_cast<real_t>(samples.total_count()) / (img_width * img_height)
+                    << " per pixel on average\n";
+        }
+
+        image resolved = samples.resolve();
+        if (opts.denoise || !opts.aov_prefix.empty())
+        {
+            const auto start = clock::now();
+            const feature_buffer features = render_features(paths, img_width, img_height);
+            if (!opts.aov_prefix.empty())
+                features.save(opts.frames > 1 ? frame_filename(opts.aov_prefix, frame, opts.frames) : opts.aov_prefix);
+
+            if (opts.denoise)
             {
-                const real_t u = (i + random_real(-0.5, 0.5)) / (img_width-1);
-                const real_t v = (j + random_real(-0.5, 0.5)) / (img_height-1);
-                const ray r = cam.get_ray(u, v);
-                rainbow.at(i, img_height - 1 - j) += ray_colour(r, world, max_depth);
+                denoise_settings settings;
+                settings.iterations = opts.denoise_iterations;
+                image filtered = denoise(resolved, mean_variances(samples), features, settings);
+                swap(resolved, filtered);
             }
+
+            std::cerr << "Features and denoising took "
+                    << std::chrono::duration<double, std::milli>(clock::now() - start).count() << " ms\n";
         }
+
+        if (opts.frames > 1)
+            write_image(resolved, opts, 1.0, frame_filename(opts.output_file, frame, opts.frames));
+        swap(rainbow, resolved);
     }
 
-    std::cerr << '\n';
+    return 1.0;
+}
 
-    // Average out samples
-    rainbow.scale_brightness(1.0 / samples_per_pixel);
+real_t render_phase(image& rainbow, const options& opts)
+{
+    const phase_table table = load_phase_table(opts);
 
-    // Gamma correction
-    rainbow.transform([] (real_t m) { return std::sqrt(m); });
+    const camera cam;
+    render_phase_sky(rainbow, cam, table.angular_rgb(), sun_direction(opts.sun_elevation));
 
-    std::cout << rainbow;
+    // Optically thin rain: sky radiance is proportional to the phase function
+    constexpr real_t rain_scale = 8.0;
+    return rain_scale;
 }
+
+int main(int argc, char* argv[])
+{
+    options opts;
+    try
+    {
+        opts = parse_options(argc, argv);
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << '\n';
+        print_usage(std::cerr, argv[0]);
+        return 1;
+    }
+
+    if (opts.show_help)
+    {
+        print_usage(std::cout, argv[0]);
+        return 0;
+    }
+
+    const real_t aspect_ratio = 16.0 / 9.0;
+    const real_t width = 600.0;
+    image rainbow(static_cast<std::size_t>(width), aspect_ratio);
+
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+
+    try
+    {
+        stats_collector stats;
+        const real_t scale = opts.mode == render_mode::phase
+                ? render_phase(rainbow, opts)
+                : render_path(rainbow, opts, stats);
+
+        const std::uint64_t output_start = stats_ticks();
+
+        // A partial render's real output is its accumulation buffer, and
+        // an animation has written its frames already
+        if (opts.frames == 1 && (opts.partial_file.empty() || !opts.output_file.empty()))
+            write_image(rainbow, opts, scale, opts.output_file);
+        stats.add_output_ticks(stats_ticks() - output_start);
+
+        if (!opts.stats_file.empty())
+            write_stats(opts.stats_file, opts, rainbow, stats);
+    }
+    catch (const render_interrupted& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 130;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
\ No newline at end of file
@@ -1,58 +1,88 @@
 #include "material.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "vec3.h"
 #include "ray.h"
 #include "rt_utils.h"
 #include "hittable.h"
+#include "sampler.h"
 
 bool lambertian::scatter(
         const ray& ray_in,
         const hit_record& rec,
-        colour& attenuation,
-        ray& scattered) const
+        wavelengths& lambdas,
+        spectral_sample& attenuation,
+        ray& scattered,
+        sampler& s) const
 {
-    direction scatter_dir = rec.normal + random_unit_vector<direction>();
+    direction scatter_dir = rec.normal + s.unit_vector();
 
     // Catch degenerate scatter direction
     if (scatter_dir.near_zero())
         scatter_dir = rec.normal;
 
     scattered = ray(rec.p, scatter_dir);
-    attenuation = _albedo;
+    attenuation = rgb_to_spectrum(_albedo, lambdas);
     return true;
 }
 
+// scatter() picks directions with density cos/pi, which cancels the BSDF
+// times cosine down to the albedo
+void lambertian::evaluate(
+        const hit_record& rec,
+        const direction& dir,
+        const wavelengths& lambdas,
+        spectral_sample& f_cos,
+        real_t& pdf) const
+{
+    const real_t cosine = std::max(real_t(0), dot(rec.normal, dir));
+    pdf = cosine / pi;
+    f_cos = rgb_to_spectrum(_albedo, lambdas) * pdf;
+}
+
 
 bool metal::scatter(
         const ray& ray_in,
         const hit_record& rec,
-        colour& attenuation,
-        ray& scattered) const
+        wavelengths& lambdas,
+        spectral_sample& attenuation,
+        ray& scattered,
+        sampler& s) const
 {
     const direction reflected = reflect(normalise(ray_in.dir()), rec.normal);
-    scattered = ray(rec.p, reflected + _fuzz * random_unit_vector<direction>());
-    attenuation = _albedo;
+    scattered = ray(rec.p, reflected + _fuzz * s.unit_vector());
+    attenuation = rgb_to_spectrum(_albedo, lambdas);
     return dot(scattered.dir(), rec.normal) > 0;
 }
 
 bool dielectric::scatter(
         const ray& r_in,
         const hit_record& rec,
-        colour& attenuation,
-        ray& scattered) const
+        wavelengths& lambdas,
+        spectral_sample& attenuation,
+        ray& scattered,
+        sampler& s) const
 {
-    attenuation = colour(1.0, 1.0, 1.0);
-    const real_t refraction_ratio = rec.front_face ? (1.0/_ir) : _ir;
+    // A dispersive interface sends each wavelength a different way, so only
+    // the hero wavelength can follow the scattered ray
+    if (_ir.dispersive())
+        lambdas.terminate_secondary();
+
+    const real_t ir = _ir.at(lambdas[0]);
+    attenuation = spectral_sample(1.0);
+    const real_t refraction_ratio = rec.front_face ? (1.0/ir) : ir;
 
     const direction unit_direction = normalise(r_in.dir());
-    const real_t cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+    const real_t cos_theta = std::min<real_t>(dot(-unit_direction, rec.normal), 1.0);
     const real_t sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
 
     const bool cannot_refract = refraction_ratio * sin_theta > 1.0;
 
     // Total internal reflection or refraction    
     direction dir;
-    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_real())
+    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > s.get_1d())
         dir = reflect(unit_direction, rec.normal);
     else
         dir = refract(unit_direction, rec.normal, refraction_ratio);
@@ -69,11 +99,77 @@ real_t dielectric::reflectance(real_t cosine, real_t ref_idx)
     return r2 + (1.0 - r2) * std::pow((1 - cosine), 5);
 }
 
+refractive_index refractive_index::constant(real_t n)
+{
+    refractive_index ri;
+    ri._b[0] = n;
+    return ri;
+}
+
+refractive_index refractive_index::cauchy(real_t a, real_t b, real_t c)
+{
+    refractive_index ri;
+    ri._model = model::cauchy;
+    ri._b[0] = a;
+    ri._b[1] = b;
+    ri._b[2] = c;
+    return ri;
+}
+
+refractive_index refractive_index::sellmeier(const real_t (&b)[4], const real_t (&c)[4])
+{
+    refractive_index ri;
+    ri._model = model::sellmeier;
+    for (int i = 0; i < 4; ++i)
+    {
+        ri._b[i] = b[i];
+        ri._c[i] = c[i];
+    }
+    return ri;
+}
+
+refractive_index refractive_index::water()
+{
+    constexpr real_t b[4] = { 5.684027565e-1, 1.726177391e-1, 2.086189578e-2, 1.130748688e-1 };
+    constexpr real_t c[4] = { 5.101829712e-3, 1.821153936e-2, 2.620722293e-2, 1.069792721e1 };
+    return sellmeier(b, c);
+}
+
+real_t refractive_index::at(real_t lambda_nm) const
+{
+    const real_t l = lambda_nm * 1e-3;
+    const real_t l2 = l * l;
+
+    switch (_model)
+    {
+    case model::constant:
+        return _b[0];
+    case model::cauchy:
+        return _b[0] + _b[1] / l2 + _b[2] / (l2 * l2);
+    case model::sellmeier:
+    {
+        real_t n2 = 1.0;
+        for (int i = 0; i < 4; ++i)
+            n2 += _b[i] * l2 / (l2 - _c[i]);
+        return std::sqrt(n2);
+    }
+    }
+
+    return _b[0];
+}
+
 bool light::scatter(
         const ray& r_in,
         const hit_record& rec,
-        colour& attenuation,
-        ray& scattered) const
+        wavelengths& lambdas,
+        spectral_sample& attenuation,
+        ray& scattered,
+        sampler& s) const
 {
     return false;
 }
+
+spectral_sample light::emitted(const wavelengths& lambdas) const
+{
+    return rgb_to_spectrum(_c, lambdas);
+}
\ No newline at end of file
@@ -2,38 +2,106 @@
 #define MATERIAL_H
 
 #include "vec3.h"
+#include "spectrum.h"
 
 struct hit_record;
 class ray;
+class sampler;
+
+/**
+ * The concrete material classes, so batched integrators can group hits by
+ * material and call each class's scatter directly.
+ */
+enum class material_kind
+{
+    lambertian,
+    metal,
+    dielectric,
+    light
+};
+
+constexpr int num_material_kinds = 4;
 
 class material
 {
 public:
+    virtual ~material() = default;
+
+    virtual material_kind kind() const = 0;
+
+    /**
+     * Scatter r_in at rec, giving the attenuation at each of the path's
+     * wavelengths. Random choices are drawn from s, which the caller has
+     * moved to this bounce's dimensions. Dispersive materials may terminate
+     * the secondary wavelengths.
+     */
     virtual bool scatter(
             const ray& r_in,
             const hit_record& rec,
-            colour& attenuation,
-            ray& scattered) const = 0;
-
-    virtual colour emitted() const { return { 0.0, 0.0, 0.0 }; }
+            wavelengths& lambdas,
+            spectral_sample& attenuation,
+            ray& scattered,
+            sampler& s) const = 0;
+
+    virtual spectral_sample emitted(const wavelengths& lambdas) const { return spectral_sample(0.0); }
+
+    /**
+     * Whether the material has a BSDF that evaluate() can give for any
+     * direction, so light sampling can connect to it. Materials that
+     * scatter into discrete directions, or whose scattering has no known
+     * density, do not.
+     */
+    virtual bool smooth() const { return false; }
+
+    /**
+     * For smooth materials: the BSDF at rec times the cosine toward unit
+     * direction dir, and the density per solid angle with which scatter()
+     * picks dir.
+     */
+    virtual void evaluate(
+            const hit_record& rec,
+            const direction& dir,
+            const wavelengths& lambdas,
+            spectral_sample& f_cos,
+            real_t& pdf) const
+    {
+        f_cos = spectral_sample(0.0);
+        pdf = 0.0;
+    }
+
+    // Surface colour for the albedo AOV; clear and emitting materials are white
+    virtual colour albedo() const { return colour(1.0, 1.0, 1.0); }
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
     explicit lambertian(const colour& a) : _albedo(a) {}
 
+    material_kind kind() const override { return material_kind::lambertian; }
+    colour albedo() const override { return _albedo; }
+    bool smooth() const override { return true; }
+
     bool scatter(
             const ray& ray_in,
             const hit_record& rec,
-            colour& attenuation,
-            ray& scattered) const override;
+            wavelengths& lambdas,
+            spectral_sample& attenuation,
+            ray& scattered,
+            sampler& s) const override;
+
+    void evaluate(
+            const hit_record& rec,
+            const direction& dir,
+            const wavelengths& lambdas,
+            spectral_sample& f_cos,
+            real_t& pdf) const override;
 
 private:
     colour _albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
     metal(const colour& a, real_t f)
@@ -41,46 +109,93 @@ public:
     ,   _fuzz(f < 1 ? f : 1)
     {}
 
+    material_kind kind() const override { return material_kind::metal; }
+    colour albedo() const override { return _albedo; }
+
     bool scatter(
             const ray& ray_in,
             const hit_record& rec,
-            colour& attenuation,
-            ray& scattered) const override;
+            wavelengths& lambdas,
+            spectral_sample& attenuation,
+            ray& scattered,
+            sampler& s) const override;
 
 private:
     colour _albedo;
     real_t _fuzz;
 };
 
-class dielectric : public material
+/**
+ * Wavelength-dependent index of refraction, either constant, Cauchy
+ * (n = A + B/l^2 + C/l^4) or Sellmeier (n^2 = 1 + sum B_i l^2 / (l^2 - C_i)),
+ * with l in micrometres as the published coefficients use.
+ */
+class refractive_index
 {
 public:
-    explicit dielectric(real_t ior) : _ir(ior) {}
+    static refractive_index constant(real_t n);
+    static refractive_index cauchy(real_t a, real_t b, real_t c = 0.0);
+    static refractive_index sellmeier(const real_t (&b)[4], const real_t (&c)[4]);
+
+    // Distilled water at 20C (Daimon and Masumura, 2007)
+    static refractive_index water();
+
+    real_t at(real_t lambda_nm) const;
+    bool dispersive() const { return _model != model::constant; }
+
+private:
+    enum class model
+    {
+        constant,
+        cauchy,
+        sellmeier
+    };
+
+    refractive_index() = default;
+
+    model _model = model::constant;
+    real_t _b[4] = {};
+    real_t _c[4] = {};
+};
+
+class dielectric final : public material
+{
+public:
+    explicit dielectric(real_t ior) : _ir(refractive_index::constant(ior)) {}
+    explicit dielectric(const refractive_index& ior) : _ir(ior) {}
+
+    material_kind kind() const override { return material_kind::dielectric; }
 
     bool scatter(
             const ray& r_in,
             const hit_record& rec,
-            colour& attenuation,
-            ray& scattered) const override;
+            wavelengths& lambdas,
+            spectral_sample& attenuation,
+            ray& scattered,
+            sampler& s) const override;
 
 private:
     static real_t reflectance(real_t cosine, real_t ref_idx);
 
-    real_t _ir; // Index of Refraction
+    refractive_index _ir;
 };
 
-class light : public material
+class light final : public material
 {
 public:
     explicit light(const colour& c) : _c(c) {}
 
+    material_kind kind() const override { return material_kind::light; }
+
     bool scatter(
             const ray& r_in,
             const hit_record& rec,
-            colour& attenuation,
-            ray& scattered) const override;
+            wavelengths& lambdas,
+            spectral_sample& attenuation,
+            ray& scattered,
+            sampler& s) const override;
 
-    colour emitted() const override { return _c; };
+    spectral_sample emitted(const wavelengths& lambdas) const override;
 
 private:
     colour _c;
@@ -0,0 +1,163 @@
+#include "medium.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "rt_utils.h"
+
+medium::medium(const aabb& box, real_t sigma_t, const droplet_phase& phase)
+:   _box(box)
+,   _sigma_t(sigma_t)
+,   _phase(phase)
+{
+    if (!(sigma_t >= 0.0))
+        throw std::runtime_error("Medium extinction must not be negative");
+}
+
+bool medium::clip(const ray& r, real_t t_min, real_t t_max, real_t& t0, real_t& t1) const
+{
+    t0 = t_min;
+    t1 = t_max;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const real_t o = aabb::component(r.origin(), axis);
+        const real_t inv = 1 / aabb::component(r.dir(), axis);
+        real_t near = (aabb::component(_box.min(), axis) - o) * inv;
+        real_t far = (aabb::component(_box.max(), axis) - o) * inv;
+        if (inv < 0.0)
+            std::swap(near, far);
+        t0 = near > t0 ? near : t0;
+        t1 = far < t1 ? far : t1;
+        if (t1 <= t0)
+            return false;
+    }
+
+    return true;
+}
+
+grid_medium::grid_medium(
+        const aabb& box,
+        real_t sigma_t,
+        const droplet_phase& phase,
+        std::size_t nx,
+        std::size_t ny,
+        std::size_t nz,
+        std::vector<float> values)
+:   medium(box, sigma_t, phase)
+,   _n{ nx, ny, nz }
+,   _values(std::move(values))
+{
+    if (nx == 0 || ny == 0 || nz == 0 || _values.size() != nx * ny * nz)
+        throw std::runtime_error("Medium grid does not match its size");
+
+    const float largest = *std::max_element(_values.begin(), _values.end());
+    if (!(largest > 0.0f))
+        throw std::runtime_error("Medium grid is empty");
+    for (float& v : _values)
+        v = std::max(v, 0.0f) / largest;
+
+    const direction e = box.extent();
+    const direction cell(e.x / nx, e.y / ny, e.z / nz);
+    _origin = box.min() + 0.5 * cell;
+    _inv_cell = direction(1 / cell.x, 1 / cell.y, 1 / cell.z);
+}
+
+real_t grid_medium::density(const position& p) const
+{
+    const direction g = (p - _origin) * _inv_cell;
+
+    std::size_t i0[3];
+    std::size_t i1[3];
+    real_t f[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const real_t last = static_cast<real_t>(_n[axis] - 1);
+        const real_t c = clamp(aabb::component(g, axis), 0.0, last);
+        i0[axis] = static_cast<std::size_t>(c);
+        i1[axis] = std::min(i0[axis] + 1, _n[axis] - 1);
+        f[axis] = c - i0[axis];
+    }
+
+    const auto at = [&] (std::size_t x, std::size_t y, std::size_t z)
+    {
+        return static_cast<real_t>(_values[(z * _n[1] + y) * _n[0] + x]);
+    };
+
+    const real_t x00 = at(i0[0], i0[1], i0[2]) + f[0] * (at(i1[0], i0[1], i0[2]) - at(i0[0], i0[1], i0[2]));
+    const real_t x10 = at(i0[0], i1[1], i0[2]) + f[0] * (at(i1[0], i1[1], i0[2]) - at(i0[0], i1[1], i0[2]));
+    const real_t x01 = at(i0[0], i0[1], i1[2]) + f[0] * (at(i1[0], i0[1], i1[2]) - at(i0[0], i0[1], i1[2]));
+    const real_t x11 = at(i0[0], i1[1], i1[2]) + f[0] * (at(i1[0], i1[1], i1[2]) - at(i0[0], i1[1], i1[2]));
+    const real_t y0 = x00 + f[1] * (x10 - x00);
+    const real_t y1 = x01 + f[1] * (x11 - x01);
+    return y0 + f[2] * (y1 - y0);
+}
+
+void media::add(std::unique_ptr<medium> m)
+{
+    _media.push_back(std::move(m));
+}
+
+bool media::sample_event(const ray& r, real_t t_min, real_t t_max, philox_stream& rng, medium_event& out) const
+{
+    // Each medium scatters independently, so the nearest of their events
+    // is the first. Distances along r are in units of its direction.
+    const real_t speed = r.dir().length();
+    bool scattered = false;
+    for (const std::unique_ptr<medium>& m : _media)
+    {
+        real_t t0;
+        real_t t1;
+        if (m->sigma_t() <= 0.0 || !m->clip(r, t_min, t_max, t0, t1))
+            continue;
+
+        const real_t inv_majorant = 1 / (m->sigma_t() * speed);
+        for (real_t t = t0;;)
+        {
+            t -= std::log(1 - random_real(rng)) * inv_majorant;
+            if (t >= t1)
+                break;
+
+            // A real collision, rather than a null one that leaves the ray be
+            if (m->homogeneous() || random_real(rng) < m->density(r.at(t)))
+            {
+                out = { t, m.get() };
+                t_max = t;
+                scattered = true;
+                break;
+            }
+        }
+    }
+
+    return scattered;
+}
+
+real_t media::transmittance(const ray& r, real_t t_min, real_t t_max, philox_stream& rng) const
+{
+    const real_t speed = r.dir().length();
+    real_t result = 1.0;
+    for (const std::unique_ptr<medium>& m : _media)
+    {
+        real_t t0;
+        real_t t1;
+        if (m->sigma_t() <= 0.0 || !m->clip(r, t_min, t_max, t0, t1))
+            continue;
+
+        if (m->homogeneous())
+        {
+            result *= std::exp(-m->sigma_t() * speed * (t1 - t0));
+            continue;
+        }
+
+        const real_t inv_majorant = 1 / (m->sigma_t() * speed);
+        for (real_t t = t0;;)
+        {
+            t -= std::log(1 - random_real(rng)) * inv_majorant;
+            if (t >= t1)
+                break;
+            result *= 1 - m->density(r.at(t));
+        }
+    }
+
+    return result;
+}
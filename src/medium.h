@@ -0,0 +1,105 @@
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "aabb.h"
+#include "philox.h"
+#include "ray.h"
+#include "real_type.h"
+#include "vec3.h"
+
+class droplet_phase;
+
+/**
+ * A box filled with scatterers too many and too small to be geometry, like
+ * the drops of a rain curtain. Extinction is sigma_t per unit length times
+ * density(), which is at most one, so sigma_t bounds it (the majorant) for
+ * tracking. Light that is not scattered out is lost: the phase function's
+ * albedo says how much of it scattering passes on.
+ */
+class medium
+{
+public:
+    medium(const aabb& box, real_t sigma_t, const droplet_phase& phase);
+    virtual ~medium() = default;
+
+    // Relative to sigma_t, at a point inside the box
+    virtual real_t density(const position& p) const { return 1.0; }
+    virtual bool homogeneous() const { return true; }
+
+    real_t sigma_t() const { return _sigma_t; }
+    const droplet_phase& phase() const { return _phase; }
+
+    // The stretch of r in [t_min, t_max] inside the box, if there is one
+    bool clip(const ray& r, real_t t_min, real_t t_max, real_t& t0, real_t& t1) const;
+
+private:
+    aabb _box;
+    real_t _sigma_t;
+    const droplet_phase& _phase;
+};
+
+/**
+ * A medium whose density is interpolated trilinearly from a grid of values
+ * at cell centres spread over the box, clamped at its faces.
+ */
+class grid_medium final : public medium
+{
+public:
+    // Values are in x-fastest order, and are scaled so the largest is one
+    grid_medium(
+            const aabb& box,
+            real_t sigma_t,
+            const droplet_phase& phase,
+            std::size_t nx,
+            std::size_t ny,
+            std::size_t nz,
+            std::vector<float> values);
+
+    real_t density(const position& p) const override;
+    bool homogeneous() const override { return false; }
+
+private:
+    position _origin;       // Of the first cell centre
+    direction _inv_cell;    // Cells per unit length
+    std::size_t _n[3];
+    std::vector<float> _values;
+};
+
+// Where a ray was scattered, and by what
+struct medium_event
+{
+    real_t t;
+    const medium* where;
+};
+
+/**
+ * The media of a scene. Distances are sampled by delta tracking, which
+ * steps through each medium with its majorant and accepts a step with
+ * probability density(), so only the media a ray passes through cost
+ * anything, in proportion to the length it spends in them. Transmittance
+ * along shadow rays is estimated by ratio tracking, or exactly for
+ * homogeneous media. Both take their numbers from a stream, as the count
+ * they need is not fixed.
+ */
+class media
+{
+public:
+    void add(std::unique_ptr<medium> m);
+
+    bool empty() const { return _media.empty(); }
+
+    // The first scattering along r before t_max, or false if the ray gets there
+    bool sample_event(const ray& r, real_t t_min, real_t t_max, philox_stream& rng, medium_event& out) const;
+
+    // Fraction of light getting along r from t_min to t_max unscattered
+    real_t transmittance(const ray& r, real_t t_min, real_t t_max, philox_stream& rng) const;
+
+private:
+    std::vector<std::unique_ptr<medium>> _media;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "accum_buffer.h"
+#include "image.h"
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Combine the accumulation buffers of a frame rendered in pieces, for
+ * example by several rainbow_simulator --partial runs over different tile
+ * or sample ranges:
+ *
+ *   rainbow_merge part0.acc part1.acc ... [-o image] [--format ppm|pfm]
+ *                 [--exposure X] [--gamma G] [--save FILE]
+ *
+ * The image goes to stdout unless -o is given. --save writes the merged
+ * buffer as well, so merges can themselves be merged.
+ */
+
+namespace
+{
+
+void print_usage(std::ostream& os, const char* program)
+{
+    os << "Usage: " << program << " part.acc... [-o image] [--format ppm|pfm]\n"
+       << "       [--exposure X] [--gamma G] [--save merged.acc]\n";
+}
+
+// The value of flag, which must be a number and nothing else
+double to_real(const std::string& flag, const std::string& s)
+{
+    std::size_t pos = 0;
+    double v;
+    try
+    {
+        v = std::stod(s, &pos);
+    }
+    catch (const std::invalid_argument&)
+    {
+        throw std::runtime_error("Invalid numeric argument for " + flag + ": " + s);
+    }
+    catch (const std::out_of_range&)
+    {
+        throw std::runtime_error("Numeric argument out of range for " + flag + ": " + s);
+    }
+
+    if (pos != s.size())
+        throw std::runtime_error("Invalid value for " + flag + ": " + s);
+    return v;
+}
+
+} /* Anonymous namespace */
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> files;
+    std::string output_file;
+    std::string save_file;
+    std::string format = "ppm";
+    tonemap tm;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool takes_value = arg == "-o" || arg == "--format" || arg == "--exposure"
+                    || arg == "--gamma" || arg == "--save";
+            if (takes_value && i + 1 == argc)
+                throw std::runtime_error("Missing value for " + arg);
+
+            if (arg == "-o")
+                output_file = argv[++i];
+            else if (arg == "--save")
+                save_file = argv[++i];
+            else if (arg == "--format")
+                format = argv[++i];
+            else if (arg == "--exposure")
+                tm.exposure = to_real(arg, argv[++i]);
+            else if (arg == "--gamma")
+                tm.gamma = to_real(arg, argv[++i]);
+            else if (arg == "-h" || arg == "--help")
+            {
+                print_usage(std::cout, argv[0]);
+                return 0;
+            }
+            else
+                files.push_back(arg);
+        }
+
+        if (files.empty())
+        {
+            print_usage(std::cerr, argv[0]);
+            return 1;
+        }
+        if (format != "ppm" && format != "pfm")
+            throw std::runtime_error("Unknown format: " + format);
+        if (!(tm.gamma > 0.0))
+            throw std::runtime_error("Gamma must be positive");
+
+        accumulation_buffer merged = accumulation_buffer::load(files[0]);
+        for (std::size_t i = 1; i < files.size(); ++i)
+            merged.add(accumulation_buffer::load(files[i]));
+
+        const std::size_t num_pixels = merged.width() * merged.height();
+        std::cerr << "Merged " << files.size() << " buffers, "
+                << static_cast<double>(merged.total_count()) / num_pixels << " samples per pixel on average\n";
+        if (merged.empty_pixels() > 0)
+            std::cerr << "Warning: " << merged.empty_pixels() << " pixels have no samples\n";
+
+        if (!save_file.empty())
+            merged.save(save_file);
+
+        std::ofstream file;
+        if (!output_file.empty())
+        {
+            file.open(output_file, std::ios::binary);
+            if (!file)
+                throw std::runtime_error("Cannot open " + output_file);
+        }
+        std::ostream& out = output_file.empty() ? std::cout : file;
+
+        const image img = merged.resolve();
+        if (format == "pfm")
+            write_pfm(out, img, tm.exposure);
+        else
+            write_ppm(out, img, tm);
+
+        out.flush();
+        if (!out)
+            throw std::runtime_error("Failed to write image");
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,425 @@
+#include "options.h"
+
+#include <stdexcept>
+#include <utility>
+
+namespace
+{
+
+class arg_reader
+{
+public:
+    arg_reader(int argc, char* argv[])
+    :   _argc(argc)
+    ,   _argv(argv)
+    {}
+
+    bool done() const { return _i >= _argc; }
+    std::string next() { return _argv[_i++]; }
+
+    std::string value(const std::string& flag)
+    {
+        if (done())
+            throw std::runtime_error("Missing value for " + flag);
+        return next();
+    }
+
+private:
+    int _argc;
+    char** _argv;
+    int _i = 1;
+};
+
+std::size_t to_size(const std::string& flag, const std::string& s)
+{
+    std::size_t pos = 0;
+    const unsigned long long v = std::stoull(s, &pos);
+    if (pos != s.size())
+        throw std::runtime_error("Invalid value for " + flag + ": " + s);
+    return static_cast<std::size_t>(v);
+}
+
+// Positive 32-bit count
+std::uint32_t to_count(const std::string& flag, const std::string& s)
+{
+    const std::size_t v = to_size(flag, s);
+    if (v == 0 || v > 0xffffffffu)
+        throw std::runtime_error("Invalid value for " + flag + ": " + s);
+    return static_cast<std::uint32_t>(v);
+}
+
+real_t to_real(const std::string& flag, const std::string& s)
+{
+    std::size_t pos = 0;
+    const double v = std::stod(s, &pos);
+    if (pos != s.size())
+        throw std::runtime_error("Invalid value for " + flag + ": " + s);
+    return static_cast<real_t>(v);
+}
+
+// Three comma-separated coordinates
+position to_position(const std::string& flag, const std::string& s)
+{
+    real_t v[3];
+    std::size_t start = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        const std::size_t end = i < 2 ? s.find(',', start) : s.size();
+        if (end == std::string::npos)
+            throw std::runtime_error("Invalid value for " + flag + ": " + s);
+        v[i] = to_real(flag, s.substr(start, end - start));
+        start = end + 1;
+    }
+    return position(v[0], v[1], v[2]);
+}
+
+// FIRST:END with FIRST < END
+std::pair<std::size_t, std::size_t> to_range(const std::string& flag, const std::string& s)
+{
+    const std::size_t colon = s.find(':');
+    if (colon == std::string::npos)
+        throw std::runtime_error("Invalid value for " + flag + ": " + s);
+
+    const std::size_t first = to_size(flag, s.substr(0, colon));
+    const std::size_t end = to_size(flag, s.substr(colon + 1));
+    if (first >= end)
+        throw std::runtime_error("Empty range for " + flag + ": " + s);
+    return std::make_pair(first, end);
+}
+
+} /* Anonymous namespace */
+
+options parse_options(int argc, char* argv[])
+{
+    options opts;
+    arg_reader args(argc, argv);
+    bool sun_moves = false;
+
+    try
+    {
+        while (!args.done())
+        {
+            const std::string flag = args.next();
+
+            if (flag == "-h" || flag == "--help")
+                opts.show_help = true;
+            else if (flag == "--mode")
+            {
+                const std::string mode = args.value(flag);
+                if (mode == "path")
+                    opts.mode = render_mode::path;
+                else if (mode == "phase")
+                    opts.mode = render_mode::phase;
+                else
+                    throw std::runtime_error("Unknown mode: " + mode);
+            }
+            else if (flag == "-o" || flag == "--output")
+                opts.output_file = args.value(flag);
+            else if (flag == "--format")
+            {
+                const std::string format = args.value(flag);
+                if (format == "ppm")
+                    opts.format = output_format::ppm;
+                else if (format == "ppm-ascii")
+                    opts.format = output_format::ppm_ascii;
+                else if (format == "pfm")
+                    opts.format = output_format::pfm;
+                else
+                    throw std::runtime_error("Unknown format: " + format);
+            }
+            else if (flag == "--exposure")
+                opts.exposure = to_real(flag, args.value(flag));
+            else if (flag == "--gamma")
+            {
+                opts.gamma = to_real(flag, args.value(flag));
+                if (opts.gamma <= 0.0)
+                    throw std::runtime_error("Gamma must be positive");
+            }
+            else if (flag == "--stats")
+                opts.stats_file = args.value(flag);
+            else if (flag == "--scene")
+                opts.scene_file = args.value(flag);
+            else if (flag == "--save-scene")
+                opts.save_scene_file = args.value(flag);
+            else if (flag == "--rain")
+                opts.rain = true;
+            else if (flag == "--compact-droplets")
+                opts.compact_droplets = true;
+            else if (flag == "--rain-min")
+                opts.rain_params.lower = to_position(flag, args.value(flag));
+            else if (flag == "--rain-max")
+                opts.rain_params.upper = to_position(flag, args.value(flag));
+            else if (flag == "--rain-density")
+                opts.rain_params.density = to_real(flag, args.value(flag));
+            else if (flag == "--rain-rate")
+                opts.rain_params.rain_rate = to_real(flag, args.value(flag));
+            else if (flag == "--drop-radius")
+            {
+                opts.rain_params.sizes = drop_sizes::fixed;
+                opts.rain_params.radius = to_real(flag, args.value(flag));
+            }
+            else if (flag == "--drop-scale")
+                opts.rain_params.units_per_mm = to_real(flag, args.value(flag));
+            else if (flag == "--rain-seed")
+                opts.rain_params.seed = to_size(flag, args.value(flag));
+            else if (flag == "--rain-medium")
+            {
+                const std::string model = args.value(flag);
+                if (model == "homogeneous")
+                    opts.rain_params.model = rain_model::homogeneous;
+                else if (model == "grid")
+                    opts.rain_params.model = rain_model::grid;
+                else
+                    throw std::runtime_error("Unknown rain medium: " + model);
+                opts.rain = true;
+            }
+            else if (flag == "--spp")
+                opts.samples_per_pixel = to_count(flag, args.value(flag));
+            else if (flag == "--pass-spp")
+                opts.pass_samples = to_count(flag, args.value(flag));
+            else if (flag == "--sampler")
+            {
+                const std::string kind = args.value(flag);
+                if (kind == "independent")
+                    opts.sampler = sampler_kind::independent;
+                else if (kind == "sobol")
+                    opts.sampler = sampler_kind::sobol;
+                else if (kind == "halton")
+                    opts.sampler = sampler_kind::halton;
+                else if (kind == "blue-noise")
+                    opts.sampler = sampler_kind::blue_noise;
+                else
+                    throw std::runtime_error("Unknown sampler: " + kind);
+            }
+            else if (flag == "--wavefront")
+                opts.wavefront = true;
+            else if (flag == "--max-depth")
+            {
+                const std::uint32_t depth = to_count(flag, args.value(flag));
+                if (depth > 100000)
+                    throw std::runtime_error("Invalid value for " + flag);
+                opts.max_depth = static_cast<int>(depth);
+            }
+            else if (flag == "--no-light-sampling")
+                opts.light_sampling = false;
+            else if (flag == "--denoise")
+                opts.denoise = true;
+            else if (flag == "--denoise-iterations")
+            {
+                const std::uint32_t iterations = to_count(flag, args.value(flag));
+                if (iterations > 10)
+                    throw std::runtime_error("Invalid value for " + flag);
+                opts.denoise_iterations = static_cast<int>(iterations);
+            }
+            else if (flag == "--aov")
+                opts.aov_prefix = args.value(flag);
+            else if (flag == "--checkpoint")
+                opts.checkpoint_file = args.value(flag);
+            else if (flag == "--checkpoint-interval")
+                opts.checkpoint_interval = to_real(flag, args.value(flag));
+            else if (flag == "--resume")
+                opts.resume = true;
+            else if (flag == "--partial")
+                opts.partial_file = args.value(flag);
+            else if (flag == "--tile-range")
+            {
+                const auto range = to_range(flag, args.value(flag));
+                opts.first_tile = range.first;
+                opts.end_tile = range.second;
+            }
+            else if (flag == "--sample-range")
+            {
+                const auto range = to_range(flag, args.value(flag));
+                if (range.second > 0xffffffffu)
+                    throw std::runtime_error("Invalid value for " + flag);
+                opts.first_sample = static_cast<std::uint32_t>(range.first);
+                opts.samples_per_pixel = static_cast<std::uint32_t>(range.second);
+            }
+            else if (flag == "--seed-offset")
+            {
+                const std::size_t offset = to_size(flag, args.value(flag));
+                if (offset > 0xffffffffu)
+                    throw std::runtime_error("Invalid value for " + flag);
+                opts.seed_offset = static_cast<std::uint32_t>(offset);
+            }
+            else if (flag == "--adaptive")
+                opts.adaptive = true;
+            else if (flag == "--min-spp")
+                opts.min_samples = to_count(flag, args.value(flag));
+            else if (flag == "--max-spp")
+                opts.max_samples = to_count(flag, args.value(flag));
+            else if (flag == "--target-error")
+            {
+                opts.target_error = to_real(flag, args.value(flag));
+                if (opts.target_error <= 0.0)
+                    throw std::runtime_error("Target error must be positive");
+            }
+            else if (flag == "--phase-table")
+                opts.phase_table_file = args.value(flag);
+            else if (flag == "--phase-rays")
+                opts.phase_rays = to_count(flag, args.value(flag));
+            else if (flag == "--sun-elevation")
+                opts.sun_elevation = to_real(flag, args.value(flag));
+            else if (flag == "--distant-sun")
+                opts.distant_sun = true;
+            else if (flag == "--sun-size")
+            {
+                opts.sun_size = to_real(flag, args.value(flag));
+                if (!(opts.sun_size > 0.0 && opts.sun_size < 180.0))
+                    throw std::runtime_error("Sun size must be between 0 and 180 degrees");
+            }
+            else if (flag == "--sky")
+                opts.sky = true;
+            else if (flag == "--frames")
+                opts.frames = to_count(flag, args.value(flag));
+            else if (flag == "--frame-rate")
+            {
+                opts.frame_rate = to_real(flag, args.value(flag));
+                if (!(opts.frame_rate > 0.0))
+                    throw std::runtime_error("Frame rate must be positive");
+            }
+            else if (flag == "--sun-elevation-end")
+            {
+                opts.sun_elevation_end = to_real(flag, args.value(flag));
+                sun_moves = true;
+            }
+            else
+                throw std::runtime_error("Unknown option: " + flag);
+        }
+    }
+    catch (const std::invalid_argument&)
+    {
+        throw std::runtime_error("Invalid numeric argument");
+    }
+    catch (const std::out_of_range&)
+    {
+        throw std::runtime_error("Numeric argument out of range");
+    }
+
+    if (!sun_moves)
+        opts.sun_elevation_end = opts.sun_elevation;
+
+    if (opts.rain && !opts.scene_file.empty())
+        throw std::runtime_error("--rain and --scene cannot be combined");
+
+    if (opts.resume && opts.checkpoint_file.empty())
+        throw std::runtime_error("--resume needs --checkpoint");
+
+    if (opts.first_sample >= opts.samples_per_pixel)
+        throw std::runtime_error("--sample-range is empty");
+
+    if (opts.mode == render_mode::phase && !opts.partial_file.empty())
+        throw std::runtime_error("--partial needs --mode path");
+
+    if (opts.mode == render_mode::phase && (opts.denoise || !opts.aov_prefix.empty()))
+        throw std::runtime_error("--denoise and --aov need --mode path");
+
+    if (opts.mode == render_mode::phase && (opts.distant_sun || opts.sky))
+        throw std::runtime_error("--distant-sun and --sky need --mode path");
+
+    if (opts.frames > 1)
+    {
+        if (opts.mode == render_mode::phase)
+            throw std::runtime_error("--frames needs --mode path");
+        if (opts.output_file.empty())
+            throw std::runtime_error("--frames needs -o to name the images");
+        if (!opts.checkpoint_file.empty() || !opts.partial_file.empty())
+            throw std::runtime_error("--frames cannot be combined with --checkpoint or --partial");
+        if (opts.compact_droplets && opts.rain && opts.rain_params.model == rain_model::droplets)
+            throw std::runtime_error("Falling rain cannot use --compact-droplets");
+    }
+
+    const bool partial_frame = opts.first_sample > 0 || opts.first_tile > 0 || opts.end_tile != SIZE_MAX;
+    if (opts.adaptive && partial_frame)
+        throw std::runtime_error("Adaptive sampling needs the whole frame");
+
+    if (opts.adaptive && !(opts.min_samples <= opts.samples_per_pixel && opts.samples_per_pixel <= opts.max_samples))
+        throw std::runtime_error("Adaptive sampling needs --min-spp <= --spp <= --max-spp");
+
+    return opts;
+}
+
+void print_usage(std::ostream& os, const char* program)
+{
+    os << "Usage: " << program << " [options] > image.ppm\n"
+       << "\n"
+       << "  --mode path|phase       Path trace the droplet scene (default), or light\n"
+       << "                          the sky from a single-droplet phase function\n"
+       << "  -o, --output FILE       Write the image to FILE instead of stdout\n"
+       << "  --format ppm|ppm-ascii|pfm\n"
+       << "                          Binary PPM (default), ASCII PPM or linear float PFM\n"
+       << "  --exposure X            Scale linear radiance by X before output\n"
+       << "  --gamma G               Display gamma for PPM output (default 2)\n"
+       << "  --stats FILE            Write ray counts, path statistics and timings to\n"
+       << "                          FILE as JSON\n"
+       << "  --scene FILE            Load the scene from FILE\n"
+       << "  --save-scene FILE       Save the scene to FILE for later --scene runs\n"
+       << "  --rain                  Replace the droplet grid with a rain curtain\n"
+       << "  --rain-min X,Y,Z        Lower corner of the rain box (default -4,-2.5,-8)\n"
+       << "  --rain-max X,Y,Z        Upper corner of the rain box (default 4,2.5,-2)\n"
+       << "  --rain-density D        Drops per unit volume (default 100)\n"
+       << "  --rain-rate R           Rain rate in mm/h setting the Marshall-Palmer drop\n"
+       << "                          size distribution (default 5)\n"
+       << "  --drop-scale S          Scene units per millimetre of drop (default 0.005)\n"
+       << "  --drop-radius R         Give every drop radius R instead\n"
+       << "  --rain-seed N           Seed for placing the drops (default 1)\n"
+       << "  --rain-medium KIND      Fill the rain box with a medium scattering like\n"
+       << "                          its drops, instead of the drops themselves:\n"
+       << "                          homogeneous, or grid for shafts of rain; implies\n"
+       << "                          --rain and uses the phase table options\n"
+       << "  --compact-droplets      Store droplets in 8 bytes each, with quantised\n"
+       << "                          positions and shared radii, for huge scenes\n"
+       << "  --spp N                 Samples per pixel, or the average with --adaptive\n"
+       << "                          (default 100)\n"
+       << "  --pass-spp N            Samples per pixel per progressive pass (default 10)\n"
+       << "  --sampler KIND          Random numbers for pixel positions, wavelengths,\n"
+       << "                          scattering and Russian roulette: independent\n"
+       << "                          (default), sobol, halton or blue-noise\n"
+       << "  --wavefront             Trace paths in batches sorted by material\n"
+       << "  --max-depth N           Most bounces per path (default 10)\n"
+       << "  --no-light-sampling     Find lights only by scattering into them, not\n"
+       << "                          with shadow rays from diffuse surfaces or media\n"
+       << "  --denoise               Filter the image guided by its normals, depths,\n"
+       << "                          albedos and material IDs\n"
+       << "  --denoise-iterations N  Passes of the filter, each twice as wide as the\n"
+       << "                          last (default 5)\n"
+       << "  --aov PREFIX            Write the normal, depth, albedo and material ID\n"
+       << "                          buffers to PREFIX-normal.pfm and so on\n"
+       << "  --checkpoint FILE       Save accumulated samples to FILE after each pass,\n"
+       << "                          at most every --checkpoint-interval seconds, on\n"
+       << "                          SIGINT/SIGTERM and at the end\n"
+       << "  --checkpoint-interval S Seconds between checkpoints (default 300)\n"
+       << "  --resume                Continue from the samples in the checkpoint file\n"
+       << "  --partial FILE          Also save the raw sample sums and counts to FILE\n"
+       << "                          for rainbow_merge; the image is only written if\n"
+       << "                          -o is given\n"
+       << "  --tile-range FIRST:END  Only render 16x16 tiles FIRST to END-1, counted\n"
+       << "                          in rows from the top left\n"
+       << "  --sample-range FIRST:END\n"
+       << "                          Only take samples FIRST to END-1 of each pixel,\n"
+       << "                          instead of --spp\n"
+       << "  --seed-offset N         Draw different random numbers, so separate runs\n"
+       << "                          of the same range can be merged (default 0)\n"
+       << "  --adaptive              Spend the sample budget on the noisiest pixels\n"
+       << "  --min-spp N             Samples every pixel gets first (default 16)\n"
+       << "  --max-spp N             Most samples any pixel gets (default 1024)\n"
+       << "  --target-error E        Stop sampling a pixel once the standard error of\n"
+       << "                          its mean luminance is below E times the mean\n"
+       << "                          (default 0.02)\n"
+       << "  --phase-table FILE      Load the phase function table from FILE, or build\n"
+       << "                          it and save it there if FILE does not exist\n"
+       << "  --phase-rays N          Rays per wavelength bin when building the table\n"
+       << "  --sun-elevation DEG     Sun elevation behind the camera (default 30), for\n"
+       << "                          phase mode, --distant-sun and --sky\n"
+       << "  --distant-sun           Light the scene with a sun at infinity, sampled\n"
+       << "                          directly, instead of the built-in sun sphere\n"
+       << "  --sun-size DEG          Angular diameter of the distant sun (default 0.53)\n"
+       << "  --sky                   Light escaping rays with a CIE clear sky\n"
+       << "  --frames N              Render N frames, to files numbered after the -o\n"
+       << "                          name (rain.ppm gives rain.0000.ppm and so on);\n"
+       << "                          --rain drops fall between frames\n"
+       << "  --frame-rate F          Frames per second of scene time (default 24)\n"
+       << "  --sun-elevation-end DEG Sun elevation at the last frame, moving evenly\n"
+       << "                          from --sun-elevation\n"
+       << "  -h, --help              Show this message\n";
+}
\ No newline at end of file
@@ -0,0 +1,95 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "real_type.h"
+#include "rain.h"
+#include "sampler.h"
+
+enum class render_mode
+{
+    path,   // Brute-force path tracing of the droplet scene
+    phase   // Sky lookup from a single-droplet phase function table
+};
+
+enum class output_format
+{
+    ppm,        // Binary P6
+    ppm_ascii,  // P3
+    pfm         // Linear floats
+};
+
+struct options
+{
+    render_mode mode = render_mode::path;
+
+    // Output
+    std::string output_file;    // Empty for stdout
+    output_format format = output_format::ppm;
+    real_t exposure = 1.0;
+    real_t gamma = 2.0;
+    std::string stats_file;     // JSON render statistics, if not empty
+
+    // Scene: loaded from a file, a generated rain curtain, or the built-in grid
+    std::string scene_file;
+    std::string save_scene_file;        // Write the scene used here
+    bool rain = false;
+    rain_curtain rain_params;
+    bool compact_droplets = false;      // Quantised droplet storage
+
+    // Path tracing mode
+    std::uint32_t samples_per_pixel = 100;
+    std::uint32_t pass_samples = 10;    // Samples per pixel per progressive pass
+    bool wavefront = false;             // Batched wavefront integrator
+    sampler_kind sampler = sampler_kind::independent;
+    int max_depth = 10;                 // Bounces; Russian roulette may stop paths sooner
+    bool light_sampling = true;         // Shadow rays toward lights from diffuse surfaces
+    bool denoise = false;               // Filter the image using its AOVs
+    int denoise_iterations = 5;
+    std::string aov_prefix;             // Write the AOVs to PREFIX-*.pfm, if not empty
+    std::string checkpoint_file;
+    real_t checkpoint_interval = 300.0; // Seconds
+    bool resume = false;
+
+    // Distributed rendering: render part of the frame into an accumulation
+    // buffer for rainbow_merge
+    std::string partial_file;
+    std::size_t first_tile = 0;         // Tiles [first_tile, end_tile) in row-major order
+    std::size_t end_tile = SIZE_MAX;
+    std::uint32_t first_sample = 0;     // Per-pixel samples [first_sample, samples_per_pixel)
+    std::uint32_t seed_offset = 0;      // Independent random streams per render
+
+    // Adaptive sampling: samples_per_pixel becomes the average budget
+    bool adaptive = false;
+    std::uint32_t min_samples = 16;     // Every pixel gets at least this many
+    std::uint32_t max_samples = 1024;   // No pixel gets more than this
+    real_t target_error = 0.02;         // Relative standard error to stop at
+
+    // Phase function mode
+    std::string phase_table_file;
+    std::size_t phase_rays = 2000000;
+
+    // Sun and sky
+    real_t sun_elevation = 30.0;    // Degrees
+    bool distant_sun = false;       // In place of the built-in scenes' sun sphere
+    real_t sun_size = 0.53;         // Degrees across
+    bool sky = false;               // Clear sky for rays that escape
+
+    // Animation: frames go to numbered files named after output_file
+    std::uint32_t frames = 1;
+    real_t frame_rate = 24.0;           // Frames per second of scene time
+    real_t sun_elevation_end = 30.0;    // Degrees at the last frame
+
+    bool show_help = false;
+};
+
+// Throws std::runtime_error on malformed arguments
+options parse_options(int argc, char* argv[]);
+
+void print_usage(std::ostream& os, const char* program);
+
+#endif
\ No newline at end of file
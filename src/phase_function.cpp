@@ -0,0 +1,332 @@
+#include "phase_function.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "camera.h"
+#include "hittable.h"
+#include "image.h"
+#include "material.h"
+#include "ray.h"
+#include "rt_utils.h"
+#include "sampler.h"
+#include "spectrum.h"
+
+namespace
+{
+
+constexpr char file_magic[4] = { 'A', 'T', 'P', 'F' };
+constexpr std::uint32_t file_version = 1;
+constexpr int max_interactions = 64;
+constexpr std::size_t rays_per_task = 1 << 16;
+
+constexpr real_t angle_step = pi / phase_table::num_angles;
+constexpr real_t lambda_step = (lambda_max - lambda_min) / phase_table::num_lambdas;
+
+std::size_t angle_bin(real_t cos_theta)
+{
+    const real_t theta = std::acos(clamp(cos_theta, -1.0, 1.0));
+    const std::size_t bin = static_cast<std::size_t>(theta / angle_step);
+    return std::min(bin, phase_table::num_angles - 1);
+}
+
+// Trace one ray through the droplet, drawing each interface's choice from
+// the next bounce of s. Returns false if it never got out.
+bool trace(const hittable& droplet, ray r, real_t t_min, real_t lambda, sampler& s, direction& out, int& interactions)
+{
+    interactions = 0;
+    for (;;)
+    {
+        s.start_bounce(interactions);
+        hit_record rec;
+        if (!droplet.hit(r, t_min, infinity, rec))
+            break;
+
+        if (interactions == max_interactions || rec.mat == nullptr)
+            return false;
+
+        wavelengths lambdas = wavelengths::single(lambda);
+        spectral_sample attenuation;
+        ray scattered;
+        if (!rec.mat->scatter(r, rec, lambdas, attenuation, scattered, s))
+            return false;
+
+        r = scattered;
+        ++interactions;
+    }
+
+    out = normalise(r.dir());
+    return interactions > 0;
+}
+
+} /* Anonymous namespace */
+
+real_t phase_table::angle_of(std::size_t angle_bin)
+{
+    return (angle_bin + 0.5) * angle_step;
+}
+
+real_t phase_table::lambda_of(std::size_t lambda_bin)
+{
+    return lambda_min + (lambda_bin + 0.5) * lambda_step;
+}
+
+phase_table phase_table::build(const hittable& droplet, std::size_t rays_per_lambda)
+{
+    if (rays_per_lambda == 0)
+        throw std::runtime_error("A phase table needs at least one ray per wavelength");
+
+    const aabb box = droplet.bounding_box();
+    const position centre = box.centroid();
+    const real_t radius = 0.5 * box.extent().x;
+    const direction incident(0.0, 0.0, 1.0);
+    const real_t t_min = 1e-9 * radius;
+
+    const std::size_t tasks_per_lambda = (rays_per_lambda + rays_per_task - 1) / rays_per_task;
+    const long num_tasks = static_cast<long>(tasks_per_lambda * num_lambdas);
+
+    std::vector<double> counts(num_orders * num_lambdas * num_angles, 0.0);
+
+#ifndef NO_OPENMP
+    #pragma omp parallel
+#endif
+    {
+        std::vector<std::uint32_t> local(num_orders * num_angles);
+        sampler s;
+
+#ifndef NO_OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (long task = 0; task < num_tasks; ++task)
+        {
+            const std::size_t l = task / tasks_per_lambda;
+            const std::size_t first = (task % tasks_per_lambda) * rays_per_task;
+            const std::size_t n = std::min(rays_per_task, rays_per_lambda - first);
+
+            std::fill(local.begin(), local.end(), 0);
+
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                // Every ray has numbers of its own, keyed by wavelength bin
+                // and ray, for its wavelength, its point uniform over the
+                // droplet's cross-section and its choices at each interface
+                s.start(l, first + k, 0);
+                const real_t lambda = lambda_min + (l + s.get_1d()) * lambda_step;
+                const real_t rho = radius * std::sqrt(s.get_1d());
+                const real_t phi = 2.0 * pi * s.get_1d();
+                const position origin = centre
+                        + position(rho * std::cos(phi), rho * std::sin(phi), -2.0 * radius);
+
+                direction out;
+                int interactions;
+                if (!trace(droplet, ray(origin, incident), t_min, lambda, s, out, interactions))
+                    continue;
+
+                const std::size_t order = std::min<std::size_t>(interactions - 1, num_orders - 1);
+                ++local[order * num_angles + angle_bin(dot(incident, out))];
+            }
+
+#ifndef NO_OPENMP
+            #pragma omp critical
+#endif
+            for (std::size_t order = 0; order < num_orders; ++order)
+                for (std::size_t a = 0; a < num_angles; ++a)
+                    counts[(order * num_lambdas + l) * num_angles + a] += local[order * num_angles + a];
+        }
+    }
+
+    // Normalise counts to per-steradian fractions of the incident light
+    phase_table table;
+    table._p.resize(counts.size());
+    for (std::size_t order = 0; order < num_orders; ++order)
+    {
+        for (std::size_t l = 0; l < num_lambdas; ++l)
+        {
+            for (std::size_t a = 0; a < num_angles; ++a)
+            {
+                const real_t solid_angle = 2.0 * pi * (std::cos(a * angle_step) - std::cos((a + 1) * angle_step));
+                const std::size_t i = (order * num_lambdas + l) * num_angles + a;
+                table._p[i] = static_cast<float>(counts[i] / (rays_per_lambda * solid_angle));
+            }
+        }
+    }
+
+    return table;
+}
+
+phase_table phase_table::load(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open phase table " + filename);
+
+    char magic[4];
+    std::uint32_t header[4];
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!in || std::memcmp(magic, file_magic, sizeof(magic)) != 0 || header[0] != file_version)
+        throw std::runtime_error("Not a phase table: " + filename);
+
+    if (header[1] != num_angles || header[2] != num_lambdas || header[3] != num_orders)
+        throw std::runtime_error("Phase table has unsupported dimensions: " + filename);
+
+    phase_table table;
+    table._p.resize(num_orders * num_lambdas * num_angles);
+    in.read(reinterpret_cast<char*>(table._p.data()), table._p.size() * sizeof(float));
+    if (!in)
+        throw std::runtime_error("Truncated phase table: " + filename);
+
+    return table;
+}
+
+void phase_table::save(const std::string& filename) const
+{
+    std::ofstream out(filename, std::ios::binary);
+    const std::uint32_t header[4] = {
+        file_version,
+        static_cast<std::uint32_t>(num_angles),
+        static_cast<std::uint32_t>(num_lambdas),
+        static_cast<std::uint32_t>(num_orders)
+    };
+
+    out.write(file_magic, sizeof(file_magic));
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(_p.data()), _p.size() * sizeof(float));
+    if (!out)
+        throw std::runtime_error("Failed to write phase table " + filename);
+}
+
+std::vector<colour> phase_table::angular_rgb(unsigned order_mask) const
+{
+    std::vector<colour> rgb(num_angles, colour(0.0, 0.0, 0.0));
+
+    for (std::size_t l = 0; l < num_lambdas; ++l)
+    {
+        const colour weight = lambda_to_rgb(lambda_of(l)) * lambda_step;
+        for (std::size_t order = 0; order < num_orders; ++order)
+        {
+            if ((order_mask & (1u << order)) == 0)
+                continue;
+
+            for (std::size_t a = 0; a < num_angles; ++a)
+                rgb[a] += weight * value(a, l, order);
+        }
+    }
+
+    return rgb;
+}
+
+droplet_phase::droplet_phase(const phase_table& table)
+:   _value(phase_table::num_lambdas * phase_table::num_angles)
+,   _cdf(phase_table::num_lambdas * (phase_table::num_angles + 1))
+,   _albedo(phase_table::num_lambdas)
+{
+    constexpr std::size_t num_angles = phase_table::num_angles;
+    for (std::size_t l = 0; l < phase_table::num_lambdas; ++l)
+    {
+        real_t* value = &_value[l * num_angles];
+        real_t* cdf = &_cdf[l * (num_angles + 1)];
+        cdf[0] = 0.0;
+        for (std::size_t a = 0; a < num_angles; ++a)
+        {
+            value[a] = 0.0;
+            for (std::size_t order = 0; order < phase_table::num_orders; ++order)
+                value[a] += table.value(a, l, order);
+
+            const real_t solid_angle = 2.0 * pi * (std::cos(a * angle_step) - std::cos((a + 1) * angle_step));
+            cdf[a + 1] = cdf[a] + value[a] * solid_angle;
+        }
+
+        _albedo[l] = cdf[num_angles];
+        if (_albedo[l] > 0.0)
+        {
+            for (std::size_t a = 1; a < num_angles; ++a)
+                cdf[a] /= _albedo[l];
+            cdf[num_angles] = 1.0;
+        }
+    }
+}
+
+std::size_t droplet_phase::lambda_bin(real_t lambda)
+{
+    const real_t bin = std::max(real_t(0), (lambda - lambda_min) / lambda_step);
+    return std::min(static_cast<std::size_t>(bin), phase_table::num_lambdas - 1);
+}
+
+real_t droplet_phase::value(real_t lambda, real_t cos_theta) const
+{
+    return _value[lambda_bin(lambda) * phase_table::num_angles + angle_bin(cos_theta)];
+}
+
+real_t droplet_phase::pdf(real_t lambda, real_t cos_theta) const
+{
+    const real_t a = albedo(lambda);
+    return a > 0.0 ? value(lambda, cos_theta) / a : 0.0;
+}
+
+direction droplet_phase::sample(real_t lambda, const direction& dir, const sample_2d& u, real_t& pdf) const
+{
+    constexpr std::size_t num_angles = phase_table::num_angles;
+    const std::size_t l = lambda_bin(lambda);
+    if (_albedo[l] <= 0.0)
+    {
+        pdf = 0.0;
+        return dir;
+    }
+
+    // The bin whose share of the CDF holds u, then uniform in cosine within it
+    const real_t* cdf = &_cdf[l * (num_angles + 1)];
+    const std::size_t a = std::min<std::size_t>(
+            std::upper_bound(cdf + 1, cdf + num_angles + 1, u.u) - (cdf + 1), num_angles - 1);
+    const real_t f = (u.u - cdf[a]) / (cdf[a + 1] - cdf[a]);
+    const real_t c0 = std::cos(a * angle_step);
+    const real_t c1 = std::cos((a + 1) * angle_step);
+    const real_t cos_theta = clamp(c0 + (c1 - c0) * f, -1.0, 1.0);
+    const real_t sin_theta = std::sqrt(std::max(real_t(0), 1 - cos_theta * cos_theta));
+    const real_t phi = 2.0 * pi * u.v;
+
+    direction t;
+    direction s;
+    orthonormal_basis(dir, t, s);
+    pdf = _value[l * num_angles + a] / _albedo[l];
+    return (sin_theta * std::cos(phi)) * t + (sin_theta * std::sin(phi)) * s + cos_theta * dir;
+}
+
+void render_phase_sky(
+        image& img,
+        const camera& cam,
+        const std::vector<colour>& angular_rgb,
+        const direction& to_sun)
+{
+    const std::size_t width = img.width();
+    const std::size_t height = img.height();
+    const direction sun = normalise(to_sun);
+
+    const long num_rows = static_cast<long>(height);
+#ifndef NO_OPENMP
+    #pragma omp parallel for
+#endif
+    for (long y = 0; y < num_rows; ++y)
+    {
+        const std::size_t j = height - 1 - y;
+        for (std::size_t i = 0; i < width; ++i)
+        {
+            const ray r = cam.get_ray(static_cast<real_t>(i) / (width - 1), static_cast<real_t>(j) / (height - 1));
+
+            // Light arrives travelling away from the sun and leaves the
+            // droplet back along the camera ray
+            const real_t cos_theta = dot(-sun, -normalise(r.dir()));
+            const real_t last = static_cast<real_t>(angular_rgb.size() - 1);
+            const real_t t = clamp(std::acos(clamp(cos_theta, -1.0, 1.0)) / angle_step - 0.5, 0.0, last);
+            const std::size_t lo = static_cast<std::size_t>(t);
+            const std::size_t hi = std::min(lo + 1, angular_rgb.size() - 1);
+            const real_t f = t - lo;
+
+            img.at(i, y) = (1.0 - f) * angular_rgb[lo] + f * angular_rgb[hi];
+        }
+    }
+}
\ No newline at end of file
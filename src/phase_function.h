@@ -0,0 +1,105 @@
+#ifndef PHASE_FUNCTION_H
+#define PHASE_FUNCTION_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "real_type.h"
+#include "vec3.h"
+
+class hittable;
+class camera;
+class image;
+struct sample_2d;
+
+/**
+ * Tabulated single-droplet phase function, binned by scattering angle,
+ * wavelength and order. Order 0 is external reflection, order k > 0 is
+ * light that entered the drop and left after k - 1 internal reflections
+ * (so order 2 is the primary bow, 3 the secondary). The last order bin
+ * collects everything higher. Values are per steradian and integrate to
+ * the fraction of incident light that escapes.
+ */
+class phase_table
+{
+public:
+    static constexpr std::size_t num_angles = 1800;
+    static constexpr std::size_t num_lambdas = 34;
+    static constexpr std::size_t num_orders = 8;
+
+    /**
+     * Fire rays_per_lambda parallel rays at droplet for each wavelength bin
+     * and record where they come out. droplet is any hittable whose
+     * bounding box is its silhouette, in practice a dielectric sphere.
+     * Throws std::runtime_error if rays_per_lambda is 0.
+     */
+    static phase_table build(const hittable& droplet, std::size_t rays_per_lambda);
+
+    // Throws std::runtime_error if the file is missing or malformed
+    static phase_table load(const std::string& filename);
+    void save(const std::string& filename) const;
+
+    real_t value(std::size_t angle, std::size_t lambda, std::size_t order) const
+    {
+        return _p[(order * num_lambdas + lambda) * num_angles + angle];
+    }
+
+    static real_t angle_of(std::size_t angle_bin);     // Bin centre, radians
+    static real_t lambda_of(std::size_t lambda_bin);   // Bin centre, nm
+
+    /**
+     * Linear sRGB radiance per unit sun irradiance for each angle bin,
+     * summed over wavelengths and the given orders (bit k selects order k).
+     */
+    std::vector<colour> angular_rgb(unsigned order_mask = ~0u) const;
+
+private:
+    std::vector<float> _p;
+};
+
+/**
+ * The phase function of a phase_table, summed over orders, for scattering
+ * in a medium of droplets. It is constant within each angle and wavelength
+ * bin, and sample() picks bins in proportion to the light they scatter, so
+ * the only weight a sample carries is the albedo, the fraction of light the
+ * droplet lets out at all.
+ */
+class droplet_phase
+{
+public:
+    explicit droplet_phase(const phase_table& table);
+
+    /**
+     * Per steradian, for light at wavelength lambda turned through an angle
+     * with cosine cos_theta. Integrates to albedo(lambda).
+     */
+    real_t value(real_t lambda, real_t cos_theta) const;
+
+    // The density per steradian of sample() turning through that angle
+    real_t pdf(real_t lambda, real_t cos_theta) const;
+
+    // A new direction for light travelling along unit direction dir
+    direction sample(real_t lambda, const direction& dir, const sample_2d& u, real_t& pdf) const;
+
+    real_t albedo(real_t lambda) const { return _albedo[lambda_bin(lambda)]; }
+
+private:
+    static std::size_t lambda_bin(real_t lambda);
+
+    std::vector<real_t> _value;     // [lambda][angle], per steradian
+    std::vector<real_t> _cdf;       // [lambda][angle + 1], of the light scattered into each bin
+    std::vector<real_t> _albedo;    // [lambda]
+};
+
+/**
+ * Shade every pixel of img by looking up the scattering angle between the
+ * camera ray and the sun in a table from phase_table::angular_rgb().
+ */
+void render_phase_sky(
+        image& img,
+        const camera& cam,
+        const std::vector<colour>& angular_rgb,
+        const direction& to_sun);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,82 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <cstdint>
+
+/**
+ * Philox4x32-10 (Salmon et al. 2011): a counter-based generator, so the
+ * numbers for any counter can be computed directly with no state carried
+ * from one call to the next. Each counter gives four independent 32-bit
+ * words.
+ */
+struct philox_block
+{
+    std::uint32_t word[4];
+};
+
+inline philox_block philox4x32(
+        std::uint32_t c0,
+        std::uint32_t c1,
+        std::uint32_t c2,
+        std::uint32_t c3,
+        std::uint32_t k0,
+        std::uint32_t k1)
+{
+    constexpr std::uint64_t m0 = 0xd2511f53u;
+    constexpr std::uint64_t m1 = 0xcd9e8d57u;
+    constexpr std::uint32_t w0 = 0x9e3779b9u;
+    constexpr std::uint32_t w1 = 0xbb67ae85u;
+
+    for (int round = 0; round < 10; ++round)
+    {
+        if (round > 0)
+        {
+            k0 += w0;
+            k1 += w1;
+        }
+
+        const std::uint64_t p0 = m0 * c0;
+        const std::uint64_t p1 = m1 * c2;
+        c0 = static_cast<std::uint32_t>(p1 >> 32) ^ c1 ^ k0;
+        c1 = static_cast<std::uint32_t>(p1);
+        c2 = static_cast<std::uint32_t>(p0 >> 32) ^ c3 ^ k1;
+        c3 = static_cast<std::uint32_t>(p0);
+    }
+
+    return { { c0, c1, c2, c3 } };
+}
+
+/**
+ * A stream of Philox words: the key picks the stream and a counter walks
+ * along it. Seeding costs nothing, so a stream can be started for every
+ * task that needs reproducible numbers.
+ */
+class philox_stream
+{
+public:
+    explicit philox_stream(std::uint64_t key = 0)
+    :   _key(key)
+    {}
+
+    std::uint32_t next()
+    {
+        if (_available == 0)
+        {
+            _block = philox4x32(
+                    static_cast<std::uint32_t>(_counter), static_cast<std::uint32_t>(_counter >> 32), 0, 0,
+                    static_cast<std::uint32_t>(_key), static_cast<std::uint32_t>(_key >> 32));
+            ++_counter;
+            _available = 4;
+        }
+
+        return _block.word[4 - _available--];
+    }
+
+private:
+    std::uint64_t _key;
+    std::uint64_t _counter = 0;
+    philox_block _block = {};
+    int _available = 0;
+};
+
+#endif
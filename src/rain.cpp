@@ -0,0 +1,225 @@
+#include "rain.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#include "medium.h"
+#include "rt_utils.h"
+#include "scene.h"
+#include "sphere_set.h"
+
+namespace
+{
+
+// Uniform on [0, 1), the same on every platform unlike the standard
+// distributions
+double uniform(std::mt19937_64& gen)
+{
+    return (gen() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Shaft grid resolution across the ground, and of the noise lattice on it
+constexpr std::size_t shaft_cells = 64;
+constexpr std::size_t shaft_lattice = 8;
+
+// Throws std::runtime_error if the curtain cannot make rain
+void check_curtain(const rain_curtain& rain)
+{
+    const direction extent = rain.upper - rain.lower;
+    if (extent.x <= 0.0 || extent.y <= 0.0 || extent.z <= 0.0)
+        throw std::runtime_error("Rain box is empty");
+    if (rain.density < 0.0)
+        throw std::runtime_error("Rain density must not be negative");
+
+    if (rain.sizes == drop_sizes::marshall_palmer)
+    {
+        if (rain.rain_rate <= 0.0 || rain.min_diameter <= 0.0 || rain.max_diameter < rain.min_diameter)
+            throw std::runtime_error("Bad Marshall-Palmer parameters");
+    }
+    else if (rain.radius <= 0.0)
+        throw std::runtime_error("Drop radius must be positive");
+}
+
+// Terminal speed of raindrops in still air, in m/s by diameter in mm
+// (Atlas, Srivastava and Sekhon 1973), which tends to zero for drizzle
+double terminal_speed(double diameter)
+{
+    return std::max(0.0, 9.65 - 10.3 * std::exp(-0.6 * diameter));
+}
+
+// Slope of the Marshall-Palmer exponential, per mm of diameter
+double marshall_palmer_slope(const rain_curtain& rain)
+{
+    return 4.1 * std::pow(double(rain.rain_rate), -0.21);
+}
+
+// Smoothly interpolated random values on a square lattice, sampled on a
+// square grid of cells covering it, and sharpened into shafts
+std::vector<float> shaft_noise(std::uint64_t seed)
+{
+    std::mt19937_64 gen(seed);
+    std::vector<double> lattice((shaft_lattice + 1) * (shaft_lattice + 1));
+    for (double& v : lattice)
+        v = uniform(gen);
+
+    const auto smooth = [] (double t) { return t * t * (3.0 - 2.0 * t); };
+    std::vector<float> values(shaft_cells * shaft_cells);
+    for (std::size_t z = 0; z < shaft_cells; ++z)
+    {
+        for (std::size_t x = 0; x < shaft_cells; ++x)
+        {
+            const double gx = (x + 0.5) * shaft_lattice / shaft_cells;
+            const double gz = (z + 0.5) * shaft_lattice / shaft_cells;
+            const std::size_t ix = static_cast<std::size_t>(gx);
+            const std::size_t iz = static_cast<std::size_t>(gz);
+            const double fx = smooth(gx - ix);
+            const double fz = smooth(gz - iz);
+            const auto at = [&] (std::size_t i, std::size_t j) { return lattice[j * (shaft_lattice + 1) + i]; };
+            const double v0 = at(ix, iz) + fx * (at(ix + 1, iz) - at(ix, iz));
+            const double v1 = at(ix, iz + 1) + fx * (at(ix + 1, iz + 1) - at(ix, iz + 1));
+            const double v = v0 + fz * (v1 - v0);
+            values[z * shaft_cells + x] = static_cast<float>(v * v * v);
+        }
+    }
+
+    return values;
+}
+
+} /* Anonymous namespace */
+
+std::vector<droplet> generate_rain(const rain_curtain& rain)
+{
+    check_curtain(rain);
+    const direction extent = rain.upper - rain.lower;
+
+    const double volume = double(extent.x) * extent.y * extent.z;
+    const double expected = std::round(rain.density * volume);
+    if (expected > std::numeric_limits<std::uint32_t>::max())
+        throw std::runtime_error("Too many raindrops");
+    const std::size_t count = static_cast<std::size_t>(expected);
+
+    // Inverse CDF of the exponential truncated to [min, max]
+    double lambda = 0.0;
+    double tail = 0.0;
+    if (rain.sizes == drop_sizes::marshall_palmer)
+    {
+        lambda = marshall_palmer_slope(rain);
+        tail = -std::expm1(-lambda * (rain.max_diameter - rain.min_diameter));
+    }
+
+    std::mt19937_64 gen(rain.seed);
+    std::vector<droplet> drops(count);
+    for (droplet& d : drops)
+    {
+        d.x = static_cast<float>(rain.lower.x + uniform(gen) * extent.x);
+        d.y = static_cast<float>(rain.lower.y + uniform(gen) * extent.y);
+        d.z = static_cast<float>(rain.lower.z + uniform(gen) * extent.z);
+
+        if (rain.sizes == drop_sizes::marshall_palmer)
+        {
+            const double diameter = rain.min_diameter - std::log1p(-uniform(gen) * tail) / lambda;
+            d.radius = static_cast<float>(0.5 * diameter * rain.units_per_mm);
+        }
+        else
+            d.radius = static_cast<float>(rain.radius);
+    }
+
+    return drops;
+}
+
+real_t mean_cross_section(const rain_curtain& rain)
+{
+    check_curtain(rain);
+    if (rain.sizes == drop_sizes::fixed)
+        return pi * rain.radius * rain.radius;
+
+    // Mean squared diameter of the truncated exponential, by the midpoint rule
+    constexpr int steps = 1000;
+    const double lambda = marshall_palmer_slope(rain);
+    const double step = (rain.max_diameter - rain.min_diameter) / steps;
+    double weight = 0.0;
+    double moment = 0.0;
+    for (int i = 0; i < steps; ++i)
+    {
+        const double diameter = rain.min_diameter + (i + 0.5) * step;
+        const double w = std::exp(-lambda * (diameter - rain.min_diameter));
+        weight += w;
+        moment += w * diameter * diameter;
+    }
+
+    const double radius2 = 0.25 * moment / weight * rain.units_per_mm * rain.units_per_mm;
+    return static_cast<real_t>(pi * radius2);
+}
+
+real_t fall_speed(const rain_curtain& rain, real_t radius)
+{
+    const double diameter = 2.0 * radius / rain.units_per_mm;
+    return static_cast<real_t>(terminal_speed(diameter) * 1000.0 * rain.units_per_mm);
+}
+
+void fall(const rain_curtain& rain, const droplet* start, std::size_t count, real_t seconds, std::vector<droplet>& out)
+{
+    check_curtain(rain);
+    out.resize(count);
+
+    const double bottom = rain.lower.y;
+    const double height = rain.upper.y - rain.lower.y;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const droplet& d = start[i];
+        double y = std::fmod(d.y - fall_speed(rain, d.radius) * seconds - bottom, height);
+        if (y < 0.0)
+            y += height;
+
+        out[i] = d;
+        out[i].y = static_cast<float>(bottom + y);
+    }
+}
+
+std::unique_ptr<medium> rain_medium(const rain_curtain& rain, const droplet_phase& phase)
+{
+    const aabb box(rain.lower, rain.upper);
+    const real_t sigma_t = rain.density * mean_cross_section(rain);
+    switch (rain.model)
+    {
+    case rain_model::droplets:
+        break;
+    case rain_model::homogeneous:
+        return std::make_unique<medium>(box, sigma_t, phase);
+    case rain_model::grid:
+    {
+        std::vector<float> values = shaft_noise(rain.seed);
+        double mean = 0.0;
+        for (float v : values)
+            mean += v;
+        mean /= values.size();
+
+        // Scaled to the largest value, so the majorant keeps the mean right
+        const float largest = *std::max_element(values.begin(), values.end());
+        return std::make_unique<grid_medium>(
+                box, static_cast<real_t>(sigma_t * largest / mean), phase,
+                shaft_cells, 1, shaft_cells, std::move(values));
+    }
+    }
+
+    throw std::runtime_error("Droplet rain is not a medium");
+}
+
+scene rain_scene(const rain_curtain& rain, bool sun_sphere)
+{
+    scene s;
+    const std::uint32_t water = s.add_material({ material_kind::dielectric, colour(1.0, 1.0, 1.0), 0.0, 0.0 });
+    if (sun_sphere)
+    {
+        const std::uint32_t sun = s.add_material({ material_kind::light, colour(0.0, 1.0, 1.0), 0.0, 0.0 });
+        s.add_sphere(position(0.0, 0.0, 10.0), 1.0, sun);
+    }
+    if (rain.model == rain_model::droplets)
+        s.add_droplets(generate_rain(rain), water);
+
+    return s;
+}
@@ -0,0 +1,79 @@
+#ifndef RAIN_H
+#define RAIN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "real_type.h"
+#include "vec3.h"
+
+struct droplet;
+class droplet_phase;
+class medium;
+class scene;
+
+enum class drop_sizes
+{
+    fixed,          // Every drop has the same radius
+    marshall_palmer // Exponential in diameter, set by the rain rate
+};
+
+enum class rain_model
+{
+    droplets,       // Every drop is a sphere in the world
+    homogeneous,    // A medium of the same drops, evenly spread
+    grid            // A medium of the same drops on average, gathered into shafts
+};
+
+/**
+ * A box of rain. Drop centres are uniform over the box. Marshall-Palmer
+ * sizes follow N(D) ~ exp(-4.1 R^-0.21 D) for diameter D in mm and rain
+ * rate R in mm/h, truncated to [min_diameter, max_diameter].
+ */
+struct rain_curtain
+{
+    position lower = position(-4.0, -2.5, -8.0);
+    position upper = position(4.0, 2.5, -2.0);
+    real_t density = 100.0;             // Drops per unit volume
+    drop_sizes sizes = drop_sizes::marshall_palmer;
+    real_t radius = 0.01;               // Fixed sizes only
+    real_t rain_rate = 5.0;             // mm/h
+    real_t units_per_mm = 0.005;        // Scene size of a millimetre
+    real_t min_diameter = 0.5;          // mm
+    real_t max_diameter = 6.0;          // mm
+    std::uint64_t seed = 1;
+    rain_model model = rain_model::droplets;
+};
+
+// The same curtain and seed always give the same drops
+std::vector<droplet> generate_rain(const rain_curtain& rain);
+
+// Terminal fall speed of a drop of this radius, in scene units per second
+real_t fall_speed(const rain_curtain& rain, real_t radius);
+
+/**
+ * count drops from start after falling for seconds at their terminal
+ * speeds, each re-entering at the top of the box as it leaves the bottom,
+ * so the curtain keeps its density. out is resized to fit, so passing the
+ * same vector every frame reuses its storage.
+ */
+void fall(const rain_curtain& rain, const droplet* start, std::size_t count, real_t seconds, std::vector<droplet>& out);
+
+// Mean geometric cross-section of the curtain's drops, in scene units
+real_t mean_cross_section(const rain_curtain& rain);
+
+/**
+ * The curtain as a medium for its model, scattering with phase: extinction
+ * is the drop density times their mean cross-section. Shafts are value
+ * noise across the ground, the same at every height, seeded like the drops.
+ */
+std::unique_ptr<medium> rain_medium(const rain_curtain& rain, const droplet_phase& phase);
+
+// The sun behind the camera shining on a rain curtain, or without
+// sun_sphere, the curtain alone. Only droplet curtains put drops in the
+// scene; the others are left for rain_medium().
+scene rain_scene(const rain_curtain& rain, bool sun_sphere = true);
+
+#endif
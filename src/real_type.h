@@ -1,6 +1,11 @@
 #ifndef REAL_TYPE_H
 #define REAL_TYPE_H
 
+// Floating point type used throughout; builds choose it at configure time
+#ifdef RAINBOW_SINGLE_PRECISION
+using real_t = float;
+#else
 using real_t = double;
+#endif
 
 #endif
\ No newline at end of file
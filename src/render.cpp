@@ -0,0 +1,115 @@
+#include "render.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+
+constexpr std::uint64_t pack(std::uint64_t head, std::uint64_t tail)
+{
+    return (head << 32) | tail;
+}
+
+constexpr std::uint64_t head_of(std::uint64_t range)
+{
+    return range >> 32;
+}
+
+constexpr std::uint64_t tail_of(std::uint64_t range)
+{
+    return range & 0xffffffffu;
+}
+
+} /* Anonymous namespace */
+
+std::vector<tile> make_tiles(std::size_t width, std::size_t height, std::size_t tile_size, std::size_t first, std::size_t end)
+{
+    if (tile_size == 0)
+        throw std::runtime_error("Tile size must be positive");
+
+    std::vector<tile> tiles;
+    std::size_t index = 0;
+    for (std::size_t y0 = 0; y0 < height; y0 += tile_size)
+    {
+        for (std::size_t x0 = 0; x0 < width; x0 += tile_size, ++index)
+        {
+            if (index < first || index >= end)
+                continue;
+
+            const std::size_t x1 = std::min(x0 + tile_size, width);
+            const std::size_t y1 = std::min(y0 + tile_size, height);
+            tiles.push_back({ index, x0, y0, x1, y1 });
+        }
+    }
+
+    if (index > 0xffffffffu)
+        throw std::runtime_error("Too many tiles");
+
+    return tiles;
+}
+
+tile_scheduler::tile_scheduler(const std::vector<tile>& tiles, int num_workers)
+:   _tiles(tiles)
+,   _num_workers(std::max(num_workers, 1))
+,   _queues(new queue[_num_workers])
+,   _completed(0)
+{
+    // Deal out contiguous runs so each worker starts on a coherent region
+    const std::size_t n = _tiles.size();
+    for (int w = 0; w < _num_workers; ++w)
+    {
+        const std::uint64_t begin = n * w / _num_workers;
+        const std::uint64_t end = n * (w + 1) / _num_workers;
+        _queues[w].range.store(pack(begin, end), std::memory_order_relaxed);
+    }
+}
+
+bool tile_scheduler::next(int worker, tile& t)
+{
+    std::size_t index;
+    if (!pop_front(worker, index))
+    {
+        bool stolen = false;
+        for (int i = 1; i < _num_workers && !stolen; ++i)
+            stolen = pop_back((worker + i) % _num_workers, index);
+
+        if (!stolen)
+            return false;
+    }
+
+    t = _tiles[index];
+    return true;
+}
+
+bool tile_scheduler::pop_front(int worker, std::size_t& index)
+{
+    std::atomic<std::uint64_t>& range = _queues[worker].range;
+    std::uint64_t r = range.load(std::memory_order_relaxed);
+    while (head_of(r) < tail_of(r))
+    {
+        if (range.compare_exchange_weak(r, pack(head_of(r) + 1, tail_of(r)), std::memory_order_relaxed))
+        {
+            index = head_of(r);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool tile_scheduler::pop_back(int worker, std::size_t& index)
+{
+    std::atomic<std::uint64_t>& range = _queues[worker].range;
+    std::uint64_t r = range.load(std::memory_order_relaxed);
+    while (head_of(r) < tail_of(r))
+    {
+        if (range.compare_exchange_weak(r, pack(head_of(r), tail_of(r) - 1), std::memory_order_relaxed))
+        {
+            index = tail_of(r) - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
\ No newline at end of file
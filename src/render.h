@@ -0,0 +1,213 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "sample_buffer.h"
+#include "rt_utils.h"
+#include "stats.h"
+#include "vec3.h"
+
+#ifndef NO_OPENMP
+#include <omp.h>
+#endif
+
+struct tile
+{
+    std::size_t index;
+    std::size_t x0, y0;
+    std::size_t x1, y1;
+
+    std::size_t width() const { return x1 - x0; }
+    std::size_t height() const { return y1 - y0; }
+};
+
+/**
+ * Hands out image tiles to a fixed set of workers. Each worker starts with
+ * a contiguous run of tiles which it takes from the front; a worker that
+ * runs dry steals from the back of the other workers' runs, so expensive
+ * regions of the image get shared out instead of stalling one thread.
+ */
+class tile_scheduler
+{
+public:
+    tile_scheduler(const std::vector<tile>& tiles, int num_workers);
+
+    tile_scheduler(const tile_scheduler&) = delete;
+    tile_scheduler& operator=(const tile_scheduler&) = delete;
+
+    bool next(int worker, tile& t);
+
+    std::size_t num_tiles() const { return _tiles.size(); }
+    std::size_t completed() const { return _completed.load(std::memory_order_relaxed); }
+    void mark_completed() { _completed.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+    // [head, tail) of a worker's run packed into one word so that the owner
+    // and thieves can both claim tiles with a single compare-and-swap. Padded
+    // so neighbouring workers never share a cache line.
+    struct queue
+    {
+        std::atomic<std::uint64_t> range;
+        char padding[64 - sizeof(std::atomic<std::uint64_t>)];
+    };
+
+    bool pop_front(int worker, std::size_t& index);
+    bool pop_back(int worker, std::size_t& index);
+
+    std::vector<tile> _tiles;
+    int _num_workers;
+    std::unique_ptr<queue[]> _queues;
+    std::atomic<std::size_t> _completed;
+};
+
+/**
+ * The image split into tile_size squares in row-major order, clipped at the
+ * right and bottom edges, keeping only tiles [first, end). Tiles keep their
+ * index in the full grid, so a range renders exactly as it would as part
+ * of the whole image.
+ */
+std::vector<tile> make_tiles(
+        std::size_t width,
+        std::size_t height,
+        std::size_t tile_size,
+        std::size_t first = 0,
+        std::size_t end = std::numeric_limits<std::size_t>::max());
+
+inline int num_render_workers()
+{
+#ifndef NO_OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/**
+ * One progressive pass: every pixel is topped up to target_samples.
+ * Pixels that already have that many are skipped, so a pass that was cut
+ * short can simply be run again.
+ */
+struct render_pass
+{
+    std::uint32_t target_samples;
+    std::uint32_t first_sample = 0;                 // Index of each pixel's first sample in the buffer
+    const std::uint32_t* pixel_targets = nullptr;   // Per-pixel targets overriding target_samples
+    std::size_t tile_size = sample_buffer::tile_size;
+    std::size_t first_tile = 0;                     // Only tiles [first_tile, end_tile) are rendered
+    std::size_t end_tile = std::numeric_limits<std::size_t>::max();
+    stats_collector* stats = nullptr;               // Receives the workers' counters after each tile
+
+    std::uint32_t target(std::size_t x, std::size_t y, std::size_t width) const
+    {
+        return pixel_targets ? pixel_targets[y * width + x] : target_samples;
+    }
+};
+
+/**
+ * Render a pass into buf in parallel tiles, bringing every pixel in the
+ * pass's tile range up to its target sample count. shade_tile(worker, t,
+ * accum) takes the samples tile t still needs, given the counts already in
+ * buf, and accumulates them into accum, row-major with a stride of
+ * t.width(); accum is owned by the worker and merged into buf once the tile
+ * is finished. Samples draw their random numbers by pixel and sample
+ * index, so the result does not depend on which worker rendered which
+ * tile or on how the samples were split into passes. If
+ * pass.stats is set, each worker publishes its counters to it after every
+ * tile. progress(done, total) is called from the first worker whenever it
+ * finishes a tile, and that worker then polls stop(); once it returns true
+ * no more tiles are handed out. Returns false if the pass was stopped
+ * early.
+ */
+template <typename TileFuncT, typename ProgressFuncT, typename StopFuncT>
+bool render_tile_batches(
+        sample_buffer& buf,
+        const render_pass& pass,
+        TileFuncT&& shade_tile,
+        ProgressFuncT&& progress,
+        StopFuncT&& stop)
+{
+    const int num_workers = num_render_workers();
+    const std::size_t tile_size = pass.tile_size;
+    tile_scheduler scheduler(make_tiles(buf.width(), buf.height(), tile_size, pass.first_tile, pass.end_tile), num_workers);
+    std::atomic<bool> stopped(false);
+
+#ifndef NO_OPENMP
+    #pragma omp parallel num_threads(num_workers)
+#endif
+    {
+#ifndef NO_OPENMP
+        const int worker = omp_get_thread_num();
+#else
+        const int worker = 0;
+#endif
+        std::vector<pixel_stats> accum(tile_size * tile_size);
+        thread_stats() = render_stats();
+
+        tile t;
+        while (!stopped.load(std::memory_order_relaxed) && scheduler.next(worker, t))
+        {
+            std::fill(accum.begin(), accum.end(), pixel_stats());
+
+            shade_tile(worker, static_cast<const tile&>(t), accum.data());
+
+            // Tiles never overlap, so this needs no synchronisation
+            buf.add(t.x0, t.y0, t.x1, t.y1, accum.data());
+
+            if (pass.stats)
+                pass.stats->publish();
+
+            scheduler.mark_completed();
+            if (worker == 0)
+            {
+                progress(scheduler.completed(), scheduler.num_tiles());
+                if (stop())
+                    stopped.store(true, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    if (stopped.load())
+        return false;
+
+    progress(scheduler.num_tiles(), scheduler.num_tiles());
+    return true;
+}
+
+/**
+ * render_tile_batches for integrators that take one sample at a time:
+ * pixel_colour(x, y, index) returns sample number index for pixel (x, y)
+ * in image coordinates.
+ */
+template <typename PixelFuncT, typename ProgressFuncT, typename StopFuncT>
+bool render_tiles(
+        sample_buffer& buf,
+        const render_pass& pass,
+        PixelFuncT&& pixel_colour,
+        ProgressFuncT&& progress,
+        StopFuncT&& stop)
+{
+    return render_tile_batches(buf, pass,
+            [&] (int, const tile& t, pixel_stats* accum)
+            {
+                for (std::size_t y = t.y0; y < t.y1; ++y)
+                {
+                    pixel_stats* row = accum + (y - t.y0) * t.width();
+                    for (std::size_t x = t.x0; x < t.x1; ++x)
+                    {
+                        const std::uint32_t target = pass.target(x, y, buf.width());
+                        for (std::uint32_t k = buf.count(x, y); k < target; ++k)
+                            row[x - t.x0].push(pixel_colour(x, y, pass.first_sample + k));
+                    }
+                }
+            },
+            progress, stop);
+}
+
+#endif
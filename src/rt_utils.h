@@ -1,9 +1,12 @@
 #ifndef RT_UTILS_H
 #define RT_UTILS_H
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <limits>
-#include <random>
 
+#include "philox.h"
 #include "real_type.h"
 #include "vec3.h"
 
@@ -15,11 +18,35 @@ constexpr real_t to_radians(real_t degrees)
     return degrees * pi / 180.0;
 }
 
+/**
+ * Each thread gets its own generator, so workers never share sampling state.
+ * Renders draw from sampler instead, keyed by pixel and sample; this is for
+ * tools and table building, which seed a stream per task.
+ */
+inline philox_stream& random_generator()
+{
+    static thread_local philox_stream generator;
+    return generator;
+}
+
+inline void seed_random(std::uint64_t seed)
+{
+    random_generator() = philox_stream(seed);
+}
+
+// Always converted from double, so builds of either precision see the same
+// numbers and can be compared sample for sample
+inline real_t random_real(philox_stream& stream)
+{
+    const real_t u = static_cast<real_t>(stream.next() * (1.0 / 4294967296.0));
+
+    // Rounding to float can reach 1
+    return u < real_t(1) ? u : std::nextafter(real_t(1), real_t(0));
+}
+
 inline real_t random_real()
 {
-    static std::uniform_real_distribution<real_t> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return random_real(random_generator());
 }
 
 inline real_t random_real(real_t rmin, real_t rmax)
@@ -53,12 +80,24 @@ VecT reflect(VecT v, const VecT& n)
 
 template <typename VecT>
 VecT refract(VecT u, const VecT& n, real_t n_ratio) {
-    const real_t cos_theta = std::fmin(dot(-u, n), 1.0);
+    const real_t cos_theta = std::min<real_t>(dot(-u, n), 1.0);
     const VecT r_out_perp =  n_ratio * (u + cos_theta * n);
-    const VecT r_out_parallel = -std::sqrt(fabs(1.0 - r_out_perp.length2())) * n;
+    const VecT r_out_parallel = -std::sqrt(std::abs(real_t(1) - r_out_perp.length2())) * n;
     return r_out_perp + r_out_parallel;
 }
 
+// Unit vectors t and s completing a right-handed frame with unit w
+// (Duff et al. 2017), with no branch on which axis w is near
+template <typename VecT>
+void orthonormal_basis(const VecT& w, VecT& t, VecT& s)
+{
+    const real_t sign = std::copysign(real_t(1), w.z);
+    const real_t a = -1 / (sign + w.z);
+    const real_t b = w.x * w.y * a;
+    t = VecT(1 + sign * w.x * w.x * a, sign * b, -sign * w.x);
+    s = VecT(b, sign + w.y * w.y * a, -w.y);
+}
+
 inline real_t clamp(real_t x, real_t cmin, real_t cmax)
 {
     if (x < cmin)
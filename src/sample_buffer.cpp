@@ -0,0 +1,168 @@
+#include "sample_buffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+
+constexpr char file_magic[4] = { 'A', 'T', 'C', 'K' };
+constexpr std::uint32_t file_version = 3;
+
+struct file_header
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t real_size;
+    std::uint32_t reserved;
+    std::uint64_t width;
+    std::uint64_t height;
+    sample_source source;
+};
+
+static_assert(sizeof(sample_source) == 24, "Checkpoint headers must not be padded");
+
+} /* Anonymous namespace */
+
+real_t pixel_stats::relative_error(real_t floor) const
+{
+    if (count < 2)
+        return std::numeric_limits<real_t>::infinity();
+
+    const real_t std_error = std::sqrt(variance() / count);
+    return std_error / std::max(luminance(mean), floor);
+}
+
+sample_buffer::sample_buffer(std::size_t width, std::size_t height)
+:   _width(width)
+,   _height(height)
+,   _stats(width * height)
+{
+}
+
+void sample_buffer::add(std::size_t x0, std::size_t y0, std::size_t x1, std::size_t y1, const pixel_stats* s)
+{
+    // A whole tile is one contiguous run, row-major with the same stride
+    // as s, so it merges in order without working out each pixel's index
+    const bool whole_tile = x0 % tile_size == 0 && y0 % tile_size == 0
+            && x1 == std::min(x0 + tile_size, _width) && y1 == std::min(y0 + tile_size, _height);
+    if (whole_tile)
+    {
+        pixel_stats* dst = &_stats[index(x0, y0)];
+        const std::size_t n = (x1 - x0) * (y1 - y0);
+        for (std::size_t i = 0; i < n; ++i)
+            dst[i].merge(s[i]);
+        return;
+    }
+
+    for (std::size_t y = y0; y < y1; ++y)
+        for (std::size_t x = x0; x < x1; ++x)
+            _stats[index(x, y)].merge(*s++);
+}
+
+std::uint32_t sample_buffer::min_count() const
+{
+    std::uint32_t n = std::numeric_limits<std::uint32_t>::max();
+    for (const pixel_stats& s : _stats)
+        n = std::min(n, s.count);
+    return _stats.empty() ? 0 : n;
+}
+
+std::uint64_t sample_buffer::total_count() const
+{
+    std::uint64_t n = 0;
+    for (const pixel_stats& s : _stats)
+        n += s.count;
+    return n;
+}
+
+void sample_buffer::clear()
+{
+    std::fill(_stats.begin(), _stats.end(), pixel_stats());
+}
+
+image sample_buffer::resolve() const
+{
+    image img(_width, _height);
+    colour* pixels = img.data();
+    for (std::size_t y = 0; y < _height; ++y)
+        for (std::size_t x = 0; x < _width; ++x)
+            *pixels++ = _stats[index(x, y)].mean;
+
+    return img;
+}
+
+void sample_buffer::save(const std::string& filename) const
+{
+    const std::string temp = filename + ".tmp";
+
+    {
+        std::ofstream out(temp, std::ios::binary);
+        if (!out)
+            throw std::runtime_error("Cannot open " + temp);
+
+        file_header header = {};
+        std::memcpy(header.magic, file_magic, sizeof(file_magic));
+        header.version = file_version;
+        header.real_size = sizeof(real_t);
+        header.width = _width;
+        header.height = _height;
+        header.source = _source;
+
+        // Row-major on disk, whatever the layout in memory
+        std::vector<pixel_stats> rows;
+        rows.reserve(_stats.size());
+        for (std::size_t y = 0; y < _height; ++y)
+            for (std::size_t x = 0; x < _width; ++x)
+                rows.push_back(_stats[index(x, y)]);
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(rows.data()), rows.size() * sizeof(pixel_stats));
+        out.flush();
+        if (!out)
+            throw std::runtime_error("Failed to write " + temp);
+    }
+
+    if (std::rename(temp.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Failed to replace " + filename);
+}
+
+sample_buffer sample_buffer::load(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open " + filename);
+
+    file_header header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 || header.version != file_version)
+        throw std::runtime_error("Not a checkpoint: " + filename);
+
+    if (header.real_size != sizeof(real_t))
+        throw std::runtime_error("Checkpoint was written with a different precision: " + filename);
+
+    const std::uint64_t max_pixels = std::numeric_limits<std::uint32_t>::max();
+    // Each side is checked before multiplying, so the product cannot wrap
+    if (header.width == 0 || header.height == 0 || header.width > max_pixels || header.height > max_pixels
+            || header.width * header.height > max_pixels)
+        throw std::runtime_error("Bad checkpoint dimensions: " + filename);
+
+    sample_buffer buf(header.width, header.height);
+    buf._source = header.source;
+    std::vector<pixel_stats> rows(buf._stats.size());
+    in.read(reinterpret_cast<char*>(rows.data()), rows.size() * sizeof(pixel_stats));
+    if (!in)
+        throw std::runtime_error("Truncated checkpoint: " + filename);
+
+    const pixel_stats* row = rows.data();
+    for (std::size_t y = 0; y < buf._height; ++y)
+        for (std::size_t x = 0; x < buf._width; ++x)
+            buf._stats[buf.index(x, y)] = *row++;
+
+    return buf;
+}
\ No newline at end of file
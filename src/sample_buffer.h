@@ -0,0 +1,154 @@
+#ifndef SAMPLE_BUFFER_H
+#define SAMPLE_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "real_type.h"
+#include "vec3.h"
+
+inline real_t luminance(const colour& c)
+{
+    return 0.2126*c.x + 0.7152*c.y + 0.0722*c.z;
+}
+
+/**
+ * Running mean of a pixel's samples, with Welford's running sum of squared
+ * deviations of their luminance for estimating the error of the mean.
+ */
+struct pixel_stats
+{
+    colour mean = colour(0.0, 0.0, 0.0);
+    real_t m2 = 0.0;
+    std::uint32_t count = 0;
+    std::uint32_t reserved = 0;     // Keeps the checkpoint layout free of padding
+
+    void push(const colour& c)
+    {
+        ++count;
+        const real_t old_y = luminance(mean);
+        mean += (c - mean) / static_cast<real_t>(count);
+        m2 += (luminance(c) - old_y) * (luminance(c) - luminance(mean));
+    }
+
+    // Combine with statistics from a disjoint set of samples (Chan et al.)
+    void merge(const pixel_stats& s)
+    {
+        if (s.count == 0)
+            return;
+
+        const real_t n_a = count;
+        const real_t n_b = s.count;
+        const real_t n = n_a + n_b;
+        const colour delta = s.mean - mean;
+        const real_t delta_y = luminance(delta);
+
+        mean += delta * (n_b / n);
+        m2 += s.m2 + delta_y * delta_y * (n_a * n_b / n);
+        count += s.count;
+    }
+
+    real_t variance() const
+    {
+        return count > 1 ? m2 / (count - 1) : 0.0;
+    }
+
+    /**
+     * Standard error of the mean luminance relative to the mean itself.
+     * floor stops dark pixels from looking noisy because of tiny means.
+     */
+    real_t relative_error(real_t floor) const;
+};
+
+/**
+ * Where a buffer's samples came from: the sampler (a sampler_kind) and its
+ * seed offset, the scene's fingerprint, and the sample index each pixel's
+ * samples started at. Saved with the buffer, so samples drawn from another
+ * sequence or scene are not mixed in by mistake.
+ */
+struct sample_source
+{
+    std::uint32_t sampler = 0;
+    std::uint32_t seed_offset = 0;
+    std::uint64_t scene = 0;
+    std::uint32_t first_sample = 0;
+    std::uint32_t reserved = 0;
+};
+
+/**
+ * Per-pixel sample statistics for a progressive render. Because counts are
+ * per pixel, a render can be stopped part way through a pass, saved as a
+ * checkpoint and picked up again later, and pixels can be sampled unevenly.
+ *
+ * Pixels are stored a tile at a time: the image is cut into tile_size
+ * squares (clipped at the right and bottom edges), tiles are laid out in
+ * row-major order and each tile's pixels are row-major within it. A render
+ * tile of the same size is then one contiguous run of the buffer. The
+ * accessors do no bounds checking.
+ */
+class sample_buffer
+{
+public:
+    static constexpr std::size_t tile_size = 16;
+
+    sample_buffer(std::size_t width, std::size_t height);
+
+    std::size_t width() const { return _width; }
+    std::size_t height() const { return _height; }
+
+    const sample_source& source() const { return _source; }
+    void set_source(const sample_source& source) { _source = source; }
+
+    void add(std::size_t x, std::size_t y, const pixel_stats& s)
+    {
+        _stats[index(x, y)].merge(s);
+    }
+
+    /**
+     * Merge the statistics for pixels [x0, x1) x [y0, y1), given row-major
+     * with a stride of x1 - x0. Regions that do not overlap can be added
+     * from different threads at once.
+     */
+    void add(std::size_t x0, std::size_t y0, std::size_t x1, std::size_t y1, const pixel_stats* s);
+
+    const pixel_stats& stats(std::size_t x, std::size_t y) const { return _stats[index(x, y)]; }
+    std::uint32_t count(std::size_t x, std::size_t y) const { return _stats[index(x, y)].count; }
+    std::uint32_t min_count() const;
+    std::uint64_t total_count() const;
+
+    // Forget every sample, keeping the storage for the next frame
+    void clear();
+
+    // Mean radiance per pixel; pixels with no samples are black
+    image resolve() const;
+
+    /**
+     * Checkpoints are written to a temporary file and renamed over the
+     * target, so an interrupted save never destroys the previous one.
+     * Both throw std::runtime_error on failure.
+     */
+    void save(const std::string& filename) const;
+    static sample_buffer load(const std::string& filename);
+
+private:
+    std::size_t index(std::size_t x, std::size_t y) const
+    {
+        const std::size_t tx = x / tile_size;
+        const std::size_t ty = y / tile_size;
+        const std::size_t tile_width = std::min(tile_size, _width - tx * tile_size);
+        const std::size_t tile_height = std::min(tile_size, _height - ty * tile_size);
+        return ty * tile_size * _width + tx * tile_size * tile_height
+                + (y % tile_size) * tile_width + x % tile_size;
+    }
+
+    std::size_t _width;
+    std::size_t _height;
+    sample_source _source;
+    std::vector<pixel_stats> _stats;
+};
+
+#endif
\ No newline at end of file
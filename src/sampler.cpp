@@ -0,0 +1,355 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "rt_utils.h"
+
+namespace
+{
+
+constexpr double to_unit = 1.0 / 4294967296.0;
+
+// Halton dimensions past the last prime fall back to Philox
+constexpr std::uint32_t halton_primes[] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+constexpr std::uint32_t num_halton_dimensions = sizeof(halton_primes) / sizeof(halton_primes[0]);
+
+constexpr int mask_size = 64;
+constexpr int mask_bits = 12;   // Bits in a rank: mask_size squared is 2^12
+
+std::uint32_t mix32(std::uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+std::uint32_t hash(std::uint32_t seed, std::uint32_t v)
+{
+    return mix32(seed ^ (mix32(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+std::uint32_t reverse_bits(std::uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Hash-based Owen scrambling in base 2 (Laine and Karras 2011, with the
+// constants from Burley 2020): each bit is flipped depending only on the
+// bits above it
+std::uint32_t nested_uniform_scramble(std::uint32_t x, std::uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// The first two dimensions of the Sobol sequence
+std::uint32_t sobol_0(std::uint32_t index)
+{
+    return reverse_bits(index);
+}
+
+std::uint32_t sobol_1(std::uint32_t index)
+{
+    std::uint32_t v = 1u << 31;
+    std::uint32_t result = 0;
+    for (; index != 0; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+// Padded Owen-scrambled Sobol: each 1D or 2D block shuffles the sample
+// order and scrambles its coordinates with its own seed
+std::uint32_t owen_sobol_1d(std::uint32_t index, std::uint32_t seed)
+{
+    const std::uint32_t i = nested_uniform_scramble(index, hash(seed, 0));
+    return nested_uniform_scramble(sobol_0(i), hash(seed, 1));
+}
+
+void owen_sobol_2d(std::uint32_t index, std::uint32_t seed, std::uint32_t& u, std::uint32_t& v)
+{
+    const std::uint32_t i = nested_uniform_scramble(index, hash(seed, 0));
+    u = nested_uniform_scramble(sobol_0(i), hash(seed, 1));
+    v = nested_uniform_scramble(sobol_1(i), hash(seed, 2));
+}
+
+// Radical inverse with each digit shifted by a random amount, to 32 bits
+double scrambled_radical_inverse(std::uint32_t base, std::uint32_t index, std::uint32_t seed)
+{
+    const double inv_base = 1.0 / base;
+    double inv_base_m = 1.0;
+    double result = 0.0;
+    for (std::uint32_t digit_index = 0; inv_base_m > to_unit; ++digit_index)
+    {
+        const std::uint32_t next = index / base;
+        const std::uint32_t digit = index - next * base;
+        inv_base_m *= inv_base;
+        result += (digit + hash(seed, digit_index) % base) % base * inv_base_m;
+        index = next;
+    }
+
+    return result;
+}
+
+/**
+ * Rank of each cell of a mask_size square, tiling blue noise mask by the
+ * void-and-cluster method (Ulichney 1993). Points
+ * repel each other through a Gaussian energy, so cells of similar rank are
+ * spread evenly over the mask.
+ */
+std::vector<std::uint32_t> make_blue_noise_mask()
+{
+    constexpr int n = mask_size;
+    constexpr int area = n * n;
+    constexpr double sigma = 1.5;
+
+    std::vector<double> kernel(area);
+    for (int dy = 0; dy < n; ++dy)
+    {
+        for (int dx = 0; dx < n; ++dx)
+        {
+            const int wx = std::min(dx, n - dx);
+            const int wy = std::min(dy, n - dy);
+            kernel[dy * n + dx] = std::exp(-(wx * wx + wy * wy) / (2.0 * sigma * sigma));
+        }
+    }
+
+    struct pattern
+    {
+        std::vector<char> set = std::vector<char>(area, 0);
+        std::vector<double> energy = std::vector<double>(area, 0.0);
+    };
+
+    const auto toggle = [&] (pattern& p, int cell)
+    {
+        const double sign = p.set[cell] ? -1.0 : 1.0;
+        p.set[cell] = !p.set[cell];
+        const int cx = cell % n;
+        const int cy = cell / n;
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x)
+                p.energy[y * n + x] += sign * kernel[((y - cy) & (n - 1)) * n + ((x - cx) & (n - 1))];
+    };
+
+    // The set point with the most energy, or the empty cell with the least
+    const auto tightest_cluster = [&] (const pattern& p)
+    {
+        int best = -1;
+        for (int cell = 0; cell < area; ++cell)
+            if (p.set[cell] && (best < 0 || p.energy[cell] > p.energy[best]))
+                best = cell;
+        return best;
+    };
+
+    const auto largest_void = [&] (const pattern& p)
+    {
+        int best = -1;
+        for (int cell = 0; cell < area; ++cell)
+            if (!p.set[cell] && (best < 0 || p.energy[cell] < p.energy[best]))
+                best = cell;
+        return best;
+    };
+
+    // Start from a tenth of the cells at random, then move points from
+    // clusters to voids until that changes nothing
+    pattern initial;
+    std::mt19937_64 gen(1);
+    int num_initial = 0;
+    while (num_initial < area / 10)
+    {
+        const int cell = static_cast<int>(gen() % area);
+        if (!initial.set[cell])
+        {
+            toggle(initial, cell);
+            ++num_initial;
+        }
+    }
+
+    for (;;)
+    {
+        const int cluster = tightest_cluster(initial);
+        toggle(initial, cluster);
+        const int space = largest_void(initial);
+        toggle(initial, space);
+        if (space == cluster)
+            break;
+    }
+
+    // Rank the initial points by taking clusters away, then the rest by
+    // filling voids
+    std::vector<std::uint32_t> rank(area);
+    pattern p = initial;
+    for (int r = num_initial - 1; r >= 0; --r)
+    {
+        const int cluster = tightest_cluster(p);
+        toggle(p, cluster);
+        rank[cluster] = r;
+    }
+
+    p = initial;
+    for (int r = num_initial; r < area; ++r)
+    {
+        const int space = largest_void(p);
+        toggle(p, space);
+        rank[space] = r;
+    }
+
+    return rank;
+}
+
+const std::vector<std::uint32_t>& blue_noise_mask()
+{
+    static const std::vector<std::uint32_t> mask = make_blue_noise_mask();
+    return mask;
+}
+
+// XOR u with the mask rank for pixel (x, y) in its top bits, with the mask
+// offset differently for each dimension. Neighbouring pixels get different
+// leading bits, and a digital shift keeps the sequence's stratification.
+std::uint32_t blue_noise_shift(std::uint32_t u, std::uint32_t x, std::uint32_t y, std::uint32_t dim)
+{
+    const std::uint32_t offset = hash(0x5bd1e995u, dim);
+    const std::uint32_t mx = (x + offset) & (mask_size - 1);
+    const std::uint32_t my = (y + (offset >> 16)) & (mask_size - 1);
+    const std::uint32_t rank = blue_noise_mask()[my * mask_size + mx];
+    return u ^ (rank << (32 - mask_bits)) ^ (hash(offset, rank) >> mask_bits);
+}
+
+// Always converted from double, so both precisions see the same numbers
+real_t to_sample(double u)
+{
+    const real_t r = static_cast<real_t>(u);
+
+    // Rounding to float can reach 1
+    return r < real_t(1) ? r : std::nextafter(real_t(1), real_t(0));
+}
+
+} /* Anonymous namespace */
+
+sampler::sampler(sampler_kind kind, std::uint32_t seed)
+:   _kind(kind)
+,   _seed(seed)
+{
+    // Build the mask now rather than in the middle of a render
+    if (kind == sampler_kind::blue_noise)
+        blue_noise_mask();
+}
+
+void sampler::start(std::size_t x, std::size_t y, std::uint32_t index)
+{
+    _x = static_cast<std::uint32_t>(x);
+    _y = static_cast<std::uint32_t>(y);
+    _index = index;
+    _dim = 0;
+    _pixel_seed = hash(hash(_seed, _x), _y);
+    _block_index = ~0u;
+}
+
+void sampler::start_bounce(int depth)
+{
+    _dim = camera_dimensions + static_cast<std::uint32_t>(depth) * bounce_dimensions;
+}
+
+real_t sampler::get_1d()
+{
+    return get_1d(_dim++);
+}
+
+sample_2d sampler::get_2d()
+{
+    const sample_2d s = get_2d(_dim);
+    _dim += 2;
+    return s;
+}
+
+real_t sampler::get_1d(std::uint32_t dim) const
+{
+    switch (_kind)
+    {
+    case sampler_kind::independent:
+        break;
+    case sampler_kind::sobol:
+        return to_sample(owen_sobol_1d(_index, hash(_pixel_seed, dim)) * to_unit);
+    case sampler_kind::halton:
+        if (dim < num_halton_dimensions)
+            return to_sample(scrambled_radical_inverse(halton_primes[dim], _index, hash(_pixel_seed, dim)));
+        break;
+    case sampler_kind::blue_noise:
+        return to_sample(blue_noise_shift(owen_sobol_1d(_index, hash(_seed, dim)), _x, _y, dim) * to_unit);
+    }
+
+    return to_sample(random_bits(dim) * to_unit);
+}
+
+sample_2d sampler::get_2d(std::uint32_t dim) const
+{
+    std::uint32_t u;
+    std::uint32_t v;
+    switch (_kind)
+    {
+    case sampler_kind::independent:
+    case sampler_kind::halton:
+        break;
+    case sampler_kind::sobol:
+        owen_sobol_2d(_index, hash(_pixel_seed, dim), u, v);
+        return { to_sample(u * to_unit), to_sample(v * to_unit) };
+    case sampler_kind::blue_noise:
+        owen_sobol_2d(_index, hash(_seed, dim), u, v);
+        return {
+            to_sample(blue_noise_shift(u, _x, _y, dim) * to_unit),
+            to_sample(blue_noise_shift(v, _x, _y, dim + 1) * to_unit)
+        };
+    }
+
+    return { get_1d(dim), get_1d(dim + 1) };
+}
+
+std::uint32_t sampler::random_bits(std::uint32_t dim) const
+{
+    const std::uint32_t block = dim / 4;
+    if (block != _block_index)
+    {
+        _block = philox4x32(_x, _y, _index, block, _seed, static_cast<std::uint32_t>(_kind));
+        _block_index = block;
+    }
+
+    return _block.word[dim % 4];
+}
+
+philox_stream sampler::stream(int depth, std::uint32_t walk) const
+{
+    // The top bit keeps these counters apart from the dimension blocks
+    const std::uint32_t id = 0x80000000u | (static_cast<std::uint32_t>(depth) << 4) | walk;
+    const philox_block key = philox4x32(_x, _y, _index, id, _seed, static_cast<std::uint32_t>(_kind));
+    return philox_stream(key.word[0] | static_cast<std::uint64_t>(key.word[1]) << 32);
+}
+
+direction sampler::unit_vector()
+{
+    const sample_2d s = get_2d();
+    const real_t z = 1.0 - 2.0 * s.u;
+    const real_t r = std::sqrt(std::max(real_t(0), 1 - z * z));
+    const real_t phi = 2.0 * pi * s.v;
+    return direction(r * std::cos(phi), r * std::sin(phi), z);
+}
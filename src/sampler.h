@@ -0,0 +1,105 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "philox.h"
+#include "real_type.h"
+#include "vec3.h"
+
+enum class sampler_kind
+{
+    independent,    // Philox random numbers
+    sobol,          // Owen-scrambled Sobol, scrambled per pixel
+    halton,         // Halton with random digit scrambling per pixel
+    blue_noise      // One scrambled Sobol sequence, shifted per pixel by a blue noise mask
+};
+
+struct sample_2d
+{
+    real_t u;
+    real_t v;
+};
+
+/**
+ * The random numbers for one path: sample index of pixel (x, y), in a
+ * fixed layout of dimensions. The camera takes the first camera_dimensions
+ * (pixel position, then wavelength) and each bounce has bounce_dimensions
+ * of its own: two for the scattered direction, one to choose between lobes,
+ * one for Russian roulette, two for a point on a light and one to choose
+ * the light, with one to spare. Materials draw from the start of their
+ * bounce's block, so a path that makes fewer draws at one bounce leaves the
+ * next bounce's dimensions alone.
+ *
+ * Every number is a function of the seed, pixel, sample index and
+ * dimension alone, so images do not depend on the order samples are taken
+ * in or on which thread takes them. Independent numbers come from Philox
+ * with (x, y, index, block of four dimensions) as the counter, two blocks
+ * per bounce. The other kinds give each dimension its own scramble, so
+ * dimensions and pixels are decorrelated, and successive sample indices of
+ * one pixel fill each dimension evenly. The seed gives independent renders
+ * of the same samples.
+ */
+class sampler
+{
+public:
+    static constexpr std::uint32_t camera_dimensions = 4;     // One unused, to align the bounces
+    static constexpr std::uint32_t bounce_dimensions = 8;
+
+    explicit sampler(sampler_kind kind = sampler_kind::independent, std::uint32_t seed = 0);
+
+    sampler_kind kind() const { return _kind; }
+
+    // Start sample index of pixel (x, y), at the camera's dimensions
+    void start(std::size_t x, std::size_t y, std::uint32_t index);
+
+    // Move on to the dimensions of bounce number depth
+    void start_bounce(int depth);
+
+    real_t get_1d();
+    sample_2d get_2d();
+
+    // Specific dimensions, leaving the position alone
+    real_t get_1d(std::uint32_t dim) const;
+    sample_2d get_2d(std::uint32_t dim) const;
+
+    // Uniform on the unit sphere, from one 2D sample
+    direction unit_vector();
+
+    /**
+     * Numbers for walks that take an unbounded count of them, like tracking
+     * through a medium, which cannot have dimensions of their own. Keyed by
+     * pixel, sample, bounce and walk, so they too are fixed for each sample,
+     * but they are independent whatever the kind of sampler.
+     */
+    philox_stream stream(int depth, std::uint32_t walk) const;
+
+    static std::uint32_t roulette_dimension(int depth)
+    {
+        return camera_dimensions + static_cast<std::uint32_t>(depth) * bounce_dimensions + 3;
+    }
+
+    // A point on a light (2D), then which light
+    static std::uint32_t light_dimension(int depth)
+    {
+        return camera_dimensions + static_cast<std::uint32_t>(depth) * bounce_dimensions + 4;
+    }
+
+private:
+    // Philox word for dimension dim, computing a block at a time
+    std::uint32_t random_bits(std::uint32_t dim) const;
+
+    sampler_kind _kind;
+    std::uint32_t _seed;
+    std::uint32_t _pixel_seed = 0;
+    std::uint32_t _x = 0;
+    std::uint32_t _y = 0;
+    std::uint32_t _index = 0;
+    std::uint32_t _dim = 0;
+
+    mutable std::uint32_t _block_index = ~0u;
+    mutable philox_block _block = {};
+};
+
+#endif
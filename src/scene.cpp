@@ -0,0 +1,557 @@
+#include "scene.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#include "bvh.h"
+#include "droplet_field.h"
+#include "sphere.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SCENE_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Scene files are native-endian:
+ *
+ *   header
+ *   material_record[num_materials]
+ *   sphere_record[num_spheres]
+ *   droplet_array_record[num_droplet_arrays]
+ *   droplet[count] and bvh_node[num_nodes] for each array, at their offsets
+ *
+ * Both start on a cache line boundary so they can be used in place once
+ * the file is mapped.
+ */
+
+/**
+ * A whole file mapped read-only, or read into memory where mmap is not
+ * available.
+ */
+class mapped_file
+{
+public:
+    explicit mapped_file(const std::string& filename);
+    ~mapped_file();
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const unsigned char* data() const { return _data; }
+    std::size_t size() const { return _size; }
+
+private:
+    const unsigned char* _data = nullptr;
+    std::size_t _size = 0;
+#ifndef SCENE_HAVE_MMAP
+    std::vector<unsigned char> _buffer;
+#endif
+};
+
+namespace
+{
+
+constexpr char file_magic[4] = { 'R', 'S', 'C', 'N' };
+constexpr std::uint32_t file_version = 1;
+constexpr std::uint64_t section_alignment = 64;
+
+struct file_header
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t num_materials;
+    std::uint32_t num_spheres;
+    std::uint32_t num_droplet_arrays;
+    std::uint32_t reserved[3];
+};
+
+struct material_record
+{
+    std::uint32_t kind;
+    float albedo[3];
+    float fuzz;
+    float ior;
+    std::uint32_t reserved[2];
+};
+
+struct sphere_record
+{
+    float centre[3];
+    float radius;
+    std::uint32_t material;
+    std::uint32_t reserved;
+};
+
+struct droplet_array_record
+{
+    std::uint32_t material;
+    std::uint32_t reserved;
+    std::uint64_t count;
+    std::uint64_t offset;       // From the start of the file
+    std::uint64_t num_nodes;
+    std::uint64_t nodes_offset;
+};
+
+static_assert(sizeof(droplet) == 16 && sizeof(bvh_node) == 32, "Scene file records must be packed");
+
+// Whether count records of size bytes fit at offset, suitably aligned
+bool section_fits(std::uint64_t offset, std::uint64_t count, std::size_t size, std::size_t file_size)
+{
+    return offset % section_alignment == 0 && offset <= file_size && count <= (file_size - offset) / size;
+}
+
+std::unique_ptr<material> make_material(const material_desc& m)
+{
+    switch (m.kind)
+    {
+    case material_kind::lambertian:
+        return std::make_unique<lambertian>(m.albedo);
+    case material_kind::metal:
+        return std::make_unique<metal>(m.albedo, m.fuzz);
+    case material_kind::dielectric:
+        return m.ior > 0.0
+                ? std::make_unique<dielectric>(m.ior)
+                : std::make_unique<dielectric>(refractive_index::water());
+    case material_kind::light:
+        return std::make_unique<light>(m.albedo);
+    }
+
+    throw std::runtime_error("Unknown material kind");
+}
+
+std::uint64_t align_up(std::uint64_t n, std::uint64_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+// The splitmix64 finaliser
+std::uint64_t mix64(std::uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Values are hashed as floats, so both precisions give the same fingerprint
+std::uint64_t float_bits(real_t v)
+{
+    const float f = static_cast<float>(v);
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+} /* Anonymous namespace */
+
+#ifdef SCENE_HAVE_MMAP
+
+mapped_file::mapped_file(const std::string& filename)
+{
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open " + filename);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Cannot read " + filename);
+    }
+
+    _size = static_cast<std::size_t>(st.st_size);
+    if (_size > 0)
+    {
+        void* p = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("Cannot map " + filename);
+        }
+        ::madvise(p, _size, MADV_WILLNEED);
+        _data = static_cast<const unsigned char*>(p);
+    }
+
+    // The mapping keeps the file open
+    ::close(fd);
+}
+
+mapped_file::~mapped_file()
+{
+    if (_data)
+        ::munmap(const_cast<unsigned char*>(_data), _size);
+}
+
+#else
+
+mapped_file::mapped_file(const std::string& filename)
+{
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in)
+        throw std::runtime_error("Cannot open " + filename);
+
+    _buffer.resize(static_cast<std::size_t>(in.tellg()));
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(_buffer.data()), _buffer.size());
+    if (!in)
+        throw std::runtime_error("Cannot read " + filename);
+
+    _data = _buffer.data();
+    _size = _buffer.size();
+}
+
+mapped_file::~mapped_file() = default;
+
+#endif /* SCENE_HAVE_MMAP */
+
+std::uint32_t scene::add_material(const material_desc& m)
+{
+    _materials.push_back(make_material(m));
+    _material_descs.push_back(m);
+    return static_cast<std::uint32_t>(_materials.size() - 1);
+}
+
+void scene::add_sphere(const position& centre, real_t radius, std::uint32_t material)
+{
+    if (material >= _materials.size())
+        throw std::runtime_error("Bad material index for sphere");
+    _spheres.push_back({ centre, radius, material });
+}
+
+void scene::add_droplets(std::vector<droplet> droplets, std::uint32_t material)
+{
+    if (material >= _materials.size())
+        throw std::runtime_error("Bad material index for droplets");
+    if (droplets.empty())
+        return;
+
+    // Moving the vector keeps its buffer, so the pointer stays valid
+    _owned_droplets.push_back(std::move(droplets));
+    const std::vector<droplet>& d = _owned_droplets.back();
+    _droplets.push_back({ d.data(), d.size(), nullptr, 0, material });
+}
+
+void scene::build_trees()
+{
+    for (droplet_array& a : _droplets)
+    {
+        if (a.nodes)
+            continue;
+
+        // Only generated arrays lack trees, and those are owned
+        auto owned = std::find_if(_owned_droplets.begin(), _owned_droplets.end(),
+                [&] (const std::vector<droplet>& d) { return d.data() == a.data; });
+
+        const bvh_tree tree = sphere_set::build_tree(a.data, a.count);
+        std::vector<droplet> sorted(a.count);
+        for (std::size_t slot = 0; slot < a.count; ++slot)
+            sorted[slot] = a.data[tree.order()[slot]];
+
+        *owned = std::move(sorted);
+        _owned_nodes.push_back(tree.nodes());
+        a.data = owned->data();
+        a.nodes = _owned_nodes.back().data();
+        a.num_nodes = _owned_nodes.back().size();
+    }
+}
+
+std::size_t scene::num_droplets() const
+{
+    std::size_t n = 0;
+    for (const droplet_array& a : _droplets)
+        n += a.count;
+    return n;
+}
+
+std::uint64_t scene::fingerprint() const
+{
+    check_droplets();
+
+    std::uint64_t h = 0;
+    const auto add = [&h] (std::uint64_t v) { h = mix64(h ^ v) + 0x9e3779b97f4a7c15ull; };
+
+    for (const material_desc& m : _material_descs)
+    {
+        add(static_cast<std::uint64_t>(m.kind));
+        add(float_bits(m.albedo.x) << 32 | float_bits(m.albedo.y));
+        add(float_bits(m.albedo.z) << 32 | float_bits(m.fuzz));
+        add(float_bits(m.ior));
+    }
+
+    for (const sphere_desc& s : _spheres)
+    {
+        add(float_bits(s.centre.x) << 32 | float_bits(s.centre.y));
+        add(float_bits(s.centre.z) << 32 | float_bits(s.radius));
+        add(s.material);
+    }
+
+    // Saving reorders each array into its tree's leaf order, so droplets are
+    // summed rather than chained and the order does not matter
+    for (const droplet_array& a : _droplets)
+    {
+        std::uint64_t sum = 0;
+        for (std::size_t i = 0; i < a.count; ++i)
+        {
+            std::uint32_t bits[4];
+            std::memcpy(bits, &a.data[i], sizeof(bits));
+            sum += mix64(mix64(std::uint64_t(bits[0]) << 32 | bits[1]) ^ (std::uint64_t(bits[2]) << 32 | bits[3]));
+        }
+        add(a.material);
+        add(a.count);
+        add(sum);
+    }
+
+    return h;
+}
+
+scene scene::load(const std::string& filename)
+{
+    auto file = std::make_shared<const mapped_file>(filename);
+    const unsigned char* data = file->data();
+    const std::size_t size = file->size();
+
+    file_header header;
+    if (size < sizeof(header))
+        throw std::runtime_error("Not a scene file: " + filename);
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0 || header.version != file_version)
+        throw std::runtime_error("Not a scene file: " + filename);
+
+    const std::uint64_t table_size =
+            std::uint64_t(header.num_materials) * sizeof(material_record)
+            + std::uint64_t(header.num_spheres) * sizeof(sphere_record)
+            + std::uint64_t(header.num_droplet_arrays) * sizeof(droplet_array_record);
+    if (sizeof(header) + table_size > size)
+        throw std::runtime_error("Truncated scene file: " + filename);
+
+    scene s;
+    std::size_t pos = sizeof(header);
+
+    for (std::uint32_t i = 0; i < header.num_materials; ++i, pos += sizeof(material_record))
+    {
+        material_record m;
+        std::memcpy(&m, data + pos, sizeof(m));
+        if (m.kind >= static_cast<std::uint32_t>(num_material_kinds))
+            throw std::runtime_error("Unknown material kind in " + filename);
+        s.add_material({
+                static_cast<material_kind>(m.kind),
+                colour(m.albedo[0], m.albedo[1], m.albedo[2]),
+                m.fuzz,
+                m.ior });
+    }
+
+    for (std::uint32_t i = 0; i < header.num_spheres; ++i, pos += sizeof(sphere_record))
+    {
+        sphere_record r;
+        std::memcpy(&r, data + pos, sizeof(r));
+        s.add_sphere(position(r.centre[0], r.centre[1], r.centre[2]), r.radius, r.material);
+    }
+
+    for (std::uint32_t i = 0; i < header.num_droplet_arrays; ++i, pos += sizeof(droplet_array_record))
+    {
+        droplet_array_record a;
+        std::memcpy(&a, data + pos, sizeof(a));
+        if (a.material >= s._materials.size())
+            throw std::runtime_error("Bad material index in " + filename);
+        if (!section_fits(a.offset, a.count, sizeof(droplet), size)
+                || !section_fits(a.nodes_offset, a.num_nodes, sizeof(bvh_node), size))
+            throw std::runtime_error("Truncated scene file: " + filename);
+
+        // Used in place: no copy, and pages are only read when first touched
+        s._droplets.push_back({
+                reinterpret_cast<const droplet*>(data + a.offset), a.count,
+                reinterpret_cast<const bvh_node*>(data + a.nodes_offset), a.num_nodes,
+                a.material });
+    }
+
+    s._file = std::move(file);
+    return s;
+}
+
+void scene::check_droplets() const
+{
+    for (const droplet_array& a : _droplets)
+    {
+        if (!a.data)
+            throw std::runtime_error("The scene's droplets have been given to droplet fields");
+    }
+}
+
+void scene::save(const std::string& filename)
+{
+    check_droplets();
+    build_trees();
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        throw std::runtime_error("Cannot open " + filename);
+
+    file_header header = {};
+    std::memcpy(header.magic, file_magic, sizeof(file_magic));
+    header.version = file_version;
+    header.num_materials = static_cast<std::uint32_t>(_material_descs.size());
+    header.num_spheres = static_cast<std::uint32_t>(_spheres.size());
+    header.num_droplet_arrays = static_cast<std::uint32_t>(_droplets.size());
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (const material_desc& m : _material_descs)
+    {
+        material_record r = {};
+        r.kind = static_cast<std::uint32_t>(m.kind);
+        r.albedo[0] = static_cast<float>(m.albedo.x);
+        r.albedo[1] = static_cast<float>(m.albedo.y);
+        r.albedo[2] = static_cast<float>(m.albedo.z);
+        r.fuzz = static_cast<float>(m.fuzz);
+        r.ior = static_cast<float>(m.ior);
+        out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+    }
+
+    for (const sphere_desc& s : _spheres)
+    {
+        sphere_record r = {};
+        r.centre[0] = static_cast<float>(s.centre.x);
+        r.centre[1] = static_cast<float>(s.centre.y);
+        r.centre[2] = static_cast<float>(s.centre.z);
+        r.radius = static_cast<float>(s.radius);
+        r.material = s.material;
+        out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+    }
+
+    std::uint64_t offset = sizeof(header)
+            + _material_descs.size() * sizeof(material_record)
+            + _spheres.size() * sizeof(sphere_record)
+            + _droplets.size() * sizeof(droplet_array_record);
+    std::vector<droplet_array_record> records;
+    for (const droplet_array& a : _droplets)
+    {
+        droplet_array_record r = {};
+        r.material = a.material;
+        r.count = a.count;
+        r.offset = align_up(offset, section_alignment);
+        r.num_nodes = a.num_nodes;
+        r.nodes_offset = align_up(r.offset + a.count * sizeof(droplet), section_alignment);
+        offset = r.nodes_offset + a.num_nodes * sizeof(bvh_node);
+
+        out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+        records.push_back(r);
+    }
+
+    static const char padding[section_alignment] = {};
+    const auto pad_to = [&] (std::uint64_t offset)
+    {
+        const std::uint64_t here = static_cast<std::uint64_t>(out.tellp());
+        out.write(padding, static_cast<std::streamsize>(offset - here));
+    };
+
+    for (std::size_t i = 0; i < _droplets.size(); ++i)
+    {
+        const droplet_array& a = _droplets[i];
+        pad_to(records[i].offset);
+        out.write(reinterpret_cast<const char*>(a.data), a.count * sizeof(droplet));
+        pad_to(records[i].nodes_offset);
+        out.write(reinterpret_cast<const char*>(a.nodes), a.num_nodes * sizeof(bvh_node));
+    }
+
+    if (!out)
+        throw std::runtime_error("Failed to write " + filename);
+}
+
+std::unique_ptr<bvh> scene::build_world(bool compact, std::vector<sphere_set*>* droplet_sets)
+{
+    check_droplets();
+
+    hittable_list objects;
+    for (const sphere_desc& s : _spheres)
+        objects.add(std::make_unique<sphere>(s.centre, s.radius, _materials[s.material].get()));
+
+    if (droplet_sets)
+        droplet_sets->clear();
+
+    for (droplet_array& a : _droplets)
+    {
+        const material* mat = _materials[a.material].get();
+        std::unique_ptr<sphere_set> set;
+        if (compact)
+        {
+            // Generated arrays are handed over; mapped ones are copied
+            auto owned = std::find_if(_owned_droplets.begin(), _owned_droplets.end(),
+                    [&] (const std::vector<droplet>& d) { return d.data() == a.data; });
+            std::vector<droplet> droplets = owned != _owned_droplets.end()
+                    ? std::move(*owned)
+                    : std::vector<droplet>(a.data, a.data + a.count);
+            a.data = nullptr;
+            a.nodes = nullptr;
+            a.num_nodes = 0;
+            objects.add(std::make_unique<droplet_field>(std::move(droplets), mat));
+        }
+        else if (a.nodes)
+        {
+            bvh_tree tree(std::vector<bvh_node>(a.nodes, a.nodes + a.num_nodes), a.count);
+            set = std::make_unique<sphere_set>(a.data, a.count, mat, std::move(tree));
+        }
+        else
+            set = std::make_unique<sphere_set>(a.data, a.count, mat);
+
+        if (droplet_sets)
+            droplet_sets->push_back(set.get());
+        if (set)
+            objects.add(std::move(set));
+    }
+
+    // Nothing refers to the droplet storage any more
+    if (compact)
+    {
+        std::vector<std::vector<droplet>>().swap(_owned_droplets);
+        std::vector<std::vector<bvh_node>>().swap(_owned_nodes);
+        _file.reset();
+    }
+
+    return std::make_unique<bvh>(objects.release());
+}
+
+light_list scene::lights() const
+{
+    light_list lights;
+    for (const sphere_desc& s : _spheres)
+    {
+        if (_material_descs[s.material].kind == material_kind::light)
+            lights.add_sphere(s.centre, s.radius, _materials[s.material].get());
+    }
+
+    return lights;
+}
+
+scene default_scene(std::size_t width, std::size_t height, bool sun_sphere)
+{
+    scene s;
+    const std::uint32_t water = s.add_material({ material_kind::dielectric, colour(1.0, 1.0, 1.0), 0.0, 0.0 });
+    if (sun_sphere)
+    {
+        const std::uint32_t sun = s.add_material({ material_kind::light, colour(0.0, 1.0, 1.0), 0.0, 0.0 });
+        s.add_sphere(position(0.0, 0.0, 10.0), 1.0, sun);
+    }
+
+    const real_t aspect_ratio = static_cast<real_t>(width) / height;
+    std::vector<droplet> droplets;
+    for (std::size_t i = 0; i < width; i += 10)
+    {
+        for (std::size_t j = 0; j < height; j += 10)
+        {
+            const real_t x = -1.0*aspect_ratio + (2.0*aspect_ratio * (static_cast<real_t>(i)/width));
+            const real_t y = -1.0 + (2.0 * (static_cast<real_t>(j)/height));
+            droplets.push_back({ static_cast<float>(x), static_cast<float>(y), -1.0f, 0.1f });
+        }
+    }
+    s.add_droplets(std::move(droplets), water);
+
+    return s;
+}
@@ -0,0 +1,127 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "real_type.h"
+#include "vec3.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "lights.h"
+#include "material.h"
+#include "sphere_set.h"
+
+struct material_desc
+{
+    material_kind kind;
+    colour albedo;      // Albedo, or emitted colour for lights
+    real_t fuzz;        // Metals only
+    real_t ior;         // Dielectrics only; 0 for dispersive water
+};
+
+class mapped_file;
+
+/**
+ * Materials, individual spheres and arrays of droplets, each array sharing
+ * one material. Scenes are saved in a binary format holding the packed
+ * droplet records, in the leaf order of their sphere_set BVH, and the trees
+ * themselves, so load() maps the file and the world is built from the
+ * mapped arrays without rebuilding any trees.
+ */
+class scene
+{
+public:
+    scene() = default;
+
+    // Droplet arrays may point into this scene's own storage
+    scene(const scene&) = delete;
+    scene& operator=(const scene&) = delete;
+    scene(scene&&) = default;
+    scene& operator=(scene&&) = default;
+
+    std::uint32_t add_material(const material_desc& m);
+    void add_sphere(const position& centre, real_t radius, std::uint32_t material);
+    void add_droplets(std::vector<droplet> droplets, std::uint32_t material);
+
+    // Throws std::runtime_error if the file is missing or malformed
+    static scene load(const std::string& filename);
+
+    // Builds any droplet trees the scene does not have yet, and keeps them
+    void save(const std::string& filename);
+
+    std::size_t num_spheres() const { return _spheres.size(); }
+    std::size_t num_droplets() const;
+
+    /**
+     * Hash of the materials, spheres and droplets, the same for a scene
+     * and its saved copy in either precision. Throws std::runtime_error
+     * once droplet fields have taken the droplets.
+     */
+    std::uint64_t fingerprint() const;
+
+    // Droplet array i, in the order its sphere_set in the world indexes it
+    std::size_t num_droplet_arrays() const { return _droplets.size(); }
+    const droplet* droplets(std::size_t i) const { return _droplets[i].data; }
+    std::size_t num_droplets(std::size_t i) const { return _droplets[i].count; }
+
+    /**
+     * The world refers to the scene's materials and droplets, so must not
+     * outlive the scene. Droplet arrays become sphere_sets, or with compact
+     * set, droplet_fields, which need far less memory for big arrays.
+     * Droplet fields take the droplets over, so afterwards the scene only
+     * knows how many there were: droplets(i) is null, and the scene can
+     * be neither saved nor built again.
+     * With droplet_sets, each array's sphere_set is listed there, or null
+     * for a droplet_field, so it can be moved and the world refit.
+     */
+    std::unique_ptr<bvh> build_world(bool compact = false, std::vector<sphere_set*>* droplet_sets = nullptr);
+
+    // The spheres with light materials, which like the world refer to the
+    // scene's materials
+    light_list lights() const;
+
+private:
+    struct sphere_desc
+    {
+        position centre;
+        real_t radius;
+        std::uint32_t material;
+    };
+
+    // nodes is null until the array's tree has been built, and data is null
+    // once a droplet_field has taken the droplets
+    struct droplet_array
+    {
+        const droplet* data;
+        std::size_t count;
+        const bvh_node* nodes;
+        std::size_t num_nodes;
+        std::uint32_t material;
+    };
+
+    void build_trees();
+    void check_droplets() const;
+
+    std::vector<material_desc> _material_descs;
+    std::vector<std::unique_ptr<material>> _materials;
+    std::vector<sphere_desc> _spheres;
+    std::vector<droplet_array> _droplets;
+
+    // Storage behind _droplets: generated arrays, or the mapped file
+    std::vector<std::vector<droplet>> _owned_droplets;
+    std::vector<std::vector<bvh_node>> _owned_nodes;
+    std::shared_ptr<const mapped_file> _file;
+};
+
+/**
+ * The built-in scene: the sun behind the camera and a grid of droplets
+ * every ten pixels across the view plane. Without sun_sphere the sun is
+ * left out, for lighting by a distant light instead.
+ */
+scene default_scene(std::size_t width, std::size_t height, bool sun_sphere = true);
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef SIMD_LANES_H
+#define SIMD_LANES_H
+
+#include <cstdint>
+
+#include "real_type.h"
+
+/*
+ * AVX2 and AVX-512 registers of real_t lanes, for kernels built for each
+ * instruction set with the target attributes below and picked at run time
+ * with __builtin_cpu_supports(). SIMD_X86 is only defined where they exist.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#ifdef SIMD_X86
+
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#define SIMD_AVX512 __attribute__((target("avx512f")))
+
+/*
+ * The operations kernels need on a register of real_t lanes, so the same
+ * kernel code serves both precisions. Masks have one lane per bit.
+ */
+
+struct avx2_lanes
+{
+#ifdef RAINBOW_SINGLE_PRECISION
+    using vec = __m256;
+    static constexpr std::uint32_t width = 8;
+
+    SIMD_AVX2 static vec set1(real_t v) { return _mm256_set1_ps(v); }
+    SIMD_AVX2 static vec load(const real_t* p) { return _mm256_loadu_ps(p); }
+    SIMD_AVX2 static void store(real_t* p, vec v) { _mm256_store_ps(p, v); }
+    SIMD_AVX2 static vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+    SIMD_AVX2 static vec sub(vec a, vec b) { return _mm256_sub_ps(a, b); }
+    SIMD_AVX2 static vec mul(vec a, vec b) { return _mm256_mul_ps(a, b); }
+    SIMD_AVX2 static vec div(vec a, vec b) { return _mm256_div_ps(a, b); }
+    SIMD_AVX2 static vec sqrt(vec a) { return _mm256_sqrt_ps(a); }
+    SIMD_AVX2 static vec min(vec a, vec b) { return _mm256_min_ps(a, b); }
+    SIMD_AVX2 static vec max(vec a, vec b) { return _mm256_max_ps(a, b); }
+    SIMD_AVX2 static vec negate(vec a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+
+    // |a| with the sign of b
+    SIMD_AVX2 static vec copysign(vec a, vec b)
+    {
+        return _mm256_or_ps(a, _mm256_and_ps(b, _mm256_set1_ps(-0.0f)));
+    }
+
+    SIMD_AVX2 static unsigned lt(vec a, vec b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+    SIMD_AVX2 static unsigned gt(vec a, vec b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+    SIMD_AVX2 static unsigned nlt(vec a, vec b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NLT_UQ)); }
+
+    // b in the lanes where s is negative, a elsewhere
+    SIMD_AVX2 static vec select_negative(vec s, vec a, vec b) { return _mm256_blendv_ps(a, b, s); }
+#else
+    using vec = __m256d;
+    static constexpr std::uint32_t width = 4;
+
+    SIMD_AVX2 static vec set1(real_t v) { return _mm256_set1_pd(v); }
+    SIMD_AVX2 static vec load(const real_t* p) { return _mm256_loadu_pd(p); }
+    SIMD_AVX2 static void store(real_t* p, vec v) { _mm256_store_pd(p, v); }
+    SIMD_AVX2 static vec add(vec a, vec b) { return _mm256_add_pd(a, b); }
+    SIMD_AVX2 static vec sub(vec a, vec b) { return _mm256_sub_pd(a, b); }
+    SIMD_AVX2 static vec mul(vec a, vec b) { return _mm256_mul_pd(a, b); }
+    SIMD_AVX2 static vec div(vec a, vec b) { return _mm256_div_pd(a, b); }
+    SIMD_AVX2 static vec sqrt(vec a) { return _mm256_sqrt_pd(a); }
+    SIMD_AVX2 static vec min(vec a, vec b) { return _mm256_min_pd(a, b); }
+    SIMD_AVX2 static vec max(vec a, vec b) { return _mm256_max_pd(a, b); }
+    SIMD_AVX2 static vec negate(vec a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+
+    SIMD_AVX2 static vec copysign(vec a, vec b)
+    {
+        return _mm256_or_pd(a, _mm256_and_pd(b, _mm256_set1_pd(-0.0)));
+    }
+
+    SIMD_AVX2 static unsigned lt(vec a, vec b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+    SIMD_AVX2 static unsigned gt(vec a, vec b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ)); }
+    SIMD_AVX2 static unsigned nlt(vec a, vec b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_NLT_UQ)); }
+    SIMD_AVX2 static vec select_negative(vec s, vec a, vec b) { return _mm256_blendv_pd(a, b, s); }
+#endif
+};
+
+struct avx512_lanes
+{
+#ifdef RAINBOW_SINGLE_PRECISION
+    using vec = __m512;
+    static constexpr std::uint32_t width = 16;
+
+    SIMD_AVX512 static vec set1(real_t v) { return _mm512_set1_ps(v); }
+    SIMD_AVX512 static vec load(const real_t* p) { return _mm512_loadu_ps(p); }
+    SIMD_AVX512 static void store(real_t* p, vec v) { _mm512_store_ps(p, v); }
+    SIMD_AVX512 static vec add(vec a, vec b) { return _mm512_add_ps(a, b); }
+    SIMD_AVX512 static vec sub(vec a, vec b) { return _mm512_sub_ps(a, b); }
+    SIMD_AVX512 static vec mul(vec a, vec b) { return _mm512_mul_ps(a, b); }
+    SIMD_AVX512 static vec div(vec a, vec b) { return _mm512_div_ps(a, b); }
+    SIMD_AVX512 static vec sqrt(vec a) { return _mm512_maskz_sqrt_ps(0xffff, a); }
+    SIMD_AVX512 static vec min(vec a, vec b) { return _mm512_maskz_min_ps(0xffff, a, b); }
+    SIMD_AVX512 static vec max(vec a, vec b) { return _mm512_maskz_max_ps(0xffff, a, b); }
+
+    // Plain AVX-512F has no floating point logic ops, so go via integers
+    SIMD_AVX512 static vec negate(vec a)
+    {
+        return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(INT32_MIN)));
+    }
+
+    SIMD_AVX512 static vec copysign(vec a, vec b)
+    {
+        const __m512i sign = _mm512_and_si512(_mm512_castps_si512(b), _mm512_set1_epi32(INT32_MIN));
+        return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a), sign));
+    }
+
+    SIMD_AVX512 static unsigned lt(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    SIMD_AVX512 static unsigned gt(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    SIMD_AVX512 static unsigned nlt(vec a, vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_NLT_UQ); }
+
+    SIMD_AVX512 static vec select_negative(vec s, vec a, vec b)
+    {
+        return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(s, _mm512_setzero_ps(), _CMP_LT_OQ), a, b);
+    }
+#else
+    using vec = __m512d;
+    static constexpr std::uint32_t width = 8;
+
+    SIMD_AVX512 static vec set1(real_t v) { return _mm512_set1_pd(v); }
+    SIMD_AVX512 static vec load(const real_t* p) { return _mm512_loadu_pd(p); }
+    SIMD_AVX512 static void store(real_t* p, vec v) { _mm512_store_pd(p, v); }
+    SIMD_AVX512 static vec add(vec a, vec b) { return _mm512_add_pd(a, b); }
+    SIMD_AVX512 static vec sub(vec a, vec b) { return _mm512_sub_pd(a, b); }
+    SIMD_AVX512 static vec mul(vec a, vec b) { return _mm512_mul_pd(a, b); }
+    SIMD_AVX512 static vec div(vec a, vec b) { return _mm512_div_pd(a, b); }
+    SIMD_AVX512 static vec sqrt(vec a) { return _mm512_maskz_sqrt_pd(0xff, a); }
+    SIMD_AVX512 static vec min(vec a, vec b) { return _mm512_maskz_min_pd(0xff, a, b); }
+    SIMD_AVX512 static vec max(vec a, vec b) { return _mm512_maskz_max_pd(0xff, a, b); }
+
+    SIMD_AVX512 static vec negate(vec a)
+    {
+        return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(INT64_MIN)));
+    }
+
+    SIMD_AVX512 static vec copysign(vec a, vec b)
+    {
+        const __m512i sign = _mm512_and_si512(_mm512_castpd_si512(b), _mm512_set1_epi64(INT64_MIN));
+        return _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(a), sign));
+    }
+
+    SIMD_AVX512 static unsigned lt(vec a, vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+    SIMD_AVX512 static unsigned gt(vec a, vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+    SIMD_AVX512 static unsigned nlt(vec a, vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_NLT_UQ); }
+
+    SIMD_AVX512 static vec select_negative(vec s, vec a, vec b)
+    {
+        return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(s, _mm512_setzero_pd(), _CMP_LT_OQ), a, b);
+    }
+#endif
+};
+
+#endif /* SIMD_X86 */
+
+#endif
@@ -0,0 +1,153 @@
+#include "spectrum.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+
+constexpr real_t lambda_range = lambda_max - lambda_min;
+
+real_t lobe(real_t x, real_t mu, real_t sigma_lo, real_t sigma_hi)
+{
+    const real_t t = (x - mu) / (x < mu ? sigma_lo : sigma_hi);
+    return std::exp(-0.5 * t * t);
+}
+
+/*
+ * CIE 1931 colour matching functions, using the multi-lobe Gaussian fit of
+ * Wyman, Sloan and Shirley, "Simple Analytic Approximations to the CIE XYZ
+ * Color Matching Functions" (JCGT 2013).
+ */
+colour cie_xyz(real_t lambda)
+{
+    const real_t x = 1.056 * lobe(lambda, 599.8, 37.9, 31.0)
+            + 0.362 * lobe(lambda, 442.0, 16.0, 26.7)
+            - 0.065 * lobe(lambda, 501.1, 20.4, 26.2);
+    const real_t y = 0.821 * lobe(lambda, 568.8, 46.9, 40.5)
+            + 0.286 * lobe(lambda, 530.9, 16.3, 31.1);
+    const real_t z = 1.217 * lobe(lambda, 437.0, 11.8, 36.0)
+            + 0.681 * lobe(lambda, 459.0, 26.0, 13.8);
+    return { x, y, z };
+}
+
+colour xyz_to_linear_srgb(const colour& xyz)
+{
+    return colour(
+        3.2404542*xyz.x - 1.5371385*xyz.y - 0.4985314*xyz.z,
+        -0.9692660*xyz.x + 1.8760108*xyz.y + 0.0415560*xyz.z,
+        0.0556434*xyz.x - 0.2040259*xyz.y + 1.0572252*xyz.z);
+}
+
+struct cie_constants
+{
+    real_t y_integral;
+    colour white;   // sRGB of a flat unit spectrum, used to white balance
+};
+
+const cie_constants& constants()
+{
+    static const cie_constants c = [] ()
+    {
+        colour xyz(0.0, 0.0, 0.0);
+        for (real_t lambda = lambda_min; lambda <= lambda_max; lambda += 1.0)
+            xyz += cie_xyz(lambda);
+
+        const colour rgb = xyz_to_linear_srgb(xyz / xyz.y);
+        return cie_constants{ xyz.y, rgb };
+    }();
+    return c;
+}
+
+real_t saturate(real_t x)
+{
+    return std::min(std::max(x, real_t(0.0)), real_t(1.0));
+}
+
+} /* Anonymous namespace */
+
+wavelengths wavelengths::sample_uniform(real_t u)
+{
+    wavelengths w;
+    w._lambda[0] = lambda_min + u * lambda_range;
+
+    constexpr real_t delta = lambda_range / num_wavelengths;
+    for (int i = 1; i < num_wavelengths; ++i)
+    {
+        w._lambda[i] = w._lambda[i - 1] + delta;
+        if (w._lambda[i] > lambda_max)
+            w._lambda[i] -= lambda_range;
+    }
+
+    for (int i = 0; i < num_wavelengths; ++i)
+        w._pdf[i] = 1.0 / lambda_range;
+
+    return w;
+}
+
+wavelengths wavelengths::single(real_t lambda)
+{
+    wavelengths w;
+    for (int i = 0; i < num_wavelengths; ++i)
+    {
+        w._lambda[i] = lambda;
+        w._pdf[i] = 0.0;
+    }
+    w._pdf[0] = 1.0;
+
+    return w;
+}
+
+void wavelengths::terminate_secondary()
+{
+    if (secondary_terminated())
+        return;
+
+    for (int i = 1; i < num_wavelengths; ++i)
+        _pdf[i] = 0.0;
+    _pdf[0] /= num_wavelengths;
+}
+
+bool wavelengths::secondary_terminated() const
+{
+    for (int i = 1; i < num_wavelengths; ++i)
+        if (_pdf[i] != 0.0)
+            return false;
+    return true;
+}
+
+spectral_sample rgb_to_spectrum(const colour& c, const wavelengths& lambdas)
+{
+    // Blue, green and red bands with soft edges that sum to one everywhere,
+    // so white stays flat and the round trip through spectrum_to_rgb is
+    // close for unsaturated colours
+    spectral_sample s;
+    for (int i = 0; i < num_wavelengths; ++i)
+    {
+        const real_t blue = saturate((510.0 - lambdas[i]) / 30.0);
+        const real_t red = saturate((lambdas[i] - 570.0) / 30.0);
+        const real_t green = 1.0 - blue - red;
+        s[i] = red*c.x + green*c.y + blue*c.z;
+    }
+
+    return s;
+}
+
+colour lambda_to_rgb(real_t lambda)
+{
+    const cie_constants& c = constants();
+    const colour rgb = xyz_to_linear_srgb(cie_xyz(lambda) / c.y_integral);
+    return { rgb.x / c.white.x, rgb.y / c.white.y, rgb.z / c.white.z };
+}
+
+colour spectrum_to_rgb(const spectral_sample& s, const wavelengths& lambdas)
+{
+    colour rgb(0.0, 0.0, 0.0);
+    for (int i = 0; i < num_wavelengths; ++i)
+    {
+        if (lambdas.pdf(i) != 0.0)
+            rgb += lambda_to_rgb(lambdas[i]) * (s[i] / lambdas.pdf(i));
+    }
+
+    return rgb / num_wavelengths;
+}
\ No newline at end of file
@@ -0,0 +1,127 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include "real_type.h"
+#include "vec3.h"
+
+// Wavelengths are in nanometres throughout
+constexpr int num_wavelengths = 4;
+constexpr real_t lambda_min = 380.0;
+constexpr real_t lambda_max = 720.0;
+
+/**
+ * Values of some spectral quantity (radiance, attenuation, ...) at each of
+ * the wavelengths carried by a path.
+ */
+class spectral_sample
+{
+public:
+    spectral_sample() = default;
+
+    explicit spectral_sample(real_t v)
+    {
+        for (int i = 0; i < num_wavelengths; ++i)
+            _v[i] = v;
+    }
+
+    real_t operator[](int i) const { return _v[i]; }
+    real_t& operator[](int i) { return _v[i]; }
+
+    spectral_sample& operator+=(const spectral_sample& s)
+    {
+        for (int i = 0; i < num_wavelengths; ++i)
+            _v[i] += s._v[i];
+        return *this;
+    }
+
+    spectral_sample& operator*=(const spectral_sample& s)
+    {
+        for (int i = 0; i < num_wavelengths; ++i)
+            _v[i] *= s._v[i];
+        return *this;
+    }
+
+    spectral_sample& operator*=(real_t s)
+    {
+        for (int i = 0; i < num_wavelengths; ++i)
+            _v[i] *= s;
+        return *this;
+    }
+
+    real_t max_value() const
+    {
+        real_t m = _v[0];
+        for (int i = 1; i < num_wavelengths; ++i)
+            m = _v[i] > m ? _v[i] : m;
+        return m;
+    }
+
+    bool is_black() const
+    {
+        for (int i = 0; i < num_wavelengths; ++i)
+            if (_v[i] != 0.0)
+                return false;
+        return true;
+    }
+
+private:
+    real_t _v[num_wavelengths] = {};
+};
+
+inline spectral_sample operator+(spectral_sample lhs, const spectral_sample& rhs)
+{
+    return lhs += rhs;
+}
+
+inline spectral_sample operator*(spectral_sample lhs, const spectral_sample& rhs)
+{
+    return lhs *= rhs;
+}
+
+inline spectral_sample operator*(spectral_sample s, real_t k)
+{
+    return s *= k;
+}
+
+inline spectral_sample operator*(real_t k, spectral_sample s)
+{
+    return s *= k;
+}
+
+/**
+ * The wavelengths carried by one path, using hero wavelength sampling: the
+ * hero is drawn uniformly and the others are evenly spaced after it,
+ * wrapping around the visible range. A dispersive interface can only follow
+ * one of them, so it terminates the secondary wavelengths and the hero
+ * carries on alone with its pdf adjusted to match.
+ */
+class wavelengths
+{
+public:
+    static wavelengths sample_uniform(real_t u);
+
+    // A lone hero wavelength, with the secondaries already terminated
+    static wavelengths single(real_t lambda);
+
+    real_t operator[](int i) const { return _lambda[i]; }
+    real_t pdf(int i) const { return _pdf[i]; }
+
+    void terminate_secondary();
+    bool secondary_terminated() const;
+
+private:
+    real_t _lambda[num_wavelengths];
+    real_t _pdf[num_wavelengths];
+};
+
+// Value of an RGB reflectance or emission at each wavelength
+spectral_sample rgb_to_spectrum(const colour& c, const wavelengths& lambdas);
+
+// Linear sRGB per unit spectral radiance at lambda. Integrating this against
+// a flat unit spectrum over [lambda_min, lambda_max] gives (1, 1, 1).
+colour lambda_to_rgb(real_t lambda);
+
+// Monte Carlo estimate of linear sRGB from one path's spectral radiance
+colour spectrum_to_rgb(const spectral_sample& s, const wavelengths& lambdas);
+
+#endif
\ No newline at end of file
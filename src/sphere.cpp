@@ -3,6 +3,8 @@
 #include <cmath>
 #include <stdexcept>
 
+#include "stats.h"
+
 sphere::sphere(const position& centre, real_t radius, const material* mat)
 :   _centre(centre)
 ,   _radius(radius)
@@ -12,33 +14,75 @@ sphere::sphere(const position& centre, real_t radius, const material* mat)
         std::runtime_error("No material set for sphere");
 }
 
-bool sphere::hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+/*
+ * The textbook b^2 - ac discriminant loses everything to cancellation when
+ * the sphere is small and far away, which for float builds means distant
+ * raindrops simply vanish. Following Haines et al. (Ray Tracing Gems, ch. 7)
+ * the discriminant is taken from the distance between the centre and the
+ * ray's closest approach instead, and the near root is found without
+ * subtracting two nearly equal numbers.
+ */
+bool sphere::nearest_root(const ray& r, real_t t_min, real_t t_max, real_t& root) const
 {
-    position relpos = r.origin() - _centre;
+    ++thread_stats().intersection_tests;
+
+    const position relpos = r.origin() - _centre;
     const real_t a = r.dir().length2();
+    const real_t inv_a = 1 / a;
     const real_t half_b = dot(relpos, r.dir());
-    const real_t c = relpos.length2() - _radius*_radius;
+    const real_t r2 = _radius*_radius;
 
-    const real_t discriminant = half_b*half_b - a*c;
+    const direction l = relpos - (half_b * inv_a) * r.dir();
+    const real_t discriminant = r2 - l.length2();
     if (discriminant < 0)
         return false;
 
-    const real_t sqrtd = std::sqrt(discriminant);
+    const real_t c = relpos.length2() - r2;
+    const real_t q = -half_b - std::copysign(std::sqrt(a * discriminant), half_b);
+    const real_t t0 = c / q;
+    const real_t t1 = q * inv_a;
 
     // Find the nearest root that lies in the acceptable range.
-    real_t root = (-half_b - sqrtd) / a;
+    root = t0 < t1 ? t0 : t1;
     if (root < t_min || root > t_max)
     {
-        root = (-half_b + sqrtd) / a;
+        root = t0 > t1 ? t0 : t1;
         if (root < t_min || root > t_max)
             return false;
     }
 
-    rec.t = root;
-    rec.p = r.at(root);
+    return true;
+}
+
+bool sphere::intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const
+{
+    real_t root;
+    if (!nearest_root(r, t_min, t_max, root))
+        return false;
+
+    t_max = root;
+    prim.object = this;
+    prim.index = 0;
+    return true;
+}
+
+void sphere::surface(const ray& r, real_t t, const primitive_ref&, hit_record& rec) const
+{
+    rec.t = t;
+    rec.p = r.at(t);
     direction outward_normal = (rec.p - _centre) / _radius;
     rec.set_face_normal(r, outward_normal);
     rec.mat = _material;
+}
 
-    return true;
+bool sphere::occluded(const ray& r, real_t t_min, real_t t_max) const
+{
+    real_t root;
+    return nearest_root(r, t_min, t_max, root);
+}
+
+aabb sphere::bounding_box() const
+{
+    const direction r(_radius, _radius, _radius);
+    return aabb(_centre - r, _centre + r);
 }
\ No newline at end of file
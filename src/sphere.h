@@ -14,9 +14,15 @@ class sphere : public hittable
 public:
     sphere(const position& centre, real_t radius, const material* mat);
 
-    bool hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const final;
+    bool intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const final;
+    void surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const final;
+    bool occluded(const ray& r, real_t t_min, real_t t_max) const final;
+    aabb bounding_box() const final;
 
 private:
+    // The nearer root in [t_min, t_max], if there is one
+    bool nearest_root(const ray& r, real_t t_min, real_t t_max, real_t& root) const;
+
     position _centre;
     real_t _radius;
     const material* _material;
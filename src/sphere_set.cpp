@@ -0,0 +1,448 @@
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "simd_lanes.h"
+#include "stats.h"
+
+namespace
+{
+
+// One leaf fills an AVX-512 register
+constexpr std::size_t leaf_size = 64 / sizeof(real_t);
+constexpr real_t batched_intersection_cost = 0.25;
+constexpr std::size_t simd_padding = leaf_size;
+
+// Trees whose nodes have grown this much by refitting are rebuilt instead
+constexpr real_t max_refit_growth = 2.0;
+
+/*
+ * All kernels evaluate exactly the same expressions as sphere::hit, in the
+ * same order and without fused multiply-adds (this file is built with
+ * -ffp-contract=off), so every root is bit-identical to the scalar path.
+ */
+
+bool hit_scalar(
+        const sphere_set::arrays& a,
+        std::uint32_t first,
+        std::uint32_t count,
+        const ray& r,
+        real_t t_min,
+        real_t& t_max,
+        std::uint32_t& index)
+{
+    const position& o = r.origin();
+    const direction& d = r.dir();
+    const real_t dd = d.length2();
+    const real_t inv_dd = 1 / dd;
+
+    bool hit_anything = false;
+    for (std::uint32_t i = first; i < first + count; ++i)
+    {
+        const real_t rx = o.x - a.cx[i];
+        const real_t ry = o.y - a.cy[i];
+        const real_t rz = o.z - a.cz[i];
+        const real_t half_b = rx*d.x + ry*d.y + rz*d.z;
+
+        const real_t k = half_b * inv_dd;
+        const real_t lx = rx - k*d.x;
+        const real_t ly = ry - k*d.y;
+        const real_t lz = rz - k*d.z;
+        const real_t discriminant = a.r2[i] - (lx*lx + ly*ly + lz*lz);
+        if (discriminant < 0)
+            continue;
+
+        const real_t c = (rx*rx + ry*ry + rz*rz) - a.r2[i];
+        const real_t q = -half_b - std::copysign(std::sqrt(dd * discriminant), half_b);
+        const real_t t0 = c / q;
+        const real_t t1 = q * inv_dd;
+
+        real_t root = t0 < t1 ? t0 : t1;
+        if (root < t_min || root > t_max)
+        {
+            root = t0 > t1 ? t0 : t1;
+            if (root < t_min || root > t_max)
+                continue;
+        }
+
+        t_max = root;
+        index = i;
+        hit_anything = true;
+    }
+
+    return hit_anything;
+}
+
+#ifdef SIMD_X86
+
+/*
+ * The kernel body, shared by both instruction sets. The attributes on a
+ * template apply to every instantiation, so each instruction set gets its
+ * own thin wrapper below with the matching target and always_inline.
+ */
+// Vector arguments only ever cross inlined calls, so the ABI note is moot
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+template <typename L>
+__attribute__((always_inline)) inline bool hit_lanes(
+        const sphere_set::arrays& a,
+        std::uint32_t first,
+        std::uint32_t count,
+        const ray& r,
+        real_t t_min,
+        real_t& t_max,
+        std::uint32_t& index)
+{
+    using vec = typename L::vec;
+    constexpr std::uint32_t width = L::width;
+
+    const vec ox = L::set1(r.origin().x);
+    const vec oy = L::set1(r.origin().y);
+    const vec oz = L::set1(r.origin().z);
+    const vec dx = L::set1(r.dir().x);
+    const vec dy = L::set1(r.dir().y);
+    const vec dz = L::set1(r.dir().z);
+    const real_t ray_dd = r.dir().length2();
+    const vec dd = L::set1(ray_dd);
+    const vec inv_dd = L::set1(1 / ray_dd);
+    const vec tmin = L::set1(t_min);
+    const vec zero = L::set1(0.0);
+
+    bool hit_anything = false;
+    const std::uint32_t end = first + count;
+    for (std::uint32_t base = first; base < end; base += width)
+    {
+        const vec tmax = L::set1(t_max);
+
+        const vec rx = L::sub(ox, L::load(a.cx + base));
+        const vec ry = L::sub(oy, L::load(a.cy + base));
+        const vec rz = L::sub(oz, L::load(a.cz + base));
+        const vec r2 = L::load(a.r2 + base);
+
+        const vec half_b = L::add(L::add(L::mul(rx, dx), L::mul(ry, dy)), L::mul(rz, dz));
+
+        const vec k = L::mul(half_b, inv_dd);
+        const vec lx = L::sub(rx, L::mul(k, dx));
+        const vec ly = L::sub(ry, L::mul(k, dy));
+        const vec lz = L::sub(rz, L::mul(k, dz));
+        const vec discriminant = L::sub(r2, L::add(L::add(L::mul(lx, lx), L::mul(ly, ly)), L::mul(lz, lz)));
+
+        const std::uint32_t lanes = std::min(width, end - base);
+        const unsigned valid = L::nlt(discriminant, zero) & ((1u << lanes) - 1);
+        if (valid == 0)
+            continue;
+
+        const vec c = L::sub(L::add(L::add(L::mul(rx, rx), L::mul(ry, ry)), L::mul(rz, rz)), r2);
+        const vec q = L::sub(L::negate(half_b), L::copysign(L::sqrt(L::mul(dd, discriminant)), half_b));
+        const vec t0 = L::div(c, q);
+        const vec t1 = L::mul(q, inv_dd);
+
+        // min and max pick their second operand when unordered, as the
+        // scalar ternaries do
+        const vec near = L::min(t0, t1);
+        const vec far = L::max(t0, t1);
+        const unsigned out_near = L::lt(near, tmin) | L::gt(near, tmax);
+        const unsigned out_far = L::lt(far, tmin) | L::gt(far, tmax);
+
+        unsigned mask = valid & ~(out_near & out_far);
+        if (mask == 0)
+            continue;
+
+        alignas(64) real_t near_roots[width];
+        alignas(64) real_t far_roots[width];
+        L::store(near_roots, near);
+        L::store(far_roots, far);
+        for (; mask != 0; mask &= mask - 1)
+        {
+            const int lane = __builtin_ctz(mask);
+            const real_t root = (out_near >> lane) & 1 ? far_roots[lane] : near_roots[lane];
+            if (root <= t_max)
+            {
+                t_max = root;
+                index = base + lane;
+                hit_anything = true;
+            }
+        }
+    }
+
+    return hit_anything;
+}
+
+#pragma GCC diagnostic pop
+
+SIMD_AVX2
+bool hit_avx2(
+        const sphere_set::arrays& a,
+        std::uint32_t first,
+        std::uint32_t count,
+        const ray& r,
+        real_t t_min,
+        real_t& t_max,
+        std::uint32_t& index)
+{
+    return hit_lanes<avx2_lanes>(a, first, count, r, t_min, t_max, index);
+}
+
+SIMD_AVX512
+bool hit_avx512(
+        const sphere_set::arrays& a,
+        std::uint32_t first,
+        std::uint32_t count,
+        const ray& r,
+        real_t t_min,
+        real_t& t_max,
+        std::uint32_t& index)
+{
+    return hit_lanes<avx512_lanes>(a, first, count, r, t_min, t_max, index);
+}
+
+#endif /* SIMD_X86 */
+
+} /* Anonymous namespace */
+
+namespace
+{
+
+sphere_set::element droplet_element(const droplet& d, const material* mat)
+{
+    return { position(d.x, d.y, d.z), d.radius, mat };
+}
+
+} /* Anonymous namespace */
+
+sphere_set::sphere_set(const std::vector<element>& spheres)
+:   _size(spheres.size())
+,   _kernel(select_kernel())
+{
+    const auto sphere = [&] (std::size_t i) -> const element& { return spheres[i]; };
+    _tree = make_tree(_size, sphere);
+    _built_area = _tree.surface_area();
+    fill(sphere);
+}
+
+sphere_set::sphere_set(const droplet* droplets, std::size_t count, const material* mat)
+:   sphere_set(droplets, count, mat, build_tree(droplets, count))
+{
+}
+
+sphere_set::sphere_set(const droplet* droplets, std::size_t count, const material* mat, bvh_tree tree)
+:   _size(count)
+,   _tree(std::move(tree))
+,   _kernel(select_kernel())
+{
+    if (mat == nullptr)
+        throw std::runtime_error("No material set for sphere");
+    if (_tree.order().size() != count)
+        throw std::runtime_error("Tree does not match the droplets");
+
+    _built_area = _tree.surface_area();
+    fill([=] (std::size_t i) { return droplet_element(droplets[i], mat); });
+}
+
+bvh_tree sphere_set::build_tree(const droplet* droplets, std::size_t count)
+{
+    return make_tree(count, [=] (std::size_t i) { return droplet_element(droplets[i], nullptr); });
+}
+
+template <typename ElementFuncT>
+bvh_tree sphere_set::make_tree(std::size_t count, ElementFuncT&& sphere)
+{
+    std::vector<aabb> boxes;
+    boxes.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const element& s = sphere(i);
+        const direction r(s.radius, s.radius, s.radius);
+        boxes.emplace_back(s.centre - r, s.centre + r);
+    }
+
+    return bvh_tree(boxes, leaf_size, batched_intersection_cost);
+}
+
+template <typename ElementFuncT>
+void sphere_set::fill(ElementFuncT&& sphere)
+{
+    const std::size_t padded = _size + simd_padding;
+    _cx.assign(padded, 0.0);
+    _cy.assign(padded, 0.0);
+    _cz.assign(padded, 0.0);
+    _radius.assign(padded, 0.0);
+    _r2.assign(padded, 0.0);
+    _material_index.assign(_size, 0);
+
+    // Lay the arrays out in leaf order so each leaf is one contiguous batch
+    for (std::size_t slot = 0; slot < _size; ++slot)
+    {
+        const element& s = sphere(_tree.order()[slot]);
+        if (s.mat == nullptr)
+            throw std::runtime_error("No material set for sphere");
+
+        _cx[slot] = s.centre.x;
+        _cy[slot] = s.centre.y;
+        _cz[slot] = s.centre.z;
+        _radius[slot] = s.radius;
+        _r2[slot] = s.radius * s.radius;
+
+        auto it = std::find(_materials.begin(), _materials.end(), s.mat);
+        if (it == _materials.end())
+        {
+            if (_materials.size() > std::numeric_limits<std::uint16_t>::max())
+                throw std::runtime_error("Too many materials in sphere set");
+            _materials.push_back(s.mat);
+            it = _materials.end() - 1;
+        }
+        _material_index[slot] = static_cast<std::uint16_t>(it - _materials.begin());
+    }
+}
+
+bool sphere_set::update(const droplet* droplets)
+{
+    const std::vector<std::uint32_t>& order = _tree.order();
+    for (std::size_t slot = 0; slot < _size; ++slot)
+    {
+        const droplet& d = droplets[order[slot]];
+        const real_t radius = d.radius;
+        _cx[slot] = d.x;
+        _cy[slot] = d.y;
+        _cz[slot] = d.z;
+        _radius[slot] = radius;
+        _r2[slot] = radius * radius;
+    }
+
+    _tree.refit([&] (std::uint32_t slot)
+            {
+                const position centre(_cx[slot], _cy[slot], _cz[slot]);
+                const direction r(_radius[slot], _radius[slot], _radius[slot]);
+                return aabb(centre - r, centre + r);
+            });
+
+    if (_tree.surface_area() <= max_refit_growth * _built_area)
+        return false;
+
+    rebuild();
+    return true;
+}
+
+void sphere_set::rebuild()
+{
+    // The new tree puts the spheres in new slots, so their materials must
+    // go with them
+    std::vector<element> spheres(_size);
+    const std::vector<std::uint32_t>& order = _tree.order();
+    for (std::size_t slot = 0; slot < _size; ++slot)
+    {
+        const position centre(_cx[slot], _cy[slot], _cz[slot]);
+        spheres[order[slot]] = { centre, _radius[slot], _materials[_material_index[slot]] };
+    }
+
+    const auto sphere = [&] (std::size_t i) -> const element& { return spheres[i]; };
+    _tree = make_tree(_size, sphere);
+    _built_area = _tree.surface_area();
+    _materials.clear();
+    fill(sphere);
+}
+
+bool sphere_set::intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const
+{
+    const arrays a = { _cx.data(), _cy.data(), _cz.data(), _r2.data() };
+    std::uint32_t index = 0;
+
+    const bool hit_anything = _tree.traverse(r, t_min, t_max,
+            [&] (std::uint32_t first, std::uint32_t count, real_t& closest_so_far)
+            {
+                thread_stats().intersection_tests += count;
+                return _kernel(a, first, count, r, t_min, closest_so_far, index);
+            });
+
+    if (hit_anything)
+    {
+        prim.object = this;
+        prim.index = index;
+    }
+
+    return hit_anything;
+}
+
+// Each leaf the packet reaches is tested against its rays one after
+// another, while its spheres are still in cache
+void sphere_set::intersect_packet(ray_packet& p, std::uint64_t lanes, real_t t_min) const
+{
+    const arrays a = { _cx.data(), _cy.data(), _cz.data(), _r2.data() };
+    std::uint64_t tests = 0;
+
+    _tree.traverse_packet(p, lanes, t_min,
+            [&] (std::uint32_t first, std::uint32_t count, std::uint64_t leaf_lanes)
+            {
+                for (; leaf_lanes; leaf_lanes &= leaf_lanes - 1)
+                {
+                    const int k = __builtin_ctzll(leaf_lanes);
+                    std::uint32_t index;
+                    tests += count;
+                    if (_kernel(a, first, count, p.rays[k], t_min, p.t_max[k], index))
+                    {
+                        p.prims[k].object = this;
+                        p.prims[k].index = index;
+                        p.hits |= std::uint64_t(1) << k;
+                    }
+                }
+            });
+
+    thread_stats().intersection_tests += tests;
+}
+
+void sphere_set::surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const
+{
+    const std::uint32_t index = prim.index;
+    const position centre(_cx[index], _cy[index], _cz[index]);
+    rec.t = t;
+    rec.p = r.at(t);
+    direction outward_normal = (rec.p - centre) / _radius[index];
+    rec.set_face_normal(r, outward_normal);
+    rec.mat = _materials[_material_index[index]];
+}
+
+bool sphere_set::occluded(const ray& r, real_t t_min, real_t t_max) const
+{
+    const arrays a = { _cx.data(), _cy.data(), _cz.data(), _r2.data() };
+    return _tree.any_hit(r, t_min, t_max,
+            [&] (std::uint32_t first, std::uint32_t count)
+            {
+                thread_stats().intersection_tests += count;
+                real_t closest = t_max;
+                std::uint32_t index;
+                return _kernel(a, first, count, r, t_min, closest, index);
+            });
+}
+
+aabb sphere_set::bounding_box() const
+{
+    return _tree.bounding_box();
+}
+
+sphere_set::leaf_kernel sphere_set::select_kernel()
+{
+#ifdef SIMD_X86
+    if (__builtin_cpu_supports("avx512f"))
+        return hit_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return hit_avx2;
+#endif
+    return hit_scalar;
+}
+
+const char* sphere_set::kernel_name()
+{
+    const leaf_kernel k = select_kernel();
+#ifdef SIMD_X86
+    if (k == hit_avx512)
+        return "avx512";
+    if (k == hit_avx2)
+        return "avx2";
+#endif
+    return k == hit_scalar ? "scalar" : "unknown";
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "real_type.h"
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+
+class material;
+
+// Packed droplet record, as stored in scene files
+struct droplet
+{
+    float x, y, z;
+    float radius;
+};
+
+/**
+ * A batch of spheres stored as structure-of-arrays. Spheres are grouped
+ * into BVH leaves that fill one AVX-512 register (8 doubles or 16 floats),
+ * and each leaf is tested against a ray in one go with AVX2/AVX-512 kernels
+ * where the CPU has them. Hits are
+ * bit-for-bit the same as testing each sphere with sphere::hit.
+ */
+class sphere_set : public hittable
+{
+public:
+    struct element
+    {
+        position centre;
+        real_t radius;
+        const material* mat;
+    };
+
+    explicit sphere_set(const std::vector<element>& spheres);
+
+    // count droplets sharing one material
+    sphere_set(const droplet* droplets, std::size_t count, const material* mat);
+
+    // Droplets already in the leaf order of tree, as build_tree() gives it
+    sphere_set(const droplet* droplets, std::size_t count, const material* mat, bvh_tree tree);
+
+    // The tree the constructors above build for these droplets
+    static bvh_tree build_tree(const droplet* droplets, std::size_t count);
+
+    /**
+     * Move the spheres to droplets, indexed like the spheres the set was
+     * made from, keeping their materials. The tree is refit in place, and
+     * only rebuilt once refitting has let it grow well past the size it had
+     * when built. Returns true if it was rebuilt. Storage is reused, so
+     * moving a set every frame allocates nothing until a rebuild.
+     */
+    bool update(const droplet* droplets);
+
+    bool intersect(const ray& r, real_t t_min, real_t& t_max, primitive_ref& prim) const final;
+    void surface(const ray& r, real_t t, const primitive_ref& prim, hit_record& rec) const final;
+    bool occluded(const ray& r, real_t t_min, real_t t_max) const final;
+    void intersect_packet(ray_packet& p, std::uint64_t lanes, real_t t_min) const final;
+    aabb bounding_box() const final;
+
+    std::size_t size() const { return _size; }
+
+    // Name of the intersection kernel picked for this CPU
+    static const char* kernel_name();
+
+    // Arrays in leaf order, padded so a full SIMD load past the end is safe
+    struct arrays
+    {
+        const real_t* cx;
+        const real_t* cy;
+        const real_t* cz;
+        const real_t* r2;
+    };
+
+    using leaf_kernel = bool (*)(
+            const arrays& a,
+            std::uint32_t first,
+            std::uint32_t count,
+            const ray& r,
+            real_t t_min,
+            real_t& t_max,
+            std::uint32_t& index);
+
+    // The fastest leaf kernel this CPU supports. Kernels load whole SIMD
+    // registers from index first onwards, but ignore lanes past count.
+    static leaf_kernel select_kernel();
+
+private:
+    template <typename ElementFuncT>
+    static bvh_tree make_tree(std::size_t count, ElementFuncT&& sphere);
+
+    // Fill the arrays in _tree's leaf order from sphere(i), which returns
+    // element i
+    template <typename ElementFuncT>
+    void fill(ElementFuncT&& sphere);
+
+    void rebuild();
+
+    std::size_t _size;
+    std::vector<real_t> _cx;
+    std::vector<real_t> _cy;
+    std::vector<real_t> _cz;
+    std::vector<real_t> _radius;
+    std::vector<real_t> _r2;
+    std::vector<std::uint16_t> _material_index;
+    std::vector<const material*> _materials;
+    bvh_tree _tree;
+    real_t _built_area = 0.0;   // Of the tree's nodes, when it was last built
+    leaf_kernel _kernel;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,115 @@
+#include "stats.h"
+
+#include <string>
+
+namespace
+{
+
+const char* const material_kind_names[num_material_kinds] = {
+    "lambertian",
+    "metal",
+    "dielectric",
+    "light"
+};
+
+} /* Anonymous namespace */
+
+void render_stats::merge(const render_stats& s)
+{
+    camera_rays += s.camera_rays;
+    rays += s.rays;
+    shadow_rays += s.shadow_rays;
+    medium_scatters += s.medium_scatters;
+    bvh_nodes += s.bvh_nodes;
+    intersection_tests += s.intersection_tests;
+    for (int k = 0; k < num_material_kinds; ++k)
+        hits[k] += s.hits[k];
+    for (std::size_t i = 0; i < path_length_buckets; ++i)
+        path_length[i] += s.path_length[i];
+    escaped += s.escaped;
+    absorbed += s.absorbed;
+    roulette += s.roulette;
+    depth_limit += s.depth_limit;
+    intersect_ticks += s.intersect_ticks;
+    scatter_ticks += s.scatter_ticks;
+    output_ticks += s.output_ticks;
+}
+
+stats_collector::stats_collector()
+:   _total()
+,   _rays(0)
+,   _start_time(clock::now())
+,   _start_ticks(stats_ticks())
+{
+}
+
+void stats_collector::publish()
+{
+    render_stats& local = thread_stats();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _total.merge(local);
+    }
+    _rays.fetch_add(local.rays, std::memory_order_relaxed);
+    local = render_stats();
+}
+
+void stats_collector::add_output_ticks(std::uint64_t ticks)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _total.output_ticks += ticks;
+}
+
+render_stats stats_collector::total() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _total;
+}
+
+double stats_collector::seconds() const
+{
+    return std::chrono::duration<double>(clock::now() - _start_time).count();
+}
+
+double stats_collector::ticks_per_second() const
+{
+    const double s = seconds();
+    return s > 0.0 ? (stats_ticks() - _start_ticks) / s : 1e9;
+}
+
+void write_json(std::ostream& os, const render_stats& s, double ticks_per_second, int indent)
+{
+    const std::string pad(indent + 2, ' ');
+
+    os << "{\n"
+       << pad << "\"camera_rays\": " << s.camera_rays << ",\n"
+       << pad << "\"rays\": " << s.rays << ",\n"
+       << pad << "\"shadow_rays\": " << s.shadow_rays << ",\n"
+       << pad << "\"medium_scatters\": " << s.medium_scatters << ",\n"
+       << pad << "\"bvh_nodes\": " << s.bvh_nodes << ",\n"
+       << pad << "\"intersection_tests\": " << s.intersection_tests << ",\n";
+
+    os << pad << "\"hits\": { ";
+    for (int k = 0; k < num_material_kinds; ++k)
+        os << (k > 0 ? ", " : "") << '"' << material_kind_names[k] << "\": " << s.hits[k];
+    os << " },\n";
+
+    // Trailing empty buckets are left off
+    std::size_t last = path_length_buckets;
+    while (last > 0 && s.path_length[last - 1] == 0)
+        --last;
+    os << pad << "\"path_length\": [";
+    for (std::size_t i = 0; i < last; ++i)
+        os << (i > 0 ? ", " : "") << s.path_length[i];
+    os << "],\n";
+
+    os << pad << "\"terminations\": { \"escaped\": " << s.escaped
+       << ", \"absorbed\": " << s.absorbed
+       << ", \"roulette\": " << s.roulette
+       << ", \"depth_limit\": " << s.depth_limit << " },\n";
+
+    os << pad << "\"seconds\": { \"intersect\": " << s.intersect_ticks / ticks_per_second
+       << ", \"scatter\": " << s.scatter_ticks / ticks_per_second
+       << ", \"output\": " << s.output_ticks / ticks_per_second << " }\n"
+       << std::string(indent, ' ') << '}';
+}
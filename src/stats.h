@@ -0,0 +1,125 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+#include "material.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_HAVE_TSC
+#endif
+
+// Path lengths are counted in surfaces hit; the last bucket collects
+// everything longer
+constexpr std::size_t path_length_buckets = 64;
+
+/**
+ * Counters gathered on the hot path. Every thread has its own copy (see
+ * thread_stats()), so counting is a plain increment. Times are in
+ * stats_ticks() units and are summed over threads.
+ */
+struct render_stats
+{
+    std::uint64_t camera_rays;
+    std::uint64_t rays;                 // Closest-hit queries
+    std::uint64_t shadow_rays;          // Occlusion queries toward lights
+    std::uint64_t medium_scatters;      // Scattering events in media
+    std::uint64_t bvh_nodes;            // Nodes visited
+    std::uint64_t intersection_tests;   // Primitives tested
+    std::uint64_t hits[num_material_kinds];
+    std::uint64_t path_length[path_length_buckets];
+
+    // How paths ended
+    std::uint64_t escaped;              // Missed everything
+    std::uint64_t absorbed;             // Material did not scatter
+    std::uint64_t roulette;             // Killed by Russian roulette
+    std::uint64_t depth_limit;          // Reached --max-depth
+
+    std::uint64_t intersect_ticks;
+    std::uint64_t scatter_ticks;
+    std::uint64_t output_ticks;
+
+    void end_path(std::size_t length)
+    {
+        ++path_length[std::min(length, path_length_buckets - 1)];
+    }
+
+    void merge(const render_stats& s);
+};
+
+// The calling thread's counters. Zero-initialised with no constructor, so
+// access needs no guard.
+inline render_stats& thread_stats()
+{
+    static thread_local render_stats stats;
+    return stats;
+}
+
+// Cheap timestamp for timing hot-path stages: the TSC where there is one
+inline std::uint64_t stats_ticks()
+{
+#ifdef STATS_HAVE_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Reading the clock can cost more than a short stage takes, so per-ray
+// timers time one call in this many and scale the result up
+constexpr std::uint64_t timing_stride = 16;
+
+/**
+ * Collects the counters of all render workers. Each worker publishes its
+ * thread's counters after every tile, so totals are available while the
+ * render is running, and the number of rays traced is readable without a
+ * lock for live throughput reports.
+ */
+class stats_collector
+{
+public:
+    stats_collector();
+
+    stats_collector(const stats_collector&) = delete;
+    stats_collector& operator=(const stats_collector&) = delete;
+
+    // Move the calling thread's counters into the total
+    void publish();
+
+    // Add ticks spent writing the output image
+    void add_output_ticks(std::uint64_t ticks);
+
+    std::uint64_t rays() const { return _rays.load(std::memory_order_relaxed); }
+    render_stats total() const;
+
+    // Wall time since construction
+    double seconds() const;
+
+    // Rate of stats_ticks(), measured against the wall clock
+    double ticks_per_second() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    mutable std::mutex _mutex;
+    render_stats _total;
+    std::atomic<std::uint64_t> _rays;
+    clock::time_point _start_time;
+    std::uint64_t _start_ticks;
+};
+
+/**
+ * Write s as a JSON object, with times converted to seconds. indent is the
+ * indentation of the opening brace's line, for nesting in a larger document.
+ */
+void write_json(std::ostream& os, const render_stats& s, double ticks_per_second, int indent = 0);
+
+#endif
@@ -15,7 +15,7 @@ enum class vec_type
 /**
  * 3D vector class, optimised for POD types
  */
-template <vec_type N, typename T = double>
+template <vec_type N, typename T = real_t>
 class vec3
 {
     template <typename V> using vec_t = vec3<N, V>;
@@ -236,7 +236,7 @@ constexpr bool operator!=(const vec3<N, T>& lhs, const vec3<N, U>& rhs)
     return !(lhs == rhs);
 }
 
-using number_type = double;
+using number_type = real_t;
 
 using position = vec3<vec_type::physical, real_t>;
 using direction = vec3<vec_type::physical, real_t>;
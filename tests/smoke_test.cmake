@@ -0,0 +1,76 @@
+# Smoke tests run by ctest: cmake -DCASE=... -DSIMULATOR=... -DMERGE=...
+# -DCOMPARE=... -DWORK_DIR=... -P smoke_test.cmake
+#
+# Each case renders one row of tiles under the sky at 8 samples per pixel,
+# so it takes about a second:
+#
+#   threads  one thread and three give the same image
+#   merge    two --sample-range partials merged match the whole range
+#   resume   a checkpoint resumed to the full --spp matches an
+#            uninterrupted render
+
+set(RENDER_ARGS --sky --pass-spp 3 --tile-range 38:76 --format pfm)
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+function(run)
+    execute_process(COMMAND ${ARGN}
+        WORKING_DIRECTORY ${WORK_DIR}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE output)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "Failed: ${ARGN}\n${output}")
+    endif()
+    set(output "${output}" PARENT_SCOPE)
+endfunction()
+
+function(expect_same a b)
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${a} ${b}
+        WORKING_DIRECTORY ${WORK_DIR}
+        RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "${a} and ${b} differ")
+    endif()
+endfunction()
+
+if (CASE STREQUAL "threads")
+    set(ENV{OMP_NUM_THREADS} 1)
+    run(${SIMULATOR} ${RENDER_ARGS} --spp 8 -o one.pfm)
+    set(ENV{OMP_NUM_THREADS} 3)
+    run(${SIMULATOR} ${RENDER_ARGS} --spp 8 -o three.pfm)
+    expect_same(one.pfm three.pfm)
+
+elseif (CASE STREQUAL "merge")
+    run(${SIMULATOR} ${RENDER_ARGS} --sample-range 0:3 --partial a.acc)
+    run(${SIMULATOR} ${RENDER_ARGS} --sample-range 3:8 --partial b.acc)
+    run(${SIMULATOR} ${RENDER_ARGS} --spp 8 --partial whole.acc)
+    run(${MERGE} a.acc b.acc --format pfm -o merged.pfm)
+    run(${MERGE} whole.acc --format pfm -o whole.pfm)
+
+    # The sums are single precision, so adding them in two parts rounds
+    # differently from adding them in one
+    run(${COMPARE} whole.pfm merged.pfm --tolerance 1e-5)
+    if (NOT output MATCHES "pixels_over_tolerance 0 ")
+        message(FATAL_ERROR "Merged partials differ from the whole render:\n${output}")
+    endif()
+
+    # The same samples twice must be refused
+    execute_process(COMMAND ${MERGE} a.acc a.acc -o twice.ppm
+        WORKING_DIRECTORY ${WORK_DIR}
+        RESULT_VARIABLE result
+        OUTPUT_QUIET ERROR_QUIET)
+    if (result EQUAL 0)
+        message(FATAL_ERROR "Merging a partial with itself was accepted")
+    endif()
+
+elseif (CASE STREQUAL "resume")
+    run(${SIMULATOR} ${RENDER_ARGS} --spp 8 -o whole.pfm)
+    run(${SIMULATOR} ${RENDER_ARGS} --spp 3 --checkpoint render.ck -o first.pfm)
+    run(${SIMULATOR} ${RENDER_ARGS} --spp 8 --checkpoint render.ck --resume -o resumed.pfm)
+    expect_same(whole.pfm resumed.pfm)
+
+else()
+    message(FATAL_ERROR "Unknown smoke test case: ${CASE}")
+endif()